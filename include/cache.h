@@ -16,6 +16,83 @@ typedef uint64_t lazyfree_key_t;
 struct lazyfree_stats {
     size_t total_pages;
     size_t free_pages;
+
+    // Read path, hits = lookups - misses
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t miss_absent;        // not in the index
+    uint64_t miss_writing;       // write locked
+    uint64_t miss_dropped;       // chunk was dropped since the write
+    uint64_t miss_reclaimed;     // reclaimed by the kernel
+    uint64_t miss_invalidated;   // read_unlock failed: reclaimed, rewritten or dropped while locked
+
+    // Write path
+    uint64_t explicit_drops;     // read_unlock or write_unlock with drop
+    uint64_t chunk_drops;        // capacity evictions, whole chunks
+    uint64_t pages_evicted;      // live pages dropped with them
+    uint64_t pages_evacuated;
+    uint64_t pages_scrubbed;
+    uint64_t madvise_calls;
+    uint64_t bytes_advised;
+    uint64_t maintenance_waits;  // allocations that waited for the maintenance thread
+};
+
+// Which chunk is dropped when the cache is full.
+enum lazyfree_policy {
+    LAZYFREE_POLICY_RANDOM = 0,
+    LAZYFREE_POLICY_FIFO,      // oldest filled chunk
+    LAZYFREE_POLICY_LFU,       // fewest read_lock hits, counters halve on every drop
+    LAZYFREE_POLICY_CLOCK,     // second chance, chunk is referenced by read_lock hits
+    LAZYFREE_POLICY_COUNT,
+};
+
+// Passed as is from the implementation to the cache constructor.
+struct lazyfree_config {
+    // Chunks of each memory kind, at most LAZYFREE_MAX_CHUNKS in total.
+    size_t lazyfree_chunks;
+    size_t anon_chunks;
+    size_t disk_chunks;
+    // Anonymous chunks pushed to swap with MADV_PAGEOUT once full instead of MADV_FREE.
+    // Their pages are never lost, a read of a paged out entry costs a swap-in instead of a refill.
+    size_t swap_chunks;
+    // Chunk size in bytes, 0 means capacity / number of chunks.
+    // If set, the number of chunks is capacity / chunk_size,
+    // and the counts above only give the proportions of each kind.
+    size_t chunk_size;
+    // Lazyfree and anon chunks are 2Mb aligned and MADV_HUGEPAGE,
+    // chunk size is rounded down to a multiple of 2Mb.
+    // MADV_FREE keeps huge pages whole until reclaim, which splits them, so eviction
+    // is still detected per page; a partial MADV_DONTNEED splits them right away.
+    bool huge_pages;
+    // Resize can grow the cache up to this capacity, 0 means no growth.
+    // Index and chunk table are allocated for it up front.
+    size_t max_capacity;
+
+    // Number of independent shards, used by the sharded implementation.
+    size_t shards;
+    // Sharded implementation: read_lock and read_unlock don't take the shard lock,
+    // read_unlock validates the page sequence instead.
+    bool optimistic_reads;
+
+    enum lazyfree_policy policy;
+    // Pages read since their chunk was filled are moved to the front of the
+    // victim chunk instead of being dropped, up to half of the chunk.
+    bool evacuate_hot;
+
+    // read_lock asks mincore if a page of an advised chunk is still resident,
+    // so a reclaimed page is not faulted in just to read its tail.
+    bool residency_check;
+    // Sharded implementation: a background thread scrubs every shard this often, 0 means never.
+    uint32_t scrub_interval_ms;
+
+    // A background thread per cache runs the madvise calls of full chunks, and drops
+    // the next victim once fewer than low_watermark pages are free (0 means half of a chunk),
+    // so writers only take a free page.
+    bool maintenance_thread;
+    size_t low_watermark;
+    // Blank pages are populated with MADV_POPULATE_WRITE ahead of the allocations,
+    // in batches of the current chunk or by the maintenance thread right after a drop.
+    bool prefault;
 };
 
 // ================================= Generic cache =================================
@@ -24,37 +101,73 @@ struct lazyfree_stats {
 #define PAGE_SIZE 4096
 
 // lazyfree_rlock_t is used to read from the page.
+// An entry can span several contiguous pages, see LAZYFREE_ENTRY_CAPACITY.
 typedef struct {
     lazyfree_key_t key;
-    const volatile uint8_t *head; // [0:PAGE_SIZE-1]
-    uint8_t tail;                 // last byte of the page
+    const volatile uint8_t *head; // [0:pages*PAGE_SIZE-1]
+    uint8_t tail;                 // last byte of the entry
 
-    uint8_t __padding[5];
+    uint8_t __padding[11];
+    // Pages of the entry. Set by a successful read_lock, kept on a miss,
+    // so it is also the size write_lock allocates. 0 means 1.
+    uint16_t pages;
+    uint8_t __padding2[2];
 } lazyfree_rlock_t;  
 
+// lazyfree_wlock_t is used to write the page.
+// page is NULL if no page could be allocated, write_unlock is still allowed.
+typedef struct {
+    lazyfree_key_t key;
+    uint8_t *page;                // [0:pages*PAGE_SIZE], pages of the read lock
+
+    uint8_t __padding[16];
+} lazyfree_wlock_t;
+
 // LAZYFREE_LOCK_CHECK returns if lock is still valid.
 // Must be called after reading the payload, to verify the page has not been dropped.
+// Checks the first page only, read_unlock checks all pages of the entry.
 #define LAZYFREE_LOCK_CHECK(lock) ((lock).head[PAGE_SIZE-1] > 0)
 
+// Multi-page entries: the last byte of every page but the last one is reserved
+// by the cache, so an entry of N pages holds LAZYFREE_ENTRY_CAPACITY(N) bytes.
+// Pages are validated all-or-nothing.
+#define LAZYFREE_ENTRY_CAPACITY(pages) ((size_t) (pages) * (PAGE_SIZE - 1) + 1)
+
+// Pages needed for size bytes.
+static inline size_t lazyfree_entry_pages(size_t size);
+
 // lazyfree_read is a helper to safely read from the lock.
 // Returns true if successful.
 static inline bool lazyfree_read(lazyfree_rlock_t* lock, void *dest, size_t offset, size_t size);
 
+// Reads the last size bytes of a single or multi-page entry, skipping the reserved bytes.
+// Returns true if all pages were valid.
+static inline bool lazyfree_read_entry(lazyfree_rlock_t* lock, void *dest, size_t size);
+
+// Writes src as the last size bytes of an entry of the given pages, skipping the reserved bytes.
+static inline void lazyfree_write_entry(uint8_t *page, size_t pages, const void *src, size_t size);
+
 struct lazyfree_impl {
-    lazyfree_cache_t (*new)(size_t cache_size, size_t lazyfree_chunks, size_t anon_chunks, size_t disk_chunks);
+    lazyfree_cache_t (*new)(size_t cache_size, struct lazyfree_config config);
     void (*free)(lazyfree_cache_t cache);
 
     void  (*read_lock)(   lazyfree_cache_t cache, lazyfree_rlock_t* lock);
+    // Same as read_lock for every lock, may be NULL.
+    void  (*read_lock_many)(lazyfree_cache_t cache, lazyfree_rlock_t* locks, size_t count);
     bool  (*read_unlock)( lazyfree_cache_t cache, lazyfree_rlock_t* lock, bool drop);
-    void* (*write_lock)(  lazyfree_cache_t cache, lazyfree_rlock_t* lock);
-    void  (*write_unlock)(lazyfree_cache_t cache, bool drop);
+    lazyfree_wlock_t (*write_lock)(lazyfree_cache_t cache, lazyfree_rlock_t* lock);
+    bool  (*write_unlock)(lazyfree_cache_t cache, lazyfree_wlock_t* lock, bool drop);
 
     // == Extra API ==
-    struct lazyfree_stats (*stats)(lazyfree_cache_t cache, bool verbose);
+    // Doesn't print, may be NULL.
+    struct lazyfree_stats (*stats)(lazyfree_cache_t cache);
+    // Debug output of every call, may be NULL. Not thread-safe, set it before readers start.
+    void (*set_verbose)(lazyfree_cache_t cache, bool verbose);
+    bool (*resize)(lazyfree_cache_t cache, size_t cache_size);
+    // Removes up to max_pages reclaimed pages from the index, returns the number removed.
+    size_t (*scrub)(lazyfree_cache_t cache, size_t max_pages);
 
-    size_t lazyfree_chunks;
-    size_t anon_chunks;
-    size_t disk_chunks;
+    struct lazyfree_config config;
 };
 
 // ================================ Implementations ================================
@@ -68,17 +181,38 @@ struct lazyfree_impl lazyfree_anon_impl();
 // Creates files in ./tmp folder for storage
 struct lazyfree_impl lazyfree_disk_impl();
 
+// Pages full chunks out to swap, for entries that are expensive to refill
+struct lazyfree_impl lazyfree_swap_impl();
+
 // Stores no data, returns only invalid read locks
 struct lazyfree_impl lazyfree_stub_impl();
 
+// Thread-safe, routes keys to independent lazyfree caches
+struct lazyfree_impl lazyfree_sharded_impl();
+
+// Bulk copy of lazyfree_read, picked on the first call: AVX2, SSE2 or a byte loop.
+typedef void (*lazyfree_copy_t)(void *dest, const volatile uint8_t *src, size_t size);
+extern lazyfree_copy_t lazyfree_copy;
+
+// Shorter reads are copied inline, byte by byte.
+#define LAZYFREE_COPY_INLINE 16
+
 // Inline implementation for better performance.
 static inline bool lazyfree_read(lazyfree_rlock_t* lock, void *dest, size_t offset, size_t size){
     if (!LAZYFREE_LOCK_CHECK(*lock)) {
         return false;
     }
-    
-    for (size_t i = 0; i < size && offset + i < PAGE_SIZE; ++i) {
-        ((uint8_t*)dest)[i] = lock->head[offset + i];
+
+    size_t len = offset >= PAGE_SIZE ? 0 : size < PAGE_SIZE - offset ? size : PAGE_SIZE - offset;
+    if (len < LAZYFREE_COPY_INLINE) {
+        for (size_t i = 0; i < len; ++i) {
+            ((uint8_t*)dest)[i] = lock->head[offset + i];
+        }
+    } else {
+        // The copy uses plain loads, they stay between the two checks
+        __asm__ volatile("" ::: "memory");
+        lazyfree_copy(dest, lock->head + offset, len);
+        __asm__ volatile("" ::: "memory");
     }
 
     if (offset + size == PAGE_SIZE) {
@@ -87,7 +221,71 @@ static inline bool lazyfree_read(lazyfree_rlock_t* lock, void *dest, size_t offs
     return LAZYFREE_LOCK_CHECK(*lock);
 }
 
+static inline size_t lazyfree_entry_pages(size_t size) {
+    if (size <= PAGE_SIZE) {
+        return 1;
+    }
+    return (size - 1 + PAGE_SIZE - 2) / (PAGE_SIZE - 1);
+}
+
+// Payload byte q of an entry is at (q / (PAGE_SIZE-1)) * PAGE_SIZE + q % (PAGE_SIZE-1),
+// except the very last one, which is the last byte of the last page.
+static inline bool lazyfree_read_entry(lazyfree_rlock_t* lock, void *dest, size_t size) {
+    size_t pages = lock->pages ? lock->pages : 1;
+    if (size == 0 || size > LAZYFREE_ENTRY_CAPACITY(pages)) {
+        return false;
+    }
+    if (pages == 1) {
+        return lazyfree_read(lock, dest, PAGE_SIZE - size, size);
+    }
+    if (!LAZYFREE_LOCK_CHECK(*lock)) {
+        return false;
+    }
+
+    uint8_t *out = dest;
+    size_t pos = LAZYFREE_ENTRY_CAPACITY(pages) - size;
+    for (size_t left = size - 1; left > 0; ) {
+        size_t offset = pos % (PAGE_SIZE - 1);
+        size_t len = PAGE_SIZE - 1 - offset < left ? PAGE_SIZE - 1 - offset : left;
+        lazyfree_copy(out, lock->head + pos / (PAGE_SIZE - 1) * PAGE_SIZE + offset, len);
+        out += len;
+        pos += len;
+        left -= len;
+    }
+    *out = lock->tail;
+
+    for (size_t i = 0; i < pages; ++i) {
+        if (lock->head[i * PAGE_SIZE + PAGE_SIZE - 1] == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void lazyfree_write_entry(uint8_t *page, size_t pages, const void *src, size_t size) {
+    if (pages <= 1) {
+        memcpy(page + PAGE_SIZE - size, src, size);
+        return;
+    }
+    assert(size > 0 && size <= LAZYFREE_ENTRY_CAPACITY(pages));
+
+    const uint8_t *in = src;
+    size_t pos = LAZYFREE_ENTRY_CAPACITY(pages) - size;
+    for (size_t left = size - 1; left > 0; ) {
+        size_t offset = pos % (PAGE_SIZE - 1);
+        size_t len = PAGE_SIZE - 1 - offset < left ? PAGE_SIZE - 1 - offset : left;
+        memcpy(page + pos / (PAGE_SIZE - 1) * PAGE_SIZE + offset, in, len);
+        in += len;
+        pos += len;
+        left -= len;
+    }
+    page[pages * PAGE_SIZE - 1] = *in;
+}
+
+// Default number of chunks, the cache drops one chunk at a time.
 #define NUMBER_OF_CHUNKS 32
-static_assert(NUMBER_OF_CHUNKS < (1 << 7), "Too many chunks");
+// Chunk index is int16_t in the entry descriptor.
+#define LAZYFREE_MAX_CHUNKS INT16_MAX
+static_assert(NUMBER_OF_CHUNKS <= LAZYFREE_MAX_CHUNKS, "Too many chunks");
 
 #endif
@@ -8,14 +8,22 @@
 
 typedef void (*ft_refill_t)(void *opaque, uint64_t key, uint8_t *value);
 
+// Fills values[i * entry_size] for every keys[i] with one call to the ground truth.
+typedef void (*ft_refill_batch_t)(void *opaque, const uint64_t *keys, size_t count, uint8_t *values);
+
 struct fallthrough_cache {
     struct lazyfree_impl impl;
     void *cache;
 
     ft_refill_t refill_cb;
+    ft_refill_batch_t refill_batch_cb;  // optional, gets refill_opaque too
     void *refill_opaque;
    
     uint64_t entry_size;
+    size_t entry_pages;  // entries larger than a page span several, see LAZYFREE_ENTRY_CAPACITY
+    size_t slab_size;    // slab class, 0 if every entry has its own page
+    size_t slab_slots;   // entries per slab page
+    size_t capacity;   // entries, changed by ft_cache_resize
 };
 
 typedef struct fallthrough_cache ft_cache_t; 
@@ -25,6 +33,25 @@ void ft_cache_init(ft_cache_t *cache, struct lazyfree_impl impl,
                    ft_refill_t refill_cb, void *refill_opaque,
                    size_t capacity, size_t entry_size);
 
+// Slab classes, an entry takes a slot of the smallest class that fits.
+// A slab page starts with a directory of used slots, then the slots.
+#define FT_SLAB_CLASSES { 64, 256, 1024 }
+#define FT_SLAB_DIRECTORY sizeof(uint64_t)
+
+// Entries per page for entry_size, 1 if no slab class fits.
+size_t ft_slab_slots(size_t entry_size);
+
+// Same as ft_cache_init, but packs small entries into slab pages.
+// Keys k / slots share a page, so dense keys fill the pages, and a page
+// is evicted or reclaimed with all its entries. Memory is capacity / slots pages.
+void ft_cache_init_slab(ft_cache_t *cache, struct lazyfree_impl impl,
+                        ft_refill_t refill_cb, void *refill_opaque,
+                        size_t capacity, size_t entry_size);
+
+// Registers a batch refill next to refill_cb of an initialized cache.
+// ft_cache_get_many and the refill engine then fetch their misses in batches.
+void ft_cache_set_refill_batch(ft_cache_t *cache, ft_refill_batch_t refill_batch_cb);
+
 void ft_cache_destroy(ft_cache_t *cache);
 
 // Get value from the cache, or refill it.
@@ -32,10 +59,35 @@ void ft_cache_get(ft_cache_t *cache,
                   lazyfree_key_t key, 
                   uint8_t *value);
 
+// Returns true and the value if the key is cached, never refills.
+bool ft_cache_peek(ft_cache_t *cache, lazyfree_key_t key, uint8_t *value);
+
+// Caches a value refilled elsewhere, replacing the cached one.
+void ft_cache_put(ft_cache_t *cache, lazyfree_key_t key, const uint8_t *value);
+
+// Fetches the keys from the ground truth without caching them, with one
+// refill_batch_cb call if it is registered, else one refill_cb call per key.
+void ft_cache_refill_many(ft_cache_t *cache, const lazyfree_key_t *keys, size_t count, uint8_t *values);
+
+// Keys of one window of ft_cache_get_many.
+#define FT_BATCH 64
+
+// Same as ft_cache_get for every key, values are entry_size bytes each.
+// Index and page accesses of a window are prefetched together when
+// the implementation has read_lock_many, then the misses are refilled in order,
+// all misses of a window with one call when refill_batch_cb is registered.
+void ft_cache_get_many(ft_cache_t *cache, const lazyfree_key_t *keys, size_t count, uint8_t *values);
+
 // Drop the key from the cache. Returns true if existed.
 bool ft_cache_drop(ft_cache_t *cache, lazyfree_key_t key);
 
-// Print debug info and remember verbosity.
+// Change capacity of a live cache, false if not supported or not reached.
+bool ft_cache_resize(ft_cache_t *cache, size_t capacity);
+
+// Remove up to max_entries reclaimed entries from the index, returns the number removed.
+size_t ft_cache_scrub(ft_cache_t *cache, size_t max_entries);
+
+// Print debug info and set verbosity, not while other threads use the cache.
 void ft_cache_debug(ft_cache_t *cache, bool verbose);
                 
 #endif
@@ -21,40 +21,77 @@ void lazyfree_cache_free(lazyfree_cache_t cache);
 // Take an optimistic read lock.
 void lazyfree_read_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock);
 
+// Keys of one lookup window of lazyfree_read_lock_many.
+#define LAZYFREE_BATCH 32
+
+// Same as read_lock for every lock, but the index and page accesses of
+// LAZYFREE_BATCH keys are prefetched before any of them is validated.
+void lazyfree_read_lock_many(lazyfree_cache_t cache, lazyfree_rlock_t* locks, size_t count);
+
 // Returns true if read session was valid.
 // Returns false if the key was evicted and all reads must be discarded.
 // If drop is true, drops the page.
 bool lazyfree_read_unlock(lazyfree_cache_t cache, lazyfree_rlock_t* lock, bool drop);
 
 // ================================ Write Lock API ===============================
-// Only one page can be locked for write at the time.
+// Any number of pages can be locked for write, each lock is a separate handle.
 // There are two ways to get a write lock:
+//  - Upgrade a valid read lock, the page keeps its contents.
+//  - Pass a read lock with head == NULL or a failed one, a new page will be allocated.
+// lock.pages sets the entry size, a successful read_lock sets it to the size found.
+// An entry of several pages is allocated contiguously in one chunk, at most half of it,
+// write it with lazyfree_write_entry so the reserved bytes are skipped.
 
 
 // Aquire the write lock.
-// If lock is NULL, a new page will be allocated.
-
-void* lazyfree_write_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock);
+// wlock.page is NULL if every chunk has open write locks.
+// Until unlock, reads of the key miss.
+lazyfree_wlock_t lazyfree_write_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock);
 
 // If drop is true, drops the page.
-void lazyfree_write_unlock(lazyfree_cache_t cache, bool drop);
+// Returns true if the page is now visible to readers.
+// Returns false if dropped, or if a later write of the same key replaced it.
+bool lazyfree_write_unlock(lazyfree_cache_t cache, lazyfree_wlock_t* lock, bool drop);
 
 // ================================ Behavior details =============================
 // If the cache is full, it will start evicting random chunks.
 //
 // Provides RWLock semantics:
 //  Can lock any number of pages for read.
-//  Can lock only one page for write.
+//  Can lock any number of pages for write.
+//  Chunks with open write locks are not evicted.
 //
 // Must call all functions from the critical section.
+// Exception: read_lock and read_unlock without drop may run concurrently
+// with one writer thread. Every slot has a sequence number, read_unlock returns
+// false if the page was written, reused or dropped after read_lock.
 
 // ================================ Extra API ===================================
 
 // Crete cache with custom memory implementation.
-lazyfree_cache_t lazyfree_cache_new_ex(size_t cache_capacity, size_t lazyfree_chunks, size_t anon_chunks, size_t disk_chunks);
+lazyfree_cache_t lazyfree_cache_new_ex(size_t cache_capacity, struct lazyfree_config config);
+
+// Change capacity of a live cache, in whole chunks.
+// Shrinking retires chunks with the fewest live pages and releases their memory,
+// entries in other chunks stay valid. Growing revives retired chunks first,
+// then maps new ones, up to config.max_capacity.
+// Returns false if the target could not be reached.
+bool lazyfree_cache_resize(lazyfree_cache_t cache, size_t new_capacity);
+
+// Pages checked by one mincore call of lazyfree_cache_scrub.
+#define LAZYFREE_SCRUB_BATCH 1024
+
+// Scans up to max_pages slots of advised chunks with mincore, continuing from the last call,
+// and releases the reclaimed ones to the free lists without touching them.
+// Returns the number of pages released.
+size_t lazyfree_cache_scrub(lazyfree_cache_t cache, size_t max_pages);
+
+// Returns page counts and event counters. Doesn't print.
+// Read path counters cost one increment of a per-thread cache line.
+struct lazyfree_stats lazyfree_fetch_stats(lazyfree_cache_t cache);
 
-// Returns stats and remembers verbosity.
-struct lazyfree_stats lazyfree_fetch_stats(lazyfree_cache_t cache, bool verbose);
+// Debug output of every call. Readers test it without a lock, set it before they start.
+void lazyfree_set_verbose(lazyfree_cache_t cache, bool verbose);
 
 // Run tests.
 void lazyfree_cache_tests();
@@ -0,0 +1,70 @@
+#ifndef PRESSURE_MONITOR_H
+#define PRESSURE_MONITOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fallthrough_cache.h"
+
+// Gives memory back before the kernel reclaims pages at random.
+//
+// Watches memory pressure and shrinks the cache with ft_cache_resize,
+// so the chunks with the fewest live pages are released first.
+// Grows back one step at a time once pressure is gone.
+//
+// Sources, all optional:
+//  - PSI trigger on memory.pressure of the cgroup, or /proc/pressure/memory.
+//    If a trigger can't be created, avg10 is sampled instead.
+//  - cgroup v2 memory.events: high, max and oom counters.
+//  - cgroup v2 memory.current against memory.high or memory.max.
+
+#define PRESSURE_DEFAULT_STALL_US 100000
+#define PRESSURE_DEFAULT_WINDOW_US 1000000
+#define PRESSURE_DEFAULT_AVG10 10.0
+#define PRESSURE_DEFAULT_RELAX_MS 10000
+#define PRESSURE_DEFAULT_STEPS 8
+
+// Zero fields mean defaults.
+struct pressure_config {
+    const char *cgroup_path;   // cgroup v2 directory, NULL means the cgroup of this process
+    uint32_t stall_us;         // PSI trigger: "some" stall in a window
+    uint32_t window_us;
+    double avg10;              // sampled mode: "some avg10" threshold, percent
+    uint32_t relax_ms;         // no pressure this long to grow back a step
+    uint32_t steps;            // capacity changes by 1/steps of the initial capacity
+    uint32_t min_steps;        // never shrink below min_steps/steps, default 1
+};
+
+struct pressure_stats {
+    size_t capacity;           // entries
+    size_t shrinks;
+    size_t grows;
+    size_t events;             // pressure observed
+    bool psi;
+    bool psi_trigger;
+    bool cgroup;
+};
+
+struct pressure_monitor;
+
+// Initial capacity of the cache is the maximum.
+struct pressure_monitor* pressure_monitor_new(ft_cache_t *cache, struct pressure_config config);
+
+// Stops the background thread, if any.
+void pressure_monitor_free(struct pressure_monitor *monitor);
+
+// Checks all sources, waiting up to timeout_ms for an event.
+// Must be called from the thread that owns the cache.
+// Returns true if capacity changed.
+bool pressure_monitor_poll(struct pressure_monitor *monitor, int timeout_ms);
+
+// Polls from a background thread. The cache implementation must be thread-safe.
+void pressure_monitor_start(struct pressure_monitor *monitor);
+
+// Applies one observation, poll calls it. Returns true if capacity changed.
+bool pressure_monitor_update(struct pressure_monitor *monitor, bool pressure, double now_ms);
+
+struct pressure_stats pressure_monitor_stats(struct pressure_monitor *monitor);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef REFILL_ENGINE_H
+#define REFILL_ENGINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fallthrough_cache.h"
+
+// Runs the refills of a ft_cache_t on a pool of worker threads.
+//
+// Misses of one key share a single refill: the first one queues it,
+// the others join it while it is in flight. The worker installs the value
+// with ft_cache_put and then completes every waiter of the key.
+// With a refill_batch_cb registered, a worker takes up to batch queued keys
+// and fetches them with one call.
+// The cache implementation must be thread-safe, e.g. lazyfree_sharded_impl.
+
+#define REFILL_DEFAULT_WORKERS 4
+#define REFILL_DEFAULT_BATCH 32
+
+// Zero fields mean defaults.
+struct refill_config {
+    size_t workers;
+    size_t batch;              // keys per refill_batch_cb call, at most FT_BATCH
+};
+
+struct refill_stats {
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t refills;          // keys refilled
+    uint64_t joined;           // misses that waited on a refill in flight
+    uint64_t batches;          // calls to the ground truth
+};
+
+// Called from a worker once value is filled.
+typedef void (*refill_done_t)(void *opaque, lazyfree_key_t key, uint8_t *value);
+
+struct refill_engine;
+
+struct refill_engine* refill_engine_new(ft_cache_t *cache, struct refill_config config);
+
+// Finishes the queued refills and stops the workers.
+void refill_engine_free(struct refill_engine *engine);
+
+// Returns true and the value on a hit, done is not called.
+// On a miss returns false, value must stay valid until done is called.
+bool refill_engine_get(struct refill_engine *engine, lazyfree_key_t key, uint8_t *value,
+                       refill_done_t done, void *opaque);
+
+// Same as ft_cache_get, but concurrent misses of the key wait for one refill.
+void refill_engine_get_sync(struct refill_engine *engine, lazyfree_key_t key, uint8_t *value);
+
+struct refill_stats refill_engine_stats(struct refill_engine *engine);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef SHARDED_CACHE_H
+#define SHARDED_CACHE_H
+
+#include <stdint.h>
+
+#include "cache.h"
+
+// Thread-safe front end over N independent lazyfree caches.
+// Keys are routed to shards by hash, every shard has its own lock.
+//
+// Read locks only hold the shard lock inside the call,
+// read_unlock returns false if the page was reused in between.
+// With config.optimistic_reads they don't take the lock at all:
+// a page written or evicted while locked fails read_unlock, same as kernel eviction.
+// Write locks take the shard lock only inside the calls,
+// any number of them can be held by any threads.
+// With config.scrub_interval_ms a background thread scrubs every shard,
+// one LAZYFREE_SCRUB_BATCH under the shard lock at a time.
+
+#define LAZYFREE_DEFAULT_SHARDS 16
+
+lazyfree_cache_t sharded_cache_new(size_t /*cache_size*/, struct lazyfree_config /*config*/);
+void sharded_cache_free(lazyfree_cache_t /*cache*/);
+
+// == Read Lock API ==
+
+void sharded_cache_read_lock(lazyfree_cache_t /*cache*/, lazyfree_rlock_t* /*lock*/);
+bool sharded_cache_read_unlock(lazyfree_cache_t /*cache*/, lazyfree_rlock_t* /*lock*/, bool /*drop*/);
+
+// == Write Lock API ==
+
+lazyfree_wlock_t sharded_cache_write_lock(lazyfree_cache_t /*cache*/, lazyfree_rlock_t* /*lock*/);
+bool sharded_cache_write_unlock(lazyfree_cache_t /*cache*/, lazyfree_wlock_t* /*lock*/, bool /*drop*/);
+
+// == Extra API ==
+
+struct lazyfree_stats sharded_cache_stats(lazyfree_cache_t /*cache*/);
+void sharded_cache_set_verbose(lazyfree_cache_t /*cache*/, bool /*verbose*/);
+
+// Resizes shards one at a time, the others keep serving.
+bool sharded_cache_resize(lazyfree_cache_t /*cache*/, size_t /*cache_size*/);
+
+// Scrubs max_pages / shards pages of every shard.
+size_t sharded_cache_scrub(lazyfree_cache_t /*cache*/, size_t /*max_pages*/);
+
+#endif
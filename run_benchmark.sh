@@ -9,7 +9,7 @@ run_test() {
     # CMD="gdb -ex run --args $CMD"
     docker run  -it --rm \
                 --memory-reservation "$4"G \
-                --memory-swap        "$5"G \
+                --memory-swap        "${6:-$5}"G \
                 --memory             "$5"G \
                 --oom-score-adj=-900        \
                 lazyfree_cache /bin/sh -c "$CMD"
@@ -17,9 +17,10 @@ run_test() {
                 # --oom-kill-disable \
                 # --memory-swappiness=0 \
 }
-#        impl     capacity  reclaim soft_limit  hard_limit
+#        impl     capacity  reclaim soft_limit  hard_limit  [memory+swap]
 run_test lazyfree 8         4       8.25         8.5
 run_test disk     8         6       8.25         8.5
+run_test swap     8         6       8.25         8.5         10.5
 run_test anon     2         6       8.25         8.5
 run_test stub     8         6       8.25         8.5
 
@@ -9,5 +9,13 @@ make build/test
 
 ./build/test anon 1
 ./build/test disk 2
+./build/test sharded 1
+./build/test sharded_optimistic 1
+./build/test policies 1
+./build/test pressure 1
+./build/test huge 1
+./build/test async 1
+./build/test slab 1
+./build/test large 1
 
 echo "\n===\nAll tests passed"
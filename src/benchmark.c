@@ -1,18 +1,310 @@
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 
 #include "cache.h"
 #include "fallthrough_cache.h"
+#include "pressure_monitor.h"
 
 #include "testlib.h"
 
 
+#define SET_SIZE (8*G)
+#define DEFAULT_HOT_FACTOR 3
+
+// BENCHMARK_SAMPLES=<path> dumps the latency of every measured lookup as CSV
+static void open_samples(const char *suffix) {
+    const char *path = getenv("BENCHMARK_SAMPLES");
+    if (path == NULL) {
+        return;
+    }
+    char full[512];
+    snprintf(full, sizeof(full), "%s%s", path, suffix);
+    testlib_samples = fopen(full, "w");
+    if (testlib_samples == NULL) {
+        perror(full);
+        exit(1);
+    }
+    fprintf(testlib_samples, "set,hit,ns\n");
+}
+
+static bool init_impl(const char *name, size_t capacity_bytes, struct lazyfree_impl *impl) {
+    if (strcmp(name, "lazyfree") == 0 || strcmp(name, "lazyfree_slab") == 0) {
+        *impl = lazyfree_impl();
+    } else if (strcmp(name, "lazyfree_huge") == 0) {
+        *impl = lazyfree_impl();
+        impl->config.huge_pages = true;
+    } else if (strcmp(name, "disk") == 0) {
+        *impl = lazyfree_disk_impl();
+    } else if (strcmp(name, "swap") == 0) {
+        *impl = lazyfree_swap_impl();
+    } else if (strcmp(name, "anon") == 0) {
+        *impl = lazyfree_anon_impl();
+    } else if (strcmp(name, "stub") == 0) {
+        *impl = lazyfree_stub_impl();
+    } else if (strcmp(name, "sharded") == 0 || strcmp(name, "sharded_psi") == 0) {
+        *impl = lazyfree_sharded_impl();
+        impl->config.max_capacity = capacity_bytes;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static struct hot_cold_report run_report(struct lazyfree_impl impl, const char *name,
+                                         size_t capacity_bytes, size_t reclaim_bytes, int factor_hot) {
+    ft_cache_t cache;
+    if (strcmp(name, "lazyfree_slab") == 0) {
+        // Same memory, packed entries
+        size_t slots = ft_slab_slots(sizeof(uint64_t));
+        ft_cache_init_slab(&cache, impl, refill_cb, NULL, capacity_bytes/PAGE_SIZE*slots, sizeof(uint64_t));
+    } else {
+        ft_cache_init(&cache, impl, refill_cb, NULL, capacity_bytes/PAGE_SIZE, sizeof(uint64_t));
+    }
+
+    // Shrinks the cache before the reclaim hits it
+    struct pressure_monitor *monitor = NULL;
+    if (strcmp(name, "sharded_psi") == 0) {
+        monitor = pressure_monitor_new(&cache, (struct pressure_config){0});
+        pressure_monitor_start(monitor);
+    }
+    
+    struct hot_cold_report report = run_hot_cold(&cache, SET_SIZE, factor_hot, reclaim_bytes);
+    printf("\n== Report %s, policy=%s, capacity=%.2fGb, reclaim=%.2fGb, hot_factor=%d ==\n", name,
+           testlib_policy_names[impl.config.policy], (float) capacity_bytes/G, (float) reclaim_bytes/G,
+           factor_hot);
+    
+    testlib_print_report(report.hot_before_reclaim, "hot_before_reclaim");
+    testlib_print_report(report.cold_before_reclaim, "cold_before_reclaim");
+
+    printf("reclaim_latency=%.2fms\n", report.reclaim_latency);
+    printf("anon_huge_pages=%zuMb before reclaim, %zuMb after\n",
+           report.anon_huge_before_reclaim/M, report.anon_huge_after_reclaim/M);
+
+    testlib_print_report(report.hot_after_reclaim, "hot_after_reclaim");
+    testlib_print_report(report.cold_after_reclaim, "cold_after_reclaim");
+    if (monitor != NULL) {
+        struct pressure_stats stats = pressure_monitor_stats(monitor);
+        printf("pressure: events=%zu shrinks=%zu grows=%zu capacity=%zuMb psi=%d cgroup=%d\n",
+               stats.events, stats.shrinks, stats.grows, stats.capacity*PAGE_SIZE/M,
+               stats.psi, stats.cgroup);
+        pressure_monitor_free(monitor);
+    }
+    printf("\n");
+    
+    ft_cache_destroy(&cache);
+    return report;
+}
+
+// == Sweep ==
+
+#define SWEEP_MAX_POINTS 32
+
+// Comma separated, returns the count or 0 if one is not a number.
+static size_t parse_list(const char *arg, float *values) {
+    size_t count = 0;
+    const char *pos = arg;
+    while (true) {
+        if (count == SWEEP_MAX_POINTS) {
+            // Input left after the last value that fits
+            return 0;
+        }
+        char *end;
+        values[count++] = strtof(pos, &end);
+        if (end == pos || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        pos = end + 1;
+    }
+    return count;
+}
+
+// memory.max of the cgroup (the container), or MemTotal.
+static size_t memory_limit() {
+    char buf[64];
+    FILE *file = fopen("/sys/fs/cgroup/memory.max", "r");
+    if (file != NULL) {
+        bool ok = fgets(buf, sizeof(buf), file) != NULL;
+        fclose(file);
+        if (ok && strncmp(buf, "max", 3) != 0) {
+            return strtoull(buf, NULL, 10);
+        }
+    }
+    file = fopen("/proc/meminfo", "r");
+    if (file == NULL) {
+        return SIZE_MAX;
+    }
+    size_t kb = SIZE_MAX / K;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "MemTotal: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb * K;
+}
+
+// Hitrate of an ideal cache of the given number of entries that keeps the hot set first.
+static void max_hitrates(size_t entries, float *hot, float *cold) {
+    size_t hot_entries = HOT_COLD_HOT_SIZE / PAGE_SIZE;
+    size_t cold_entries = (SET_SIZE - HOT_COLD_HOT_SIZE - HOT_COLD_JUNK_SIZE) / PAGE_SIZE;
+    *hot = entries >= hot_entries ? 1 : (float) entries / hot_entries;
+    entries = entries > hot_entries ? entries - hot_entries : 0;
+    *cold = entries >= cold_entries ? 1 : (float) entries / cold_entries;
+}
+
+// Runs the point in a fresh process, so the previous ones leave no mappings or page cache state.
+// Its log goes to stderr, stdout is kept for the CSV.
+static bool run_point(struct lazyfree_impl impl, const char *name, size_t capacity_bytes,
+                      size_t reclaim_bytes, int factor_hot, struct hot_cold_report *report) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        random_rotate();
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), ".%.2f_%.2f_%d", (float) capacity_bytes/G, (float) reclaim_bytes/G,
+                 factor_hot);
+        open_samples(suffix);
+        struct hot_cold_report child = run_report(impl, name, capacity_bytes, reclaim_bytes, factor_hot);
+        fflush(stdout);
+        bool ok = write(fds[1], &child, sizeof(child)) == sizeof(child);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    bool ok = read(fds[0], report, sizeof(*report)) == sizeof(*report);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int sweep_main(int argc, char** argv) {
+    if (argc < 5) {
+        printf("Usage: %s sweep <impl> <capacities_gb> <reclaims_gb> [hot_factors=3] [policy]\n", argv[0]);
+        printf("Lists are comma separated, e.g. %s sweep lazyfree 1,2,4 0,1,2,3 1,3,7\n", argv[0]);
+        printf("Prints CSV, one forked run per point, the log goes to stderr\n");
+        return 1;
+    }
+    const char *name = argv[2];
+    float capacities[SWEEP_MAX_POINTS], reclaims[SWEEP_MAX_POINTS], factors[SWEEP_MAX_POINTS];
+    size_t capacities_cnt = parse_list(argv[3], capacities);
+    size_t reclaims_cnt = parse_list(argv[4], reclaims);
+    size_t factors_cnt = 1;
+    factors[0] = DEFAULT_HOT_FACTOR;
+    if (argc > 5) {
+        factors_cnt = parse_list(argv[5], factors);
+    }
+    if (capacities_cnt == 0 || reclaims_cnt == 0 || factors_cnt == 0) {
+        printf("Lists must be comma separated numbers, at most %d each\n", SWEEP_MAX_POINTS);
+        return 1;
+    }
+    for (size_t i = 0; i < capacities_cnt; ++i) {
+        if (capacities[i] < 0.5) {
+            printf("Capacity must be at least 0.5Gb\n");
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < factors_cnt; ++i) {
+        if (factors[i] < 1) {
+            printf("Hot factor must be at least 1\n");
+            return 1;
+        }
+    }
+
+    struct lazyfree_impl impl;
+    if (!init_impl(name, 0, &impl)) {
+        printf("Unknown impl: %s\n", name);
+        return 1;
+    }
+    const char *policy = argc > 6 ? argv[6] : "random";
+    impl.config.policy = testlib_parse_policy(policy);
+    if (impl.config.policy == LAZYFREE_POLICY_COUNT) {
+        printf("Unknown policy: %s\n", policy);
+        return 1;
+    }
+
+    size_t limit = memory_limit();
+    size_t slots = strcmp(name, "lazyfree_slab") == 0 ? ft_slab_slots(sizeof(uint64_t)) : 1;
+    fprintf(stderr, "Memory limit %zuMb\n", limit/M);
+
+    printf("impl,policy,capacity_gb,reclaim_gb,hot_factor,"
+           "hot_hitrate_before,hot_max_before,cold_hitrate_before,cold_max_before,"
+           "hot_hitrate_after,hot_max_after,cold_hitrate_after,cold_max_after,"
+           "hot_latency_before_ns,cold_latency_before_ns,hot_latency_after_ns,cold_latency_after_ns,"
+           "hot_after_hit_p99_ns,hot_after_miss_p99_ns,cold_after_hit_p99_ns,cold_after_miss_p99_ns,"
+           "reclaim_ms\n");
+    size_t failed = 0;
+    for (size_t c = 0; c < capacities_cnt; ++c) {
+        for (size_t r = 0; r < reclaims_cnt; ++r) {
+            for (size_t f = 0; f < factors_cnt; ++f) {
+                size_t capacity_bytes = capacities[c] * G;
+                size_t reclaim_bytes = reclaims[r] * G;
+                int factor_hot = factors[f];
+                init_impl(name, capacity_bytes, &impl);
+                impl.config.policy = testlib_parse_policy(policy);
+
+                struct hot_cold_report report;
+                if (!run_point(impl, name, capacity_bytes, reclaim_bytes, factor_hot, &report)) {
+                    fprintf(stderr, "Point capacity=%.2fGb reclaim=%.2fGb hot_factor=%d failed\n",
+                            capacities[c], reclaims[r], factor_hot);
+                    failed++;
+                    continue;
+                }
+
+                // The reclaim leaves the cache what is under the limit
+                size_t kept = limit > reclaim_bytes ? limit - reclaim_bytes : 0;
+                kept = kept < capacity_bytes ? kept : capacity_bytes;
+                float hot_max_before, cold_max_before, hot_max_after, cold_max_after;
+                max_hitrates(capacity_bytes / PAGE_SIZE * slots, &hot_max_before, &cold_max_before);
+                max_hitrates(kept / PAGE_SIZE * slots, &hot_max_after, &cold_max_after);
+
+                printf("%s,%s,%.2f,%.2f,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.1f,%.1f,%.1f,%.1f,%lu,%lu,%lu,%lu,%.2f\n",
+                       name, policy, capacities[c], reclaims[r], factor_hot,
+                       report.hot_before_reclaim.hitrate, hot_max_before,
+                       report.cold_before_reclaim.hitrate, cold_max_before,
+                       report.hot_after_reclaim.hitrate, hot_max_after,
+                       report.cold_after_reclaim.hitrate, cold_max_after,
+                       report.hot_before_reclaim.latency_ns, report.cold_before_reclaim.latency_ns,
+                       report.hot_after_reclaim.latency_ns, report.cold_after_reclaim.latency_ns,
+                       report.hot_after_reclaim.hits.p99, report.hot_after_reclaim.misses.p99,
+                       report.cold_after_reclaim.hits.p99, report.cold_after_reclaim.misses.p99,
+                       report.reclaim_latency);
+                fflush(stdout);
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "sweep") == 0) {
+        return sweep_main(argc, argv);
+    }
     if (argc < 4) {
-        printf("Usage: %s <impl> <capacity_gb> <reclaim_gb>\n", argv[0]);       
-        printf("Impls: lazyfree, normal, anon, stub\n");
+        printf("Usage: %s <impl> <capacity_gb> <reclaim_gb> [policy]\n", argv[0]);
+        printf("       %s sweep <impl> <capacities_gb> <reclaims_gb> [hot_factors] [policy]\n", argv[0]);
+        printf("Impls: lazyfree, lazyfree_huge, lazyfree_slab, disk, swap, anon, stub, sharded, sharded_psi\n");
+        printf("Policies: random, fifo, lfu, clock, all (default random)\n");
         return 1;
     }
     float capacity_gb = atof(argv[2]);
@@ -30,37 +322,40 @@ int main(int argc, char** argv) {
     size_t reclaim_bytes = reclaim_gb * G;
     
     struct lazyfree_impl impl;
-    if (strcmp(argv[1], "lazyfree") == 0) {
-        impl = lazyfree_impl();
-    } else if (strcmp(argv[1], "disk") == 0) {
-        impl = lazyfree_disk_impl();
-    } else if (strcmp(argv[1], "anon") == 0) {
-        impl = lazyfree_anon_impl();
-    } else if (strcmp(argv[1], "stub") == 0) {
-        impl = lazyfree_stub_impl();
-    } else {
+    if (!init_impl(argv[1], capacity_bytes, &impl)) {
         printf("Unknown impl: %s\n", argv[1]);
         return 1;
     }
 
-    random_rotate();
+    const char *policy = argc > 4 ? argv[4] : "random";
+    bool all_policies = strcmp(policy, "all") == 0;
+    if (!all_policies) {
+        impl.config.policy = testlib_parse_policy(policy);
+        if (impl.config.policy == LAZYFREE_POLICY_COUNT) {
+            printf("Unknown policy: %s\n", policy);
+            return 1;
+        }
+    }
 
-    ft_cache_t cache;
-    ft_cache_init(&cache, impl, refill_cb, NULL, capacity_bytes/PAGE_SIZE, sizeof(uint64_t));
-    
-    struct hot_cold_report report = run_hot_cold(&cache, 8*G, reclaim_bytes);
-    printf("\n== Report %s, capacity=%zuGb, reclaim=%zuGb ==\n", argv[1], capacity_bytes/G, reclaim_bytes/G);
-    
-    testlib_print_report(report.hot_before_reclaim, "hot_before_reclaim");
-    testlib_print_report(report.cold_before_reclaim, "cold_before_reclaim");
+    random_rotate();
+    open_samples("");
 
-    printf("reclaim_latency=%.2fms\n", report.reclaim_latency);
+    if (!all_policies) {
+        run_report(impl, argv[1], capacity_bytes, reclaim_bytes, DEFAULT_HOT_FACTOR);
+        return 0;
+    }
 
-    testlib_print_report(report.hot_after_reclaim, "hot_after_reclaim");
-    testlib_print_report(report.cold_after_reclaim, "cold_after_reclaim");
-    printf("\n");
-    
-    ft_cache_destroy(&cache);
+    struct hot_cold_report reports[LAZYFREE_POLICY_COUNT];
+    for (size_t i = 0; i < LAZYFREE_POLICY_COUNT; ++i) {
+        impl.config.policy = i;
+        reports[i] = run_report(impl, argv[1], capacity_bytes, reclaim_bytes, DEFAULT_HOT_FACTOR);
+    }
+    printf("== Hot set hitrate by policy ==\n");
+    for (size_t i = 0; i < LAZYFREE_POLICY_COUNT; ++i) {
+        printf("policy=%-6s hot_before_reclaim_hitrate=%.2f hot_after_reclaim_hitrate=%.2f\n",
+               testlib_policy_names[i], reports[i].hot_before_reclaim.hitrate,
+               reports[i].hot_after_reclaim.hitrate);
+    }
 }
 
 
@@ -21,16 +21,22 @@ inline struct lazyfree_impl lazyfree_impl() {
         .free = lazyfree_cache_free,
 
         .read_lock = lazyfree_read_lock,
+        .read_lock_many = lazyfree_read_lock_many,
         .read_unlock = lazyfree_read_unlock,
 
         .write_lock = lazyfree_write_lock,
         .write_unlock = lazyfree_write_unlock,
 
         .stats = lazyfree_fetch_stats,
+        .set_verbose = lazyfree_set_verbose,
+        .resize = lazyfree_cache_resize,
+        .scrub = lazyfree_cache_scrub,
     
-        .lazyfree_chunks = NUMBER_OF_CHUNKS,
-        .anon_chunks = 0,
-        .disk_chunks = 0,
+        .config = {
+            .lazyfree_chunks = NUMBER_OF_CHUNKS,
+            .anon_chunks = 0,
+            .disk_chunks = 0,
+        },
     };    
     return impl;
 }
@@ -38,15 +44,23 @@ inline struct lazyfree_impl lazyfree_impl() {
 // Anonymous storage is the same: no MADV_FREE, no lock failures.
 inline struct lazyfree_impl lazyfree_anon_impl() {
     struct lazyfree_impl impl = lazyfree_impl();
-    impl.lazyfree_chunks = 0;
-    impl.anon_chunks = NUMBER_OF_CHUNKS;
+    impl.config.lazyfree_chunks = 0;
+    impl.config.anon_chunks = NUMBER_OF_CHUNKS;
     return impl;
 }
 
 // Store pages in files.
 inline struct lazyfree_impl lazyfree_disk_impl() {
     struct lazyfree_impl impl = lazyfree_impl();
-    impl.lazyfree_chunks = 0;
-    impl.disk_chunks = NUMBER_OF_CHUNKS;
+    impl.config.lazyfree_chunks = 0;
+    impl.config.disk_chunks = NUMBER_OF_CHUNKS;
+    return impl;
+}
+
+// Full chunks go to swap (or zram) instead of being discardable.
+inline struct lazyfree_impl lazyfree_swap_impl() {
+    struct lazyfree_impl impl = lazyfree_impl();
+    impl.config.lazyfree_chunks = 0;
+    impl.config.swap_chunks = NUMBER_OF_CHUNKS;
     return impl;
 }
@@ -8,58 +8,323 @@
 #include "cache.h"
 
 
-void ft_cache_init(struct fallthrough_cache *cache, struct lazyfree_impl impl, 
-                   ft_refill_t refill_cb, void *refill_opaque,
-                   size_t num_entries, size_t entry_size) {
-    assert(entry_size <= PAGE_SIZE);
+// Smallest slab class for entry_size, 0 if none fits.
+static size_t slab_class(size_t entry_size) {
+    static const size_t classes[] = FT_SLAB_CLASSES;
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        if (entry_size <= classes[i]) {
+            return classes[i];
+        }
+    }
+    return 0;
+}
+
+size_t ft_slab_slots(size_t entry_size) {
+    size_t size = slab_class(entry_size);
+    return size ? (PAGE_SIZE - FT_SLAB_DIRECTORY) / size : 1;
+}
+
+// Pages that hold num_entries entries.
+static size_t entries_pages(ft_cache_t* cache, size_t num_entries) {
+    if (cache->slab_size) {
+        return (num_entries + cache->slab_slots - 1) / cache->slab_slots;
+    }
+    return num_entries * cache->entry_pages;
+}
+
+static size_t pages_entries(ft_cache_t* cache, size_t num_pages) {
+    if (cache->slab_size) {
+        return num_pages * cache->slab_slots;
+    }
+    return num_pages / cache->entry_pages;
+}
+
+static void init(struct fallthrough_cache *cache, struct lazyfree_impl impl,
+                 ft_refill_t refill_cb, void *refill_opaque,
+                 size_t num_entries, size_t entry_size, size_t slab_size) {
     memset(cache, 0, sizeof(*cache));
     cache->impl = impl;
     cache->entry_size = entry_size;
+    cache->entry_pages = lazyfree_entry_pages(entry_size);
+    cache->slab_size = slab_size;
+    cache->slab_slots = ft_slab_slots(entry_size);
     cache->refill_cb = refill_cb;
     cache->refill_opaque = refill_opaque;
+    cache->capacity = num_entries;
 
-    cache->cache = impl.new(num_entries*PAGE_SIZE, impl.lazyfree_chunks, impl.anon_chunks, impl.disk_chunks);
+    cache->cache = impl.new(entries_pages(cache, num_entries)*PAGE_SIZE, impl.config);
     assert(cache->cache != NULL);
 }
 
+void ft_cache_init(struct fallthrough_cache *cache, struct lazyfree_impl impl, 
+                   ft_refill_t refill_cb, void *refill_opaque,
+                   size_t num_entries, size_t entry_size) {
+    init(cache, impl, refill_cb, refill_opaque, num_entries, entry_size, 0);
+}
+
+void ft_cache_init_slab(struct fallthrough_cache *cache, struct lazyfree_impl impl,
+                        ft_refill_t refill_cb, void *refill_opaque,
+                        size_t num_entries, size_t entry_size) {
+    init(cache, impl, refill_cb, refill_opaque, num_entries, entry_size, slab_class(entry_size));
+}
+
+void ft_cache_set_refill_batch(struct fallthrough_cache *cache, ft_refill_batch_t refill_batch_cb) {
+    cache->refill_batch_cb = refill_batch_cb;
+}
+
 void ft_cache_destroy(struct fallthrough_cache* cache) {
     cache->impl.free(cache->cache);
 }
 
+// == Slab pages ==
+
+static size_t slab_offset(ft_cache_t* cache, uint64_t slot) {
+    return FT_SLAB_DIRECTORY + slot * cache->slab_size;
+}
+
+// Reads the entry of a locked page, returns false on a miss.
+static bool slab_read_locked(ft_cache_t* cache, lazyfree_rlock_t* lock, uint64_t slot, uint8_t *value) {
+    assert(lock->head != NULL);
+    if (!LAZYFREE_LOCK_CHECK(*lock)) {
+        return false;
+    }
+    // Page found, the entry may be not
+    uint64_t directory;
+    bool ok = lazyfree_read(lock, &directory, 0, sizeof(directory));
+    ok = ok && (directory >> slot & 1);
+    ok = ok && lazyfree_read(lock, value, slab_offset(cache, slot), cache->entry_size);
+    return cache->impl.read_unlock(cache->cache, lock, false) && ok;
+}
+
+// Writes the entry over the read lock of its page.
+static void slab_install(ft_cache_t* cache, lazyfree_rlock_t* lock, uint64_t slot, const uint8_t *value) {
+    // Upgrade keeps the other entries of the page, a new page has none
+    lazyfree_wlock_t wlock = cache->impl.write_lock(cache->cache, lock);
+    if (wlock.page == NULL) {
+        return;
+    }
+    uint64_t directory = 0;
+    if (wlock.page == (const uint8_t*) lock->head) {
+        memcpy(&directory, wlock.page, sizeof(directory));
+    }
+    directory |= 1ull << slot;
+    memcpy(wlock.page, &directory, sizeof(directory));
+    memcpy(wlock.page + slab_offset(cache, slot), value, cache->entry_size);
+    cache->impl.write_unlock(cache->cache, &wlock, false);
+}
+
+static void slab_get(ft_cache_t* cache, uint64_t key, uint8_t *value) {
+    uint64_t slot = key % cache->slab_slots;
+    lazyfree_rlock_t lock = { .key = key / cache->slab_slots };
+    cache->impl.read_lock(cache->cache, &lock);
+    if (slab_read_locked(cache, &lock, slot, value)) {
+        return;
+    }
+
+    // Cache miss
+    cache->refill_cb(cache->refill_opaque, key, value);
+    slab_install(cache, &lock, slot, value);
+}
+
+// Clears the slot, the page is dropped with its last entry.
+static bool slab_drop(ft_cache_t* cache, uint64_t key) {
+    uint64_t slot = key % cache->slab_slots;
+    lazyfree_rlock_t lock = { .key = key / cache->slab_slots };
+    cache->impl.read_lock(cache->cache, &lock);
+    if (!LAZYFREE_LOCK_CHECK(lock)) {
+        return false;
+    }
+    uint64_t directory;
+    if (!lazyfree_read(&lock, &directory, 0, sizeof(directory)) || !(directory >> slot & 1) ||
+        !cache->impl.read_unlock(cache->cache, &lock, false)) {
+        return false;
+    }
+
+    lazyfree_wlock_t wlock = cache->impl.write_lock(cache->cache, &lock);
+    if (wlock.page != (const uint8_t*) lock.head) {
+        // Page is gone, so is the entry
+        cache->impl.write_unlock(cache->cache, &wlock, true);
+        return false;
+    }
+    memcpy(&directory, wlock.page, sizeof(directory));
+    directory &= ~(1ull << slot);
+    memcpy(wlock.page, &directory, sizeof(directory));
+    cache->impl.write_unlock(cache->cache, &wlock, directory == 0);
+    return true;
+}
+
+// == Fallthrough API ==
+
+// Reads a locked entry, returns false on a miss.
+static bool read_locked(ft_cache_t* cache, lazyfree_rlock_t* lock, uint8_t *value) {
+    assert(lock->head != NULL);
+    if (!LAZYFREE_LOCK_CHECK(*lock)) {
+        return false;
+    }
+    // Found, all pages of the entry are checked
+    bool ok = lazyfree_read_entry(lock, value, cache->entry_size);
+
+    // Unlock fails if the page was dropped or reused while reading
+    return cache->impl.read_unlock(cache->cache, lock, false) && ok;
+}
+
+// Writes the entry over its read lock.
+static void install(ft_cache_t* cache, lazyfree_rlock_t* lock, const uint8_t *value) {
+    // Write lock, an entry of another size is replaced
+    lock->pages = cache->entry_pages;
+    lazyfree_wlock_t wlock = cache->impl.write_lock(cache->cache, lock);
+    if (wlock.page == NULL) {
+        // No page available, value is returned uncached
+        return;
+    }
+    lazyfree_write_entry(wlock.page, cache->entry_pages, value, cache->entry_size); // Write to the end of the entry
+    cache->impl.write_unlock(cache->cache, &wlock, false);
+}
+
+// Refills the value of a missed read lock and caches it.
+static void refill(ft_cache_t* cache, lazyfree_rlock_t* lock, uint8_t *value) {
+    cache->refill_cb(cache->refill_opaque, lock->key, value);
+    install(cache, lock, value);
+}
+
 void ft_cache_get(ft_cache_t* cache, uint64_t key, uint8_t *value) {
-    lazyfree_rlock_t lock;
-    lock.key = key;
+    if (cache->slab_size) {
+        slab_get(cache, key, value);
+        return;
+    }
+    lazyfree_rlock_t lock = { .key = key, .pages = cache->entry_pages };
     cache->impl.read_lock(cache->cache, &lock);
-    assert(lock.head != NULL);
-    if (LAZYFREE_LOCK_CHECK(lock)) {
-        // Found
-        
-        lazyfree_read(&lock, value, PAGE_SIZE-cache->entry_size, cache->entry_size);
-        
-        if (LAZYFREE_LOCK_CHECK(lock)) {
-            // Check successful
-            cache->impl.read_unlock(cache->cache, &lock, false);
-            return;
+    if (read_locked(cache, &lock, value)) {
+        return;
+    }
+    refill(cache, &lock, value);
+}
+
+bool ft_cache_peek(ft_cache_t* cache, uint64_t key, uint8_t *value) {
+    if (cache->slab_size) {
+        lazyfree_rlock_t lock = { .key = key / cache->slab_slots };
+        cache->impl.read_lock(cache->cache, &lock);
+        return slab_read_locked(cache, &lock, key % cache->slab_slots, value);
+    }
+    lazyfree_rlock_t lock = { .key = key, .pages = cache->entry_pages };
+    cache->impl.read_lock(cache->cache, &lock);
+    return read_locked(cache, &lock, value);
+}
+
+void ft_cache_put(ft_cache_t* cache, uint64_t key, const uint8_t *value) {
+    lazyfree_rlock_t lock = {
+        .key = cache->slab_size ? key / cache->slab_slots : key,
+        .pages = cache->slab_size ? 1 : cache->entry_pages,
+    };
+    // A valid lock is upgraded in place
+    cache->impl.read_lock(cache->cache, &lock);
+    if (cache->slab_size) {
+        slab_install(cache, &lock, key % cache->slab_slots, value);
+    } else {
+        install(cache, &lock, value);
+    }
+}
+
+void ft_cache_refill_many(ft_cache_t* cache, const uint64_t *keys, size_t count, uint8_t *values) {
+    if (cache->refill_batch_cb != NULL) {
+        cache->refill_batch_cb(cache->refill_opaque, keys, count, values);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        cache->refill_cb(cache->refill_opaque, keys[i], values + i * cache->entry_size);
+    }
+}
+
+// Fetches the misses of a window with one batch refill, then installs them in one pass.
+static void refill_batch(ft_cache_t* cache, const uint64_t *keys, lazyfree_rlock_t *locks, const bool *hits,
+                         size_t count, uint8_t *values, uint8_t *scratch) {
+    uint64_t miss_keys[FT_BATCH];
+    size_t misses = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!hits[i]) {
+            miss_keys[misses++] = keys[i];
         }
+    }
+    if (misses == 0) {
+        return;
+    }
+    cache->refill_batch_cb(cache->refill_opaque, miss_keys, misses, scratch);
 
-        printf("\nFALLTHROUGH READ LOCK CHECK FAILED\n");
-        exit(1);
+    size_t miss = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (hits[i]) {
+            continue;
+        }
+        uint8_t *value = values + i * cache->entry_size;
+        memcpy(value, scratch + miss++ * cache->entry_size, cache->entry_size);
+        if (cache->slab_size) {
+            // An earlier install of the batch could have rewritten the page
+            ft_cache_put(cache, keys[i], value);
+        } else {
+            install(cache, &locks[i], value);
+        }
     }
+}
 
-    // Cache miss
-    cache->refill_cb(cache->refill_opaque, key, value);
+void ft_cache_get_many(ft_cache_t* cache, const uint64_t *keys, size_t count, uint8_t *values) {
+    lazyfree_rlock_t locks[FT_BATCH];
+    bool hits[FT_BATCH];
+    uint8_t *scratch = NULL;
+    if (cache->refill_batch_cb != NULL) {
+        scratch = malloc(FT_BATCH * cache->entry_size);
+        assert(scratch != NULL);
+    }
+    for (size_t start = 0; start < count; start += FT_BATCH) {
+        size_t batch_count = count - start < FT_BATCH ? count - start : FT_BATCH;
+        for (size_t i = 0; i < batch_count; ++i) {
+            uint64_t key = keys[start + i];
+            locks[i] = (lazyfree_rlock_t){
+                .key = cache->slab_size ? key / cache->slab_slots : key,
+                .pages = cache->slab_size ? 1 : cache->entry_pages,
+            };
+        }
+        if (cache->impl.read_lock_many != NULL) {
+            cache->impl.read_lock_many(cache->cache, locks, batch_count);
+        } else {
+            for (size_t i = 0; i < batch_count; ++i) {
+                cache->impl.read_lock(cache->cache, &locks[i]);
+            }
+        }
 
-    // Write lock
-    uint8_t *page = cache->impl.write_lock(cache->cache, &lock);
-    memcpy(page+PAGE_SIZE-cache->entry_size, value, cache->entry_size); // Write to the end of the page
-    cache->impl.write_unlock(cache->cache, false);
+        // All hits are read before the first refill writes
+        for (size_t i = 0; i < batch_count; ++i) {
+            uint8_t *value = values + (start + i) * cache->entry_size;
+            hits[i] = cache->slab_size ? slab_read_locked(cache, &locks[i], keys[start + i] % cache->slab_slots, value)
+                                       : read_locked(cache, &locks[i], value);
+        }
+        if (scratch != NULL) {
+            refill_batch(cache, keys + start, locks, hits, batch_count,
+                         values + start * cache->entry_size, scratch);
+            continue;
+        }
+        for (size_t i = 0; i < batch_count; ++i) {
+            if (hits[i]) {
+                continue;
+            }
+            uint8_t *value = values + (start + i) * cache->entry_size;
+            if (cache->slab_size) {
+                // An earlier refill of the batch could have rewritten the page
+                slab_get(cache, keys[start + i], value);
+            } else {
+                refill(cache, &locks[i], value);
+            }
+        }
+    }
+    free(scratch);
 }
 
 
 bool ft_cache_drop(ft_cache_t* cache, 
                             uint64_t key) {
-    lazyfree_rlock_t lock;
-    lock.key = key;
+    if (cache->slab_size) {
+        return slab_drop(cache, key);
+    }
+    lazyfree_rlock_t lock = { .key = key, .pages = cache->entry_pages };
     cache->impl.read_lock(cache->cache, &lock);
     if (LAZYFREE_LOCK_CHECK(lock)) {
         cache->impl.read_unlock(cache->cache, &lock, true);
@@ -68,9 +333,50 @@ bool ft_cache_drop(ft_cache_t* cache,
     return false;
 }
                   
+bool ft_cache_resize(ft_cache_t* cache, size_t num_entries) {
+    if (cache->impl.resize == NULL) {
+        return false;
+    }
+    if (cache->impl.resize(cache->cache, entries_pages(cache, num_entries)*PAGE_SIZE)) {
+        cache->capacity = num_entries;
+        return true;
+    }
+    // Partial resize: keep the size the cache actually ended up with
+    if (cache->impl.stats != NULL) {
+        cache->capacity = pages_entries(cache, cache->impl.stats(cache->cache).total_pages);
+    }
+    return false;
+}
+
+size_t ft_cache_scrub(ft_cache_t* cache, size_t max_entries) {
+    if (cache->impl.scrub == NULL) {
+        return 0;
+    }
+    return cache->impl.scrub(cache->cache, entries_pages(cache, max_entries));
+}
+
 void ft_cache_debug(ft_cache_t* cache, bool verbose) {
-    struct lazyfree_stats stats = cache->impl.stats(cache->cache, verbose);
+    if (cache->impl.stats == NULL) {
+        printf("Lazyfree stats: not supported\n");
+        return;
+    }
+    if (cache->impl.set_verbose != NULL) {
+        cache->impl.set_verbose(cache->cache, verbose);
+    }
+    struct lazyfree_stats stats = cache->impl.stats(cache->cache);
     printf("Lazyfree stats: total_pages=%zu, free_pages=%zu\n", 
            stats.total_pages, stats.free_pages);
+    double hitrate = stats.lookups ? (double) stats.hits / stats.lookups * 100 : 0;
+    printf("  lookups=%" PRIu64 " hits=%" PRIu64 " (%.2f%%)\n", stats.lookups, stats.hits, hitrate);
+    printf("  misses: absent=%" PRIu64 " writing=%" PRIu64 " dropped=%" PRIu64
+           " reclaimed=%" PRIu64 " invalidated=%" PRIu64 "\n",
+           stats.miss_absent, stats.miss_writing, stats.miss_dropped,
+           stats.miss_reclaimed, stats.miss_invalidated);
+    printf("  explicit_drops=%" PRIu64 " chunk_drops=%" PRIu64 " pages_evicted=%" PRIu64
+           " pages_evacuated=%" PRIu64 " pages_scrubbed=%" PRIu64 "\n",
+           stats.explicit_drops, stats.chunk_drops, stats.pages_evicted,
+           stats.pages_evacuated, stats.pages_scrubbed);
+    printf("  madvise_calls=%" PRIu64 " advised=%" PRIu64 "Mb maintenance_waits=%" PRIu64 "\n",
+           stats.madvise_calls, stats.bytes_advised / (1024*1024), stats.maintenance_waits);
 }
 
@@ -1,6 +1,9 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,7 +18,7 @@
 #include "lazyfree_cache.h"
 
 #include "util.h"
-#include "hashmap.h"
+#include "u64map.h"
 #include "bitset.h"
 #include "random.h"
 
@@ -30,9 +33,11 @@ struct discardable_entry {
 static_assert(sizeof(struct discardable_entry) == PAGE_SIZE, "Discardable entry size is not equal to page size");
 
 
+// No epoch since the index packs descriptors into 32 bits (see hmap_pack): an entry of a
+// dropped chunk is told apart by its index past the chunk's len, readers check the epoch at unlock.
 struct entry_descriptor {
     uint32_t index;
-    int8_t chunk;
+    int16_t chunk;
 };
 static_assert(sizeof(struct entry_descriptor) == 8, "entry_descriptor size is not 8 bytes");
 
@@ -41,13 +46,31 @@ typedef struct {
     volatile uint8_t *head;     // [0:PAGE_SIZE-1]
     uint8_t tail;      // last byte of the page
 
-    int8_t _chunk;
-    uint16_t _index;
+    uint8_t _padding;
+    int16_t _chunk;
+    uint32_t _index;
+    uint32_t _seq;     // slot sequence at read_lock
+    uint16_t pages;    // entry pages, public
+    uint16_t _epoch;   // chunk epoch at read_lock
 } rlock_impl_t;
-static_assert(sizeof(rlock_impl_t) == 24, "rlock_impl_t size is not 24 bytes");
-static_assert(sizeof(lazyfree_rlock_t) == 24, "lazyfree_rlock_t size is not 24 bytes");
+static_assert(sizeof(rlock_impl_t) == 32, "rlock_impl_t size is not 32 bytes");
+static_assert(sizeof(lazyfree_rlock_t) == 32, "lazyfree_rlock_t size is not 32 bytes");
 static_assert(offsetof(lazyfree_rlock_t, head) == offsetof(rlock_impl_t, head), "lazyfree_rlock_t and rlock_impl_t have different head offsets");
 static_assert(offsetof(lazyfree_rlock_t, tail) == offsetof(rlock_impl_t, tail), "lazyfree_rlock_t and rlock_impl_t have different tail offsets");
+static_assert(offsetof(lazyfree_rlock_t, pages) == offsetof(rlock_impl_t, pages), "lazyfree_rlock_t and rlock_impl_t have different pages offsets");
+
+typedef struct {
+    lazyfree_key_t key;
+    uint8_t *page;     // [0:PAGE_SIZE]
+
+    int16_t _chunk;
+    uint8_t _padding[2];
+    uint32_t _index;
+    uint8_t _padding2[8];
+} wlock_impl_t;
+static_assert(sizeof(wlock_impl_t) == 32, "wlock_impl_t size is not 32 bytes");
+static_assert(sizeof(lazyfree_wlock_t) == 32, "lazyfree_wlock_t size is not 32 bytes");
+static_assert(offsetof(lazyfree_wlock_t, page) == offsetof(wlock_impl_t, page), "lazyfree_wlock_t and wlock_impl_t have different page offsets");
 
 static struct entry_descriptor  EMPTY_DESC = { .chunk = -1 };
 
@@ -57,75 +80,333 @@ struct chunk {
     mmap_impl_t mmap_impl;
     struct discardable_entry* entries; // anonymous mmap size=CHUNK_SIZE
     bitset_t bit0;                     // malloc size=PAGES_PER_CHUNK/8 
+    bitset_t accessed;                 // malloc size=PAGES_PER_CHUNK/8, set by read_lock hits
     uint32_t* free_pages;              // malloc size=PAGES_PER_CHUNK
     lazyfree_key_t* keys;              // malloc size=PAGES_PER_CHUNK
+    uint32_t* seqs;                    // malloc size=PAGES_PER_CHUNK, odd while written
+    uint16_t* spans;                   // malloc size=PAGES_PER_CHUNK, pages of the entry starting here, 0 if none
     uint32_t free_pages_count;
     uint32_t len;
+
+    uint32_t writers;                  // open write locks, chunk can't be dropped
+    bool advise_pending;               // madv_impl is called after the last writer
+    bool advised;                      // MADV_FREE was called, pages may be reclaimed
+
+    uint32_t hits;                     // LFU: read_lock hits, decayed
+    uint8_t referenced;                // CLOCK: hit since the hand passed
+    uint16_t epoch;                    // bumped when the chunk is dropped, see chunk_invalidate
+
+    bool retired;                      // released by resize, keeps its mapping
+    uint8_t queued;                    // jobs in the maintenance thread, an advise and a drop at most
+    uint32_t populated;                // blank pages below are prefaulted
+};
+
+// Read path counters are written by concurrent optimistic readers, so every thread
+// increments its own cache line. Threads beyond READ_SLOTS share lines and may lose increments.
+#define READ_SLOTS 64
+
+struct read_counters {
+    uint64_t lookups;
+    uint64_t absent;
+    uint64_t writing;
+    uint64_t dropped;
+    uint64_t reclaimed;
+    uint64_t invalidated;
+} __attribute__((aligned(64)));
+
+// Written under the writer lock, madvise counters by the maintenance thread too.
+struct write_counters {
+    uint64_t explicit_drops;
+    uint64_t chunk_drops;
+    uint64_t pages_evicted;
+    uint64_t pages_evacuated;
+    uint64_t pages_scrubbed;
+    uint64_t madvise_calls;
+    uint64_t bytes_advised;
+    uint64_t maintenance_waits;
 };
 
 struct lazyfree_cache {
     size_t cache_capacity;
 
-    struct chunk chunks[NUMBER_OF_CHUNKS];
+    struct chunk* chunks;              // malloc size=max_chunks, never moves
+    size_t chunks_count;               // mapped chunks, including retired
+    size_t active_chunks;
+    size_t max_chunks;
     size_t pages_per_chunk;
     size_t chunk_size;
     size_t current_chunk_idx;
 
-    struct hashmap_s map;
-    struct entry_descriptor key0;
+    struct u64map map;
+    uint32_t index_bits;               // page index bits of an index value, the chunk is above
 
     size_t total_free_pages;
+    uint64_t seed;
+
+    enum lazyfree_policy policy;
+    size_t clock_hand;
+    bool evacuate_hot;
+
+    bool residency_check;
+    size_t scrub_chunk;                // scrub cursor
+    uint32_t scrub_index;
+    size_t sweep_slot;                 // index sweep cursor
+    size_t sweep_left;                 // index slots to check since the last chunk drop
+    size_t sweep_budget;               // index slots checked per allocation
+
+    struct maintenance* maintenance;   // NULL without the maintenance thread
+    size_t low_watermark;              // free pages that trigger the next drop
+    size_t prepared_chunk;             // dropped ahead of time, NO_CHUNK if none
+    bool prefault;
 
-    // Write lock state
-    uint32_t wlock_index;
-    int8_t wlock_chunk;
-    lazyfree_key_t wlock_key;
+    struct read_counters* read_counters; // aligned_alloc size=READ_SLOTS
+    struct write_counters write_counters;
 
     bool verbose;
 };
 
-static int exact_key_comparer(const void *a, hashmap_uint32_t a_len,
-                              const void *b, hashmap_uint32_t b_len) {
-    UNUSED(a_len);
-    UNUSED(b_len);
-    return a == b;
+// mmap_impl and madv_impl must be set.
+static void chunk_init(struct lazyfree_cache* cache, struct chunk* chunk) {
+    void *entries = chunk->mmap_impl(cache->chunk_size);
+    assert(entries != MAP_FAILED);
+
+    chunk->entries = entries;
+
+    chunk->bit0 = bitset_new(cache->pages_per_chunk);
+    assert(chunk->bit0 != NULL);
+
+    chunk->accessed = bitset_new(cache->pages_per_chunk);
+    assert(chunk->accessed != NULL);
+    memset(chunk->accessed, 0, (cache->pages_per_chunk + 7) / 8);
+
+    chunk->free_pages = malloc(cache->pages_per_chunk * sizeof(uint32_t));
+    assert(chunk->free_pages != NULL);
+
+    chunk->keys = calloc(cache->pages_per_chunk, sizeof(uint64_t));
+    assert(chunk->keys != NULL);
+
+    chunk->seqs = calloc(cache->pages_per_chunk, sizeof(uint32_t));
+    assert(chunk->seqs != NULL);
+
+    chunk->spans = calloc(cache->pages_per_chunk, sizeof(uint16_t));
+    assert(chunk->spans != NULL);
+}
+
+static void chunk_destroy(struct lazyfree_cache* cache, struct chunk* chunk) {
+    munmap(chunk->entries, cache->chunk_size);
+    bitset_free(chunk->bit0);
+    bitset_free(chunk->accessed);
+    free(chunk->free_pages);
+    free(chunk->keys);
+    free(chunk->seqs);
+    free(chunk->spans);
+}
+
+// == Maintenance thread ==
+// Writers hand the madvise calls of full and dropped chunks to the thread, and take
+// the chunks back once they are done. A queued chunk is not allocated from or written,
+// it can still be picked as a victim: the jobs of a chunk run in order.
+// Both rings have a single producer and a single consumer, writers are serialized by the caller.
+
+#define NO_CHUNK SIZE_MAX
+
+enum job_kind {
+    JOB_ADVISE,                        // madv_impl of a full chunk
+    JOB_DROP,                          // MADV_DONTNEED of a victim past the kept pages
+};
+
+struct job {
+    uint16_t chunk;
+    uint16_t kind;
+    uint32_t keep;
+};
+
+struct job_ring {
+    struct job* jobs;                  // malloc size=mask+1
+    size_t mask;
+    size_t head;                       // consumer
+    size_t tail;                       // producer
+};
+
+struct maintenance {
+    pthread_t thread;
+    sem_t wake;                        // posted once per queued job and on stop
+    bool stop;
+    struct job_ring queued;            // writers -> thread
+    struct job_ring ready;             // thread -> writers
+    size_t pending;                    // queued and not taken back yet, writer side
+};
+
+static void count_madvise(struct lazyfree_cache* cache, size_t bytes);
+
+static void ring_init(struct job_ring* ring, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    ring->jobs = malloc(size * sizeof(struct job));
+    assert(ring->jobs != NULL);
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Rings have room for two jobs of every chunk.
+static void ring_push(struct job_ring* ring, struct job job) {
+    size_t tail = ring->tail;
+    assert(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <= ring->mask);
+    ring->jobs[tail & ring->mask] = job;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool ring_pop(struct job_ring* ring, struct job* job) {
+    size_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *job = ring->jobs[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Touches only the memory of the queued chunks, never the index or the chunk metadata.
+static void* run_maintenance(void* opaque) {
+    struct lazyfree_cache* cache = opaque;
+    struct maintenance* maintenance = cache->maintenance;
+    while (true) {
+        while (sem_wait(&maintenance->wake) != 0) {
+            // EINTR
+        }
+        struct job job;
+        if (!ring_pop(&maintenance->queued, &job)) {
+            // Every job has its own post, so this is the stop
+            if (__atomic_load_n(&maintenance->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+
+        struct chunk* chunk = &cache->chunks[job.chunk];
+        if (job.kind == JOB_DROP) {
+            size_t bytes = cache->chunk_size - (size_t) job.keep * PAGE_SIZE;
+            int ret = madvise(&chunk->entries[job.keep], bytes, MADV_DONTNEED);
+            if (ret != 0) {
+                printf("MADV_DONTNEED failed: %d\n", ret);
+                exit(1);
+            }
+            count_madvise(cache, bytes);
+            if (cache->prefault) {
+                lazyfree_populate(&chunk->entries[job.keep], bytes);
+            }
+        } else {
+            chunk->madv_impl(chunk->entries, cache->chunk_size);
+            count_madvise(cache, cache->chunk_size);
+        }
+        ring_push(&maintenance->ready, job);
+    }
+    return NULL;
 }
 
-static uint32_t hash_u64_to_u32(uint64_t key) {
-    key ^= key >> 33;
-    key *= 0xff51afd7ed558ccdULL;
-    key ^= key >> 33;
-    key *= 0xc4ceb9fe1a85ec53ULL;
-    key ^= key >> 33;
-    return (uint32_t)key; // take the low 32 bits
+static void maintenance_start(struct lazyfree_cache* cache) {
+    struct maintenance* maintenance = calloc(1, sizeof(struct maintenance));
+    assert(maintenance != NULL);
+    sem_init(&maintenance->wake, 0, 0);
+    ring_init(&maintenance->queued, 2 * cache->max_chunks);
+    ring_init(&maintenance->ready, 2 * cache->max_chunks);
+    cache->maintenance = maintenance;
+    pthread_create(&maintenance->thread, NULL, run_maintenance, cache);
 }
 
-static hashmap_uint32_t exact_key_hasher(hashmap_uint32_t seed,
-                                         const void *key,
-                                         hashmap_uint32_t key_len) {
-    UNUSED(key_len);
-    return seed + hash_u64_to_u32((uint64_t) key) + 1;
+// Finishes the queued jobs first.
+static void maintenance_stop(struct lazyfree_cache* cache) {
+    struct maintenance* maintenance = cache->maintenance;
+    __atomic_store_n(&maintenance->stop, true, __ATOMIC_RELEASE);
+    sem_post(&maintenance->wake);
+    pthread_join(maintenance->thread, NULL);
+    sem_destroy(&maintenance->wake);
+    free(maintenance->queued.jobs);
+    free(maintenance->ready.jobs);
+    free(maintenance);
+    cache->maintenance = NULL;
 }
 
-lazyfree_cache_t lazyfree_cache_new_ex(size_t cache_capacity, size_t lazyfree_chunks, size_t anon_chunks, size_t disk_chunks) {
-    if (lazyfree_chunks + anon_chunks + disk_chunks != NUMBER_OF_CHUNKS) {
-        printf("Lazyfree chunks + anon chunks + disk chunks must equal %d\n", NUMBER_OF_CHUNKS);
+lazyfree_cache_t lazyfree_cache_new_ex(size_t cache_capacity, struct lazyfree_config config) {
+    size_t lazyfree_chunks = config.lazyfree_chunks;
+    size_t anon_chunks = config.anon_chunks;
+    size_t disk_chunks = config.disk_chunks;
+    size_t swap_chunks = config.swap_chunks;
+    size_t chunks_count = lazyfree_chunks + anon_chunks + disk_chunks + swap_chunks;
+    if (chunks_count == 0) {
+        printf("Lazyfree chunks + anon chunks + disk chunks + swap chunks must be positive\n");
+        exit(1);
+    }
+    size_t chunk_size = cache_capacity / chunks_count;
+    if (config.huge_pages) {
+        // Every chunk covers whole huge pages
+        chunk_size -= chunk_size % HUGE_PAGE_SIZE;
+        config.chunk_size -= config.chunk_size % HUGE_PAGE_SIZE;
+    }
+    if (config.chunk_size) {
+        // Keep the proportions of each kind
+        chunk_size = config.chunk_size;
+        size_t kinds_count = chunks_count;
+        chunks_count = cache_capacity / chunk_size;
+        anon_chunks = anon_chunks * chunks_count / kinds_count;
+        disk_chunks = disk_chunks * chunks_count / kinds_count;
+        swap_chunks = swap_chunks * chunks_count / kinds_count;
+        lazyfree_chunks = chunks_count - anon_chunks - disk_chunks - swap_chunks;
+    }
+    if (chunks_count == 0 || chunks_count > LAZYFREE_MAX_CHUNKS) {
+        printf("Number of chunks must be in [1, %d], got %zu\n", LAZYFREE_MAX_CHUNKS, chunks_count);
+        exit(1);
+    }
+    if (chunk_size < (config.huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE) || chunk_size / PAGE_SIZE > UINT32_MAX) {
+        printf("Cache of %zu bytes can't be split into %zu chunks\n", cache_capacity, chunks_count);
+        exit(1);
+    }
+    if (config.policy >= LAZYFREE_POLICY_COUNT) {
+        printf("Unknown eviction policy: %d\n", config.policy);
         exit(1);
     }
     struct lazyfree_cache* cache = malloc(sizeof(struct lazyfree_cache));
     memset(cache, 0, sizeof(struct lazyfree_cache));
     cache->cache_capacity = cache_capacity;
-    cache->chunk_size = cache_capacity / NUMBER_OF_CHUNKS;
-    cache->pages_per_chunk = cache->chunk_size / PAGE_SIZE;
-
+    cache->chunks_count = chunks_count;
+    cache->pages_per_chunk = chunk_size / PAGE_SIZE;
+    cache->chunk_size = cache->pages_per_chunk * PAGE_SIZE;
+    cache->active_chunks = chunks_count;
+    cache->max_chunks = config.max_capacity / cache->chunk_size;
+    if (cache->max_chunks < chunks_count) {
+        cache->max_chunks = chunks_count;
+    }
+    if (cache->max_chunks > LAZYFREE_MAX_CHUNKS) {
+        cache->max_chunks = LAZYFREE_MAX_CHUNKS;
+    }
+    // Index values pack the chunk above the page index
+    cache->index_bits = cache->pages_per_chunk > 1 ? 64 - __builtin_clzll(cache->pages_per_chunk - 1) : 0;
+    if (((uint64_t) cache->max_chunks << cache->index_bits) > (uint64_t) UINT32_MAX + 1) {
+        printf("%zu chunks of %zu pages don't fit in the index\n", cache->max_chunks, cache->pages_per_chunk);
+        exit(1);
+    }
+    cache->chunks = calloc(cache->max_chunks, sizeof(struct chunk));
+    assert(cache->chunks != NULL);
+    cache->seed = random_next();
+    cache->policy = config.policy;
+    cache->evacuate_hot = config.evacuate_hot;
+    cache->residency_check = config.residency_check;
+    cache->read_counters = aligned_alloc(64, READ_SLOTS * sizeof(struct read_counters));
+    assert(cache->read_counters != NULL);
+    memset(cache->read_counters, 0, READ_SLOTS * sizeof(struct read_counters));
+
+    mmap_impl_t mmap_anon = config.huge_pages ? lazyfree_mmap_anon_huge : lazyfree_mmap_anon;
     size_t idx = 0;
     while (idx < lazyfree_chunks) {
-        cache->chunks[idx].mmap_impl = lazyfree_mmap_anon;
+        cache->chunks[idx].mmap_impl = mmap_anon;
         cache->chunks[idx].madv_impl = lazyfree_madv_free;
         idx++;
     }
     while (idx < lazyfree_chunks + anon_chunks) {
-        cache->chunks[idx].mmap_impl = lazyfree_mmap_anon;
+        cache->chunks[idx].mmap_impl = mmap_anon;
         cache->chunks[idx].madv_impl = lazyfree_madv_nop;
         idx++;
     }
@@ -134,59 +415,65 @@ lazyfree_cache_t lazyfree_cache_new_ex(size_t cache_capacity, size_t lazyfree_ch
         cache->chunks[idx].madv_impl = lazyfree_madv_nop;
         idx++;
     }
+    while (idx < lazyfree_chunks + anon_chunks + disk_chunks + swap_chunks) {
+        // Not advised, so reads don't expect lost pages
+        cache->chunks[idx].mmap_impl = mmap_anon;
+        cache->chunks[idx].madv_impl = lazyfree_madv_pageout;
+        idx++;
+    }
     
 
     // Allocate all chunks on start
-    for (size_t i = 0; i < NUMBER_OF_CHUNKS; i++) {
-        void *entries = cache->chunks[i].mmap_impl(cache->chunk_size);
-        assert(entries != MAP_FAILED);
-
-        cache->chunks[i].entries = entries;
-
-        cache->chunks[i].bit0 = bitset_new(cache->pages_per_chunk);
-        assert(cache->chunks[i].bit0 != NULL);
-
-        cache->chunks[i].free_pages = malloc(cache->pages_per_chunk * sizeof(uint32_t));
-        assert(cache->chunks[i].free_pages != NULL);
-
-        cache->chunks[i].keys = malloc(cache->pages_per_chunk * sizeof(uint64_t));
-        assert(cache->chunks[i].keys != NULL);
+    for (size_t i = 0; i < cache->chunks_count; i++) {
+        chunk_init(cache, &cache->chunks[i]);
+    }
+    // Never grows: every entry, live or stale, has a page of its own (see blank_reset),
+    // so concurrent readers are safe.
+    size_t max_pages = cache->max_chunks * cache->pages_per_chunk;
+    u64map_init_ex(&cache->map, max_pages, sizeof(uint32_t));
+    // Stale entries only take room, a full pass every eighth of the pages in allocations
+    cache->sweep_budget = 8 * cache->map.capacity / max_pages + 1;
+
+    cache->total_free_pages = cache->chunks_count * cache->pages_per_chunk;
+
+    cache->prefault = config.prefault;
+    cache->prepared_chunk = NO_CHUNK;
+    if (config.maintenance_thread) {
+        cache->low_watermark = config.low_watermark ? config.low_watermark : cache->pages_per_chunk / 2;
+        maintenance_start(cache);
     }
-    hashmap_create_ex( (struct hashmap_create_options_s){
-        .initial_capacity = NUMBER_OF_CHUNKS*cache->pages_per_chunk,
-        .comparer = &exact_key_comparer,
-        .hasher = &exact_key_hasher,
-    }, &cache->map);
-    cache->key0.chunk = -1;
-
-    cache->total_free_pages = NUMBER_OF_CHUNKS * cache->pages_per_chunk;
-
-    cache->wlock_chunk = EMPTY_DESC.chunk;
-    
     return cache;
 }
 
 lazyfree_cache_t lazyfree_cache_new(size_t cache_capacity) {
-    return lazyfree_cache_new_ex(cache_capacity, NUMBER_OF_CHUNKS, 0, 0);
+    return lazyfree_cache_new_ex(cache_capacity, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS,
+    });
 }
 
 void lazyfree_cache_free(struct lazyfree_cache* cache) {
-    for (size_t i = 0; i < NUMBER_OF_CHUNKS; ++i) {
-        munmap(cache->chunks[i].entries, cache->chunk_size);
-        bitset_free(cache->chunks[i].bit0);
-        free(cache->chunks[i].free_pages);
-        free(cache->chunks[i].keys);
+    if (cache->maintenance != NULL) {
+        maintenance_stop(cache);
     }
-    hashmap_destroy(&cache->map);
+    for (size_t i = 0; i < cache->chunks_count; ++i) {
+        chunk_destroy(cache, &cache->chunks[i]);
+    }
+    u64map_destroy(&cache->map);
+    free(cache->chunks);
+    free(cache->read_counters);
     free(cache);
 }
 
 static void print_stats(lazyfree_cache_t cache) {
     struct lazyfree_cache* lazyfree_cache = (struct lazyfree_cache*) cache;
-    printf("Htable size: %u\n", hashmap_num_entries(&lazyfree_cache->map));
+    printf("Htable size: %zu (%zu Mb)\n", u64map_size(&lazyfree_cache->map), u64map_memory(&lazyfree_cache->map) / M);
     printf("Total free pages: %zu\n", lazyfree_cache->total_free_pages);
-    for (size_t i = 0; i < NUMBER_OF_CHUNKS; ++i) {
+    for (size_t i = 0; i < lazyfree_cache->chunks_count; ++i) {
         struct chunk* chunk = &lazyfree_cache->chunks[i];
+        if (chunk->retired) {
+            printf("Chunk %zu: retired\n", i);
+            continue;
+        }
         float ratio = (float) chunk->free_pages_count / (float) chunk->len;
         printf("Chunk %zu: %u/%u (%.2f%%)\n", i, chunk->free_pages_count, chunk->len, ratio * 100);
     }
@@ -194,43 +481,128 @@ static void print_stats(lazyfree_cache_t cache) {
 
 // == Hashmap helpers ==
 
-union {
-    struct entry_descriptor desc;
-    void *value;
-    struct {
-        uint32_t index;
-        int8_t chunk;
-        bool set;
-    } entry;
-} hmap_access;
-static_assert(sizeof(hmap_access) == sizeof(void*), "");
-static_assert(sizeof(hmap_access.entry) == sizeof(void*), "");
+static uint32_t hmap_pack(struct lazyfree_cache* cache, struct entry_descriptor desc) {
+    return (uint32_t) desc.chunk << cache->index_bits | desc.index;
+}
+
+static struct entry_descriptor hmap_unpack(struct lazyfree_cache* cache, uint64_t value) {
+    return (struct entry_descriptor){
+        .chunk = value >> cache->index_bits,
+        .index = value & (((uint32_t) 1 << cache->index_bits) - 1),
+    };
+}
+
+// Dropping a chunk only lowers its len: the entries past it are stale at once.
+// Lookups ignore them, they are erased when their page is allocated again,
+// and sweep_index erases the rest a few at a time on later allocations.
+
+static bool desc_dropped(struct lazyfree_cache* cache, struct entry_descriptor desc) {
+    return desc.index >= cache->chunks[desc.chunk].len;
+}
+
+// An entry starts at the slot. Free slots and the rest of a span have key 0 too,
+// and 0 is a valid key, so only the span tells them apart.
+static bool slot_holds(struct chunk* chunk, uint32_t index, lazyfree_key_t key) {
+    return chunk->spans[index] != 0 && chunk->keys[index] == key;
+}
+
+// Readers also compare the key: the page may be allocated to another one meanwhile.
+static bool desc_live(struct lazyfree_cache* cache, lazyfree_key_t key, struct entry_descriptor desc) {
+    struct chunk* chunk = &cache->chunks[desc.chunk];
+    return desc.index < __atomic_load_n(&chunk->len, __ATOMIC_ACQUIRE) && slot_holds(chunk, desc.index, key);
+}
+
+// Raw index entry, it may be stale, see read_lock_desc.
+static struct entry_descriptor hmap_lookup(struct lazyfree_cache* cache, lazyfree_key_t key) {
+    uint64_t value;
+    if (u64map_get(&cache->map, key, &value)) {
+        return hmap_unpack(cache, value);
+    }
+    return EMPTY_DESC;
+}
 
+// Live entry of the key, for the writer.
 static struct entry_descriptor hmap_get(struct lazyfree_cache* cache, lazyfree_key_t key) {
-    if (key == 0) {
-        return cache->key0;
+    struct entry_descriptor desc = hmap_lookup(cache, key);
+    if (desc.chunk != EMPTY_DESC.chunk && !desc_live(cache, key, desc)) {
+        return EMPTY_DESC;
     }
-    hmap_access.value = hashmap_get(&cache->map, (void*) (key), sizeof(key));
-    // printf("hmap_get %lu: %p\n", key, hmap_access.value);
-    if (hmap_access.entry.set) {
-        return hmap_access.desc;
+    return desc;
+}
+
+// Checks the next slots of the index and erases stale entries.
+static void sweep_index(struct lazyfree_cache* cache, size_t slots) {
+    struct u64map* map = &cache->map;
+    for (size_t i = 0; i < slots; ) {
+        size_t slot = cache->sweep_slot;
+        if (map->tags[slot] != 0) {
+            if (desc_dropped(cache, hmap_unpack(cache, u64map_value(map, slot)))) {
+                // The next entry of the cluster may move here, check the slot again
+                u64map_erase_at(map, slot);
+                continue;
+            }
+        }
+        cache->sweep_slot = slot + 1 == map->capacity ? 0 : slot + 1;
+        i++;
     }
-    return EMPTY_DESC;
 }
 
+// Entries past len become stale and readers of the chunk fail at unlock, the sweep starts over.
+// The epoch is bumped last, so a reader that sees it sees the new len too.
+static void chunk_invalidate(struct lazyfree_cache* cache, struct chunk* chunk, uint32_t len) {
+    __atomic_store_n(&chunk->len, len, __ATOMIC_RELEASE);
+    __atomic_store_n(&chunk->epoch, (uint16_t) (chunk->epoch + 1), __ATOMIC_RELEASE);
+    cache->sweep_left = cache->map.capacity;
+}
 
 static void hmap_put(struct lazyfree_cache* cache, lazyfree_key_t key, struct entry_descriptor desc) {
-    if (key == 0) {
-        cache->key0 = desc;
+    uint32_t value = hmap_pack(cache, desc);
+    size_t slot = u64map_find(&cache->map, key);
+    if (slot != U64MAP_NONE) {
+        // Overwrites don't add entries, so they never need the sweep
+        u64map_set_value(&cache->map, slot, value);
         return;
     }
-    hmap_access.desc = desc;
-    hmap_access.entry.set = true;
-    hashmap_put(&cache->map, (void*) key, sizeof(key), hmap_access.value);
+    if ((cache->map.size + 1) * 8 > cache->map.capacity * 7) {
+        // Not reached while every entry has a page of its own, the index must not grow
+        sweep_index(cache, cache->map.capacity);
+        cache->sweep_left = 0;
+    }
+    u64map_put(&cache->map, key, value);
+}
+
+// Removes the key only if it still points to desc.
+static void hmap_remove(struct lazyfree_cache* cache, lazyfree_key_t key, struct entry_descriptor desc) {
+    size_t slot = u64map_find(&cache->map, key);
+    if (slot == U64MAP_NONE) {
+        return;
+    }
+    struct entry_descriptor current = hmap_unpack(cache, u64map_value(&cache->map, slot));
+    if (current.chunk == desc.chunk && current.index == desc.index) {
+        u64map_erase_at(&cache->map, slot);
+    }
+}
+
+// == Counter helpers ==
+
+static uint32_t next_read_slot;
+static __thread uint32_t read_slot = UINT32_MAX;
+
+static struct read_counters* thread_counters(struct lazyfree_cache* cache) {
+    if (read_slot == UINT32_MAX) {
+        read_slot = __atomic_fetch_add(&next_read_slot, 1, __ATOMIC_RELAXED) % READ_SLOTS;
+    }
+    return &cache->read_counters[read_slot];
+}
+
+// Not a locked add: the line is owned by one thread.
+static inline void counter_inc(uint64_t* counter) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
 }
 
-static void hmap_remove(struct lazyfree_cache* cache, lazyfree_key_t key) {
-    hashmap_remove(&cache->map,     (void*) (key), sizeof(key));
+static void count_madvise(struct lazyfree_cache* cache, size_t bytes) {
+    __atomic_fetch_add(&cache->write_counters.madvise_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->write_counters.bytes_advised, bytes, __ATOMIC_RELAXED);
 }
 
 // == Bitset helpers
@@ -247,6 +619,78 @@ static void bit_from_tail(struct chunk* chunk, uint32_t index, uint8_t* tail) {
     *tail |= 1;
 }
 
+// == Span helpers ==
+// An entry of N pages takes N contiguous slots of one chunk. The first slot holds
+// the key, sequence and span; the others have span 0, so chunk walks skip them.
+// The tail byte of every page but the last is only a reclaim marker.
+
+static uint32_t span_pages(struct chunk* chunk, uint32_t index) {
+    uint16_t span = chunk->spans[index];
+    return span ? span : 1;
+}
+
+// All pages of the entry are still there.
+static bool span_valid(struct chunk* chunk, uint32_t index, uint32_t pages) {
+    for (uint32_t i = 0; i < pages; ++i) {
+        if (chunk->entries[index + i].tail == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// == Sequence helpers ==
+// Every slot has a sequence number, it is odd while the slot is written.
+// Readers remember it in read_lock and compare in read_unlock,
+// so they don't need to hold any lock while copying the page.
+
+static uint32_t seq_read(struct chunk* chunk, uint32_t index) {
+    return __atomic_load_n(&chunk->seqs[index], __ATOMIC_ACQUIRE);
+}
+
+static void seq_write_begin(struct chunk* chunk, uint32_t index) {
+    __atomic_store_n(&chunk->seqs[index], chunk->seqs[index] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(struct chunk* chunk, uint32_t index) {
+    __atomic_store_n(&chunk->seqs[index], chunk->seqs[index] + 1, __ATOMIC_RELEASE);
+}
+
+// Invalidates current readers of the slot.
+static void seq_bump(struct chunk* chunk, uint32_t index) {
+    __atomic_store_n(&chunk->seqs[index], chunk->seqs[index] + 2, __ATOMIC_RELEASE);
+}
+
+// == Residency helpers ==
+// A reclaimed MADV_FREE page has no mapping until it is touched again,
+// mincore tells it apart without the fault that maps the zero page.
+
+static bool pages_resident(struct discardable_entry* entry, uint32_t pages) {
+    unsigned char vec[256];
+    for (uint32_t done = 0; done < pages; done += sizeof(vec)) {
+        uint32_t batch = pages - done < sizeof(vec) ? pages - done : sizeof(vec);
+        if (mincore((void*) &entry[done], batch * PAGE_SIZE, vec) != 0) {
+            // Let the tail bytes decide
+            return true;
+        }
+        for (uint32_t i = 0; i < batch; ++i) {
+            if (!(vec[i] & 1)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void chunk_advise(struct lazyfree_cache* cache, struct chunk* chunk) {
+    if (chunk->madv_impl != lazyfree_madv_nop) {
+        count_madvise(cache, cache->chunk_size);
+    }
+    chunk->madv_impl(chunk->entries, cache->chunk_size);
+    chunk->advised = chunk->madv_impl == lazyfree_madv_free;
+}
+
 // == rlock helpers ==
 
 static uint32_t rlock_to_index(struct chunk* chunk, rlock_impl_t* lock) {
@@ -258,7 +702,7 @@ static bool rlock_check_key(struct lazyfree_cache* cache, rlock_impl_t* lock) {
     struct chunk* chunk = &cache->chunks[lock->_chunk];
     uint32_t index = rlock_to_index(chunk, lock);
 
-    if (chunk->keys[index] != lock->key) {
+    if (!slot_holds(chunk, index, lock->key) || __atomic_load_n(&chunk->epoch, __ATOMIC_ACQUIRE) != lock->_epoch) {
         if (cache->verbose) {
             printf("Key %lu was evicted by dropping the chunk\n", lock->key);
         }
@@ -267,41 +711,90 @@ static bool rlock_check_key(struct lazyfree_cache* cache, rlock_impl_t* lock) {
     return true;
 }
 
+static bool rlock_check_seq(struct lazyfree_cache* cache, rlock_impl_t* lock) {
+    struct chunk* chunk = &cache->chunks[lock->_chunk];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&chunk->seqs[lock->_index], __ATOMIC_RELAXED) != lock->_seq) {
+        if (cache->verbose) {
+            printf("Key %lu was rewritten while locked\n", lock->key);
+        }
+        return false;
+    }
+    return true;
+}
+
+// == Policy helpers ==
+
+// Called on every hit, possibly by concurrent readers.
+static void chunk_touch(struct lazyfree_cache* cache, struct chunk* chunk, uint32_t index) {
+    if (cache->evacuate_hot && !bitset_get(chunk->accessed, index)) {
+        bitset_put_atomic(chunk->accessed, index, true);
+    }
+
+    switch (cache->policy) {
+    case LAZYFREE_POLICY_LFU:
+        __atomic_fetch_add(&chunk->hits, 1, __ATOMIC_RELAXED);
+        break;
+    case LAZYFREE_POLICY_CLOCK:
+        if (!__atomic_load_n(&chunk->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&chunk->referenced, 1, __ATOMIC_RELAXED);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 // == Read lock implementation ==
 
 static void cache_drop(struct lazyfree_cache* cache, struct entry_descriptor desc) {
     if (cache->verbose) {
-        printf("DEBUG: Dropping chunk %d, index %d\n", desc.chunk, desc.index);
+        printf("DEBUG: Dropping chunk %d, index %u\n", desc.chunk, desc.index);
     }
     
     struct chunk* chunk = &cache->chunks[desc.chunk];
-    chunk->free_pages[chunk->free_pages_count++] = desc.index;
+    uint32_t pages = span_pages(chunk, desc.index);
+    for (uint32_t i = 0; i < pages; ++i) {
+        chunk->free_pages[chunk->free_pages_count++] = desc.index + i;
+    }
     if (chunk->free_pages_count > chunk->len) {
 
         print_stats(cache);
         exit(1);
     }
     
-    cache->total_free_pages++;
+    cache->total_free_pages += pages;
 
-    hmap_remove(cache, chunk->keys[desc.index]);
+    hmap_remove(cache, chunk->keys[desc.index], desc);
     chunk->keys[desc.index] = 0;
+    chunk->spans[desc.index] = 0;
 }
 
-void lazyfree_read_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
-    assert(cache->wlock_chunk == EMPTY_DESC.chunk);
+static bool desc_valid(struct lazyfree_cache* cache, struct entry_descriptor desc) {
+    return desc.chunk != EMPTY_DESC.chunk &&
+           (size_t) desc.chunk < cache->chunks_count && desc.index < cache->pages_per_chunk;
+}
+
+// read_lock after the index lookup.
+static void read_lock_desc(struct lazyfree_cache* cache, lazyfree_rlock_t* lock, struct entry_descriptor desc) {
     rlock_impl_t *lock_impl = (rlock_impl_t*) lock;
     lock_impl->head = EMPTY_PAGE;
     lock_impl->tail = 0;
     lock_impl->_chunk = EMPTY_DESC.chunk;
 
-  
-    struct entry_descriptor desc = hmap_get(cache, lock->key);
+    struct read_counters* counters = thread_counters(cache);
+    counter_inc(&counters->lookups);
 
     if (desc.chunk == EMPTY_DESC.chunk) {
         if (cache->verbose) {
             printf("Key %lu not found\n", lock->key);
         }
+        counter_inc(&counters->absent);
+        return;
+    }
+    if (!desc_valid(cache, desc)) {
+        // Torn read of the index by a concurrent reader
+        counter_inc(&counters->absent);
         return;
     }
     struct chunk* chunk = &cache->chunks[desc.chunk];
@@ -311,33 +804,97 @@ void lazyfree_read_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
         printf("DEBUG: rlock key=%lu chunk=%d index=%d\n", lock->key, desc.chunk, desc.index);
     }
 
-    if (chunk->keys[desc.index] != lock->key) {
+    uint32_t seq = seq_read(chunk, desc.index);
+    if (seq % 2 == 1) {
+        if (cache->verbose || lock->key == DEBUG_KEY) {
+            printf("Key %lu is being written\n", lock->key);
+        }
+        counter_inc(&counters->writing);
+        return;
+    }
+
+    // Before the liveness check: a drop after it fails read_unlock
+    uint16_t epoch = __atomic_load_n(&chunk->epoch, __ATOMIC_ACQUIRE);
+    if (!desc_live(cache, lock->key, desc)) {
         if (cache->verbose || lock->key == DEBUG_KEY) {
             printf("Key %lu was evicted by dropping the chunk\n", lock->key);
         }
+        counter_inc(&counters->dropped);
         return;
     }   
 
+    uint32_t pages = span_pages(chunk, desc.index);
+    if (desc.index + pages > cache->pages_per_chunk) {
+        // Torn read of the span by a concurrent reader
+        counter_inc(&counters->absent);
+        return;
+    }
+
     lock_impl->_index = desc.index;
     lock_impl->_chunk = desc.chunk;
+    lock_impl->_seq = seq;
+    lock_impl->_epoch = epoch;
+
+    // Pages of chunks that were never advised can't be reclaimed
+    if (cache->residency_check && chunk->advised && !pages_resident(entry, pages)) {
+        if (cache->verbose || lock->key == DEBUG_KEY) {
+            printf("Key %lu was evicted by kernel, page is not resident\n", lock->key);
+        }
+        counter_inc(&counters->reclaimed);
+        return;
+    }
     
-    if (entry->tail == 0) {
+    if (!span_valid(chunk, desc.index, pages)) {
         if (cache->verbose || lock->key == DEBUG_KEY) {
             printf("Key %lu was evicted by kernel\n", lock->key);
         }
-
+        counter_inc(&counters->reclaimed);
         return;
     }
 
     lock_impl->head = entry->head;
-    lock_impl->tail = entry->tail;
-    bit_to_tail(chunk, desc.index, &lock_impl->tail);
+    lock_impl->tail = entry[pages - 1].tail;
+    lock_impl->pages = pages;
+    bit_to_tail(chunk, desc.index + pages - 1, &lock_impl->tail);
+    chunk_touch(cache, chunk, desc.index);
+}
+
+void lazyfree_read_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
+    read_lock_desc(cache, lock, hmap_lookup(cache, lock->key));
+}
+
+// Every stage prefetches what the next one touches, so the misses
+// of one window overlap instead of following each other.
+void lazyfree_read_lock_many(lazyfree_cache_t cache, lazyfree_rlock_t* locks, size_t count) {
+    struct entry_descriptor descs[LAZYFREE_BATCH];
+    for (size_t start = 0; start < count; start += LAZYFREE_BATCH) {
+        lazyfree_rlock_t* batch = &locks[start];
+        size_t batch_count = count - start < LAZYFREE_BATCH ? count - start : LAZYFREE_BATCH;
+
+        // Index groups
+        for (size_t i = 0; i < batch_count; ++i) {
+            u64map_prefetch(&cache->map, batch[i].key);
+        }
+        // Slot metadata and the page tail, a reclaimed page doesn't fault on prefetch
+        for (size_t i = 0; i < batch_count; ++i) {
+            descs[i] = hmap_lookup(cache, batch[i].key);
+            if (!desc_valid(cache, descs[i])) {
+                continue;
+            }
+            struct chunk* chunk = &cache->chunks[descs[i].chunk];
+            __builtin_prefetch(&chunk->seqs[descs[i].index]);
+            __builtin_prefetch(&chunk->keys[descs[i].index]);
+            __builtin_prefetch((void*) &chunk->entries[descs[i].index].tail);
+        }
+        for (size_t i = 0; i < batch_count; ++i) {
+            read_lock_desc(cache, &batch[i], descs[i]);
+        }
+    }
 }
 
 
 bool lazyfree_read_unlock(struct lazyfree_cache* cache, lazyfree_rlock_t* lock, bool drop) {
     assert(lock->head != NULL);
-    assert(cache->wlock_chunk == EMPTY_DESC.chunk);
 
 
 
@@ -351,12 +908,25 @@ bool lazyfree_read_unlock(struct lazyfree_cache* cache, lazyfree_rlock_t* lock,
     assert(lock_impl->_chunk != EMPTY_DESC.chunk);
 
     if (!LAZYFREE_LOCK_CHECK(*lock)) {
-        printf("LOCK CHECK FAILED\n");
-        exit(1);
+        if (cache->verbose) {
+            printf("Key %lu was evicted while locked\n", lock->key);
+        }
+        counter_inc(&thread_counters(cache)->invalidated);
+        return false;
     }
    
-    // Check if was dropped already
-    if (!rlock_check_key(cache, lock_impl)) {
+    // Check if was dropped or rewritten already
+    if (!rlock_check_key(cache, lock_impl) || !rlock_check_seq(cache, lock_impl)) {
+        counter_inc(&thread_counters(cache)->invalidated);
+        return false;
+    }
+
+    // Any page of a multi-page entry could be reclaimed
+    if (lock_impl->pages > 1 && !span_valid(&cache->chunks[lock_impl->_chunk], lock_impl->_index, lock_impl->pages)) {
+        if (cache->verbose) {
+            printf("Key %lu was evicted while locked\n", lock->key);
+        }
+        counter_inc(&thread_counters(cache)->invalidated);
         return false;
     }
 
@@ -370,87 +940,400 @@ bool lazyfree_read_unlock(struct lazyfree_cache* cache, lazyfree_rlock_t* lock,
         .chunk = lock_impl->_chunk,
         .index = rlock_to_index(chunk, lock_impl),
     };
+    seq_bump(chunk, desc.index);
     cache_drop(cache, desc);
+    cache->write_counters.explicit_drops++;
     return true;
 }
 
-// == Write Lock Implementation ==
+// == Victim policies ==
+// Return chunks_count if every chunk has open write locks.
+// Frequency based policies don't pick the current chunk,
+// it was just filled and has no hits yet.
+
+// The prepared chunk is dropped already, the thread hands it back as the next current one.
+static bool chunk_droppable(struct lazyfree_cache* cache, size_t idx) {
+    struct chunk* chunk = &cache->chunks[idx];
+    return chunk->writers == 0 && !chunk->retired && idx != cache->prepared_chunk;
+}
 
-static void drop_next_chunk(struct lazyfree_cache* cache) {
-    // Next chunk:
-    // cache->current_chunk_idx = (cache->current_chunk_idx + 1) % NUMBER_OF_CHUNKS;
+static bool victim_allowed(struct lazyfree_cache* cache, size_t idx) {
+    return chunk_droppable(cache, idx) && idx != cache->current_chunk_idx;
+}
 
-    // Random chunk:
-    cache->current_chunk_idx = random_next() % NUMBER_OF_CHUNKS;
+static size_t victim_random(struct lazyfree_cache* cache) {
+    size_t victim = random_next_r(&cache->seed) % cache->chunks_count;
+    for (size_t tries = 0; !chunk_droppable(cache, victim); ++tries) {
+        if (tries == cache->chunks_count) {
+            return cache->chunks_count;
+        }
+        victim = (victim + 1) % cache->chunks_count;
+    }
+    return victim;
+}
 
-    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
+// Chunks are filled in order, so the one after the current is the oldest.
+static size_t victim_fifo(struct lazyfree_cache* cache) {
+    for (size_t i = 1; i <= cache->chunks_count; ++i) {
+        size_t idx = (cache->current_chunk_idx + i) % cache->chunks_count;
+        if (chunk_droppable(cache, idx)) {
+            return idx;
+        }
+    }
+    return cache->chunks_count;
+}
 
-    for (size_t i = 0; i < chunk->len; ++i) {
-        hmap_remove(cache, chunk->keys[i]);
+static size_t victim_lfu(struct lazyfree_cache* cache) {
+    size_t victim = cache->chunks_count;
+    uint32_t min_hits = UINT32_MAX;
+    uint64_t sum_hits = 0;
+    for (size_t i = 0; i < cache->chunks_count; ++i) {
+        struct chunk* chunk = &cache->chunks[i];
+        uint32_t hits = __atomic_load_n(&chunk->hits, __ATOMIC_RELAXED);
+        sum_hits += hits;
+        if (victim_allowed(cache, i) && hits < min_hits) {
+            min_hits = hits;
+            victim = i;
+        }
+        // Decay, so old popularity doesn't stick forever
+        __atomic_store_n(&chunk->hits, hits / 2, __ATOMIC_RELAXED);
     }
-    memset(chunk->keys, 0, chunk->len * sizeof(lazyfree_key_t));
-    int ret = madvise(chunk->entries, cache->chunk_size, MADV_DONTNEED);
-    if (ret != 0) {
-        printf("MADV_DONTNEED failed: %d\n", ret);
-        exit(1);
+    if (victim == cache->chunks_count) {
+        return victim_fifo(cache);
     }
-    
-    cache->total_free_pages += (chunk->len - chunk->free_pages_count);
-    
-    chunk->len = 0;
-    chunk->free_pages_count = 0;
+    // New contents start from the average, otherwise they are the next victim
+    __atomic_store_n(&cache->chunks[victim].hits, sum_hits / cache->active_chunks / 2, __ATOMIC_RELAXED);
+    return victim;
 }
 
-static void advance_chunk(struct lazyfree_cache* cache) {
-    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
-    chunk->madv_impl(chunk->entries, cache->chunk_size);
-    
-    cache->current_chunk_idx = (cache->current_chunk_idx + 1) % NUMBER_OF_CHUNKS;
-} 
+static size_t victim_clock(struct lazyfree_cache* cache) {
+    // Two rounds: the first one may only clear the bits
+    for (size_t step = 0; step < 2 * cache->chunks_count; ++step) {
+        size_t idx = cache->clock_hand;
+        cache->clock_hand = (idx + 1) % cache->chunks_count;
+        if (!victim_allowed(cache, idx)) {
+            continue;
+        }
+        if (__atomic_exchange_n(&cache->chunks[idx].referenced, 0, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        return idx;
+    }
+    return victim_fifo(cache);
+}
 
-static struct entry_descriptor alloc_current_chunk(struct lazyfree_cache* cache) {
-    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
-    struct entry_descriptor desc = { .chunk = cache->current_chunk_idx };
+static size_t pick_victim(struct lazyfree_cache* cache) {
+    switch (cache->policy) {
+    case LAZYFREE_POLICY_FIFO:
+        return victim_fifo(cache);
+    case LAZYFREE_POLICY_LFU:
+        return victim_lfu(cache);
+    case LAZYFREE_POLICY_CLOCK:
+        return victim_clock(cache);
+    default:
+        return victim_random(cache);
+    }
+}
 
-    if (chunk->free_pages_count > 0 ) {
-        // We have free pages
-        uint32_t idx = chunk->free_pages[--chunk->free_pages_count];
-        desc.index = idx;
+// == Evacuation ==
+// The victim chunk becomes the current one right after the drop,
+// so hot pages are compacted to its front and only the rest is dropped.
 
-        cache->total_free_pages--;
-        return desc;
+// Moves the page at desc to slot dest.index of the same chunk.
+// Returns false if the page was evicted by the kernel meanwhile.
+static bool evacuate_page(struct lazyfree_cache* cache, struct entry_descriptor desc, struct entry_descriptor dest) {
+    struct chunk* chunk = &cache->chunks[desc.chunk];
+    if (dest.index == desc.index) {
+        // Already indexed here
+        return chunk->entries[desc.index].tail != 0;
     }
 
-    if (chunk->len < cache->pages_per_chunk) {
-        // We have blank pages
-        desc.index = chunk->len++;
-
-        cache->total_free_pages--;
-        return desc;
+    // Readers of both slots must fail or miss
+    lazyfree_key_t key = chunk->keys[desc.index];
+    seq_write_begin(chunk, dest.index);
+    // The page evicted from dest is still indexed, the drop would leave its entry behind len
+    hmap_remove(cache, chunk->keys[dest.index], dest);
+    memcpy((void*) &chunk->entries[dest.index], (void*) &chunk->entries[desc.index], PAGE_SIZE);
+    if (chunk->entries[desc.index].tail == 0) {
+        // Evicted during the copy
+        seq_write_end(chunk, dest.index);
+        return false;
     }
-    
-    // Nothing left in this chunk
-    return EMPTY_DESC;
+    bitset_put(chunk->bit0, dest.index, bitset_get(chunk->bit0, desc.index));
+    chunk->keys[dest.index] = key;
+    chunk->spans[dest.index] = 1;
+    hmap_put(cache, key, dest);
+    seq_write_end(chunk, dest.index);
+    seq_bump(chunk, desc.index);
+    return true;
 }
 
-static struct entry_descriptor alloc_new_page(struct lazyfree_cache* cache) {
-    struct entry_descriptor desc = EMPTY_DESC;
-    if (cache->total_free_pages == 0) {
-        drop_next_chunk(cache);
+// Runs before the victim is invalidated, its live entries are the ones to keep or drop.
+// Returns number of pages kept at the front of the chunk, moved tells if all of them were copied.
+static uint32_t evacuate_hot(struct lazyfree_cache* cache, size_t victim, bool* moved) {
+    struct chunk* chunk = &cache->chunks[victim];
+    uint32_t max_hot = cache->pages_per_chunk / 2;
+    uint32_t hot = 0;
+    *moved = true;
+    for (uint32_t i = 0; i < chunk->len; ++i) {
+        if (chunk->spans[i] == 0) {
+            // Free page or the rest of a span
+            continue;
+        }
+        struct entry_descriptor desc = { .chunk = victim, .index = i };
+        struct entry_descriptor current = hmap_lookup(cache, chunk->keys[i]);
+        bool live = current.chunk == desc.chunk && current.index == desc.index;
+        if (!live) {
+            continue;
+        }
+        struct entry_descriptor dest = { .chunk = victim, .index = hot };
+        // Multi-page entries are not moved, they would take most of the room
+        bool single = chunk->spans[i] <= 1;
+        if (hot < max_hot && single && bitset_get(chunk->accessed, i) && evacuate_page(cache, desc, dest)) {
+            // A page that stays in its slot was not written, MADV_FREE still applies to it
+            *moved &= i != hot;
+            hot++;
+            continue;
+        }
+        cache->write_counters.pages_evicted++;
+        // Slot can be overwritten by a later hot page, its index entry goes stale with the drop
+        seq_bump(chunk, i);
     }
+    if (cache->verbose) {
+        printf("DEBUG: Evacuated %u hot pages of chunk %zu\n", hot, victim);
+    }
+    memset(chunk->accessed, 0, (cache->pages_per_chunk + 7) / 8);
+    return hot;
+}
 
-    size_t chunks_visited = 0;
-    while(desc.chunk == EMPTY_DESC.chunk) {
-        desc = alloc_current_chunk(cache);
-        if (desc.chunk != EMPTY_DESC.chunk) {
-            // Found a free page
-            break;
-        }
+// == Write Lock Implementation ==
 
-        advance_chunk(cache);
+static void maintenance_queue(struct lazyfree_cache* cache, size_t idx, enum job_kind kind, uint32_t keep) {
+    cache->chunks[idx].queued++;
+    cache->maintenance->pending++;
+    ring_push(&cache->maintenance->queued, (struct job){ .chunk = idx, .kind = kind, .keep = keep });
+    sem_post(&cache->maintenance->wake);
+}
+
+// Takes back the chunks the thread is done with.
+static void maintenance_drain(struct lazyfree_cache* cache) {
+    struct job job;
+    while (ring_pop(&cache->maintenance->ready, &job)) {
+        cache->chunks[job.chunk].queued--;
+        cache->maintenance->pending--;
+    }
+}
+
+// The thread is behind, waits for every queued job.
+// Returns false if nothing was queued.
+static bool maintenance_wait(struct lazyfree_cache* cache) {
+    if (cache->maintenance == NULL || cache->maintenance->pending == 0) {
+        return false;
+    }
+    cache->write_counters.maintenance_waits++;
+    maintenance_drain(cache);
+    while (cache->maintenance->pending > 0) {
+        sched_yield();
+        maintenance_drain(cache);
+    }
+    return true;
+}
+
+// Readers miss every page of the victim from now on, no index entry is removed here.
+// Slots past len keep their old keys, allocations clear them before len moves past.
+// Returns number of pages kept at the front, the rest is still to be released.
+static uint32_t invalidate_victim(struct lazyfree_cache* cache, size_t victim) {
+    struct chunk* chunk = &cache->chunks[victim];
+    if (cache->evacuate_hot && chunk->queued) {
+        // A page moved before a queued MADV_FREE could be torn by a reclaim
+        maintenance_wait(cache);
+    }
+    uint32_t hot = 0;
+    bool moved = true;
+    if (cache->evacuate_hot) {
+        hot = evacuate_hot(cache, victim, &moved);
+        cache->write_counters.pages_evacuated += hot;
+    } else {
+        cache->write_counters.pages_evicted += chunk->len - chunk->free_pages_count;
+    }
+    cache->write_counters.chunk_drops++;
+
+    cache->total_free_pages += (chunk->len - chunk->free_pages_count) - hot;
+
+    chunk_invalidate(cache, chunk, hot);
+    chunk->populated = hot;
+    chunk->free_pages_count = 0;
+    chunk->advise_pending = false;
+    // Copied pages were written again, the rest is released
+    chunk->advised = chunk->advised && !moved;
+    return hot;
+}
+
+// Returns false if every chunk has open write locks.
+static bool drop_next_chunk(struct lazyfree_cache* cache) {
+    size_t victim = pick_victim(cache);
+    if (victim == cache->chunks_count) {
+        return false;
+    }
+    cache->current_chunk_idx = victim;
+
+    struct chunk* chunk = &cache->chunks[victim];
+    uint32_t hot = invalidate_victim(cache, victim);
+    int ret = madvise(&chunk->entries[hot], cache->chunk_size - hot * PAGE_SIZE, MADV_DONTNEED);
+    count_madvise(cache, cache->chunk_size - hot * PAGE_SIZE);
+    if (ret != 0) {
+        printf("MADV_DONTNEED failed: %d\n", ret);
+        exit(1);
+    }
+    if (chunk->queued) {
+        // It becomes current right away
+        maintenance_wait(cache);
+    }
+    return true;
+}
+
+// Drops the next victim once free pages are below the low watermark,
+// the thread releases its memory while the current chunk is filled.
+static void prepare_next_chunk(struct lazyfree_cache* cache) {
+    if (cache->maintenance == NULL || cache->prepared_chunk != NO_CHUNK ||
+        cache->total_free_pages >= cache->low_watermark) {
+        return;
+    }
+    size_t victim = pick_victim(cache);
+    if (victim == cache->chunks_count || victim == cache->current_chunk_idx) {
+        // Tried again on the next allocation
+        return;
+    }
+    uint32_t hot = invalidate_victim(cache, victim);
+    if (cache->prefault) {
+        // By the thread, before the chunk is handed back
+        cache->chunks[victim].populated = cache->pages_per_chunk;
+    }
+    cache->prepared_chunk = victim;
+    maintenance_queue(cache, victim, JOB_DROP, hot);
+}
+
+// Advises the chunk now, or hands it to the maintenance thread.
+static void advise_chunk(struct lazyfree_cache* cache, size_t idx) {
+    struct chunk* chunk = &cache->chunks[idx];
+    if (cache->maintenance == NULL || chunk->madv_impl == lazyfree_madv_nop) {
+        chunk_advise(cache, chunk);
+        return;
+    }
+    chunk->advised = chunk->madv_impl == lazyfree_madv_free;
+    maintenance_queue(cache, idx, JOB_ADVISE, 0);
+}
+
+static void advance_chunk(struct lazyfree_cache* cache) {
+    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
+    if (chunk->retired || chunk->queued) {
+        // Nothing to advise
+    } else if (chunk->writers > 0) {
+        // Pages written after MADV_FREE are kept, but a page reclaimed
+        // in the middle of a write would keep only the second half.
+        chunk->advise_pending = true;
+    } else {
+        advise_chunk(cache, cache->current_chunk_idx);
+    }
+
+    size_t prepared = cache->prepared_chunk;
+    if (prepared != NO_CHUNK && !cache->chunks[prepared].queued) {
+        cache->current_chunk_idx = prepared;
+        cache->prepared_chunk = NO_CHUNK;
+        return;
+    }
+    cache->current_chunk_idx = (cache->current_chunk_idx + 1) % cache->chunks_count;
+} 
+
+// Blank pages populated at once with config.prefault.
+#define PREFAULT_PAGES 64
+
+// Populates the blank pages up to end, and a batch more, so the writes don't fault one by one.
+static void prefault_blank(struct lazyfree_cache* cache, struct chunk* chunk, uint32_t end) {
+    if (!cache->prefault || end <= chunk->populated) {
+        return;
+    }
+    uint32_t from = chunk->populated > chunk->len ? chunk->populated : chunk->len;
+    uint32_t to = end > from + PREFAULT_PAGES ? end : from + PREFAULT_PAGES;
+    if (to > cache->pages_per_chunk) {
+        to = cache->pages_per_chunk;
+    }
+    lazyfree_populate(&chunk->entries[from], (size_t) (to - from) * PAGE_SIZE);
+    chunk->populated = to;
+}
+
+// Old entries of blank pages about to be allocated, before len moves past them:
+// their stale index entries are erased, and readers must not match them anymore.
+// Afterwards every page is free, the writer sets the span of the first one.
+static void blank_reset(struct lazyfree_cache* cache, struct entry_descriptor desc, uint32_t pages) {
+    struct chunk* chunk = &cache->chunks[desc.chunk];
+    for (uint32_t i = 0; i < pages; ++i) {
+        struct entry_descriptor page = { .chunk = desc.chunk, .index = desc.index + i };
+        if (chunk->spans[page.index] != 0) {
+            hmap_remove(cache, chunk->keys[page.index], page);
+            chunk->keys[page.index] = 0;
+            chunk->spans[page.index] = 0;
+        }
+    }
+}
+
+static struct entry_descriptor alloc_current_chunk(struct lazyfree_cache* cache) {
+    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
+    struct entry_descriptor desc = { .chunk = cache->current_chunk_idx };
+
+    if (chunk->retired || chunk->queued) {
+        return EMPTY_DESC;
+    }
+
+    if (chunk->free_pages_count > 0 ) {
+        // We have free pages
+        uint32_t idx = chunk->free_pages[--chunk->free_pages_count];
+        desc.index = idx;
+
+        cache->total_free_pages--;
+        return desc;
+    }
+
+    if (chunk->len < cache->pages_per_chunk) {
+        // We have blank pages
+        prefault_blank(cache, chunk, chunk->len + 1);
+        desc.index = chunk->len;
+        blank_reset(cache, desc, 1);
+        __atomic_store_n(&chunk->len, chunk->len + 1, __ATOMIC_RELEASE);
+
+        cache->total_free_pages--;
+        return desc;
+    }
+    
+    // Nothing left in this chunk
+    return EMPTY_DESC;
+}
+
+static struct entry_descriptor alloc_new_page(struct lazyfree_cache* cache) {
+    struct entry_descriptor desc = EMPTY_DESC;
+    if (cache->total_free_pages == 0 && !drop_next_chunk(cache)) {
+        if (cache->verbose) {
+            printf("All chunks have open write locks\n");
+        }
+        return EMPTY_DESC;
+    }
+
+    size_t chunks_visited = 0;
+    while(desc.chunk == EMPTY_DESC.chunk) {
+        desc = alloc_current_chunk(cache);
+        if (desc.chunk != EMPTY_DESC.chunk) {
+            // Found a free page
+            break;
+        }
+
+        advance_chunk(cache);
 
         chunks_visited++;
-        if (chunks_visited >= NUMBER_OF_CHUNKS) {
+        if (chunks_visited >= cache->chunks_count && maintenance_wait(cache)) {
+            // Free pages were in queued chunks
+            chunks_visited = 0;
+        }
+        if (chunks_visited >= cache->chunks_count) {
             // This means total_free_pages is not updated correctly
             printf("Failed to find free page\n");
             print_stats(cache);
@@ -461,114 +1344,415 @@ static struct entry_descriptor alloc_new_page(struct lazyfree_cache* cache) {
     return desc;
 }
 
-void* lazyfree_write_alloc(lazyfree_cache_t cache, lazyfree_key_t key) {
-    assert(cache->wlock_chunk == EMPTY_DESC.chunk);
+static bool span_fits(struct lazyfree_cache* cache, uint32_t pages) {
+    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
+    return !chunk->retired && !chunk->queued && chunk->len + pages <= cache->pages_per_chunk;
+}
+
+// Multi-page entries are cut from blank pages only, freed pages are not contiguous.
+// If neither the current nor the next chunk has room, the next victim is dropped.
+static struct entry_descriptor alloc_span(struct lazyfree_cache* cache, uint32_t pages) {
+    if (!span_fits(cache, pages)) {
+        advance_chunk(cache);
+    }
+    if (!span_fits(cache, pages) && cache->prepared_chunk != NO_CHUNK && maintenance_wait(cache)) {
+        advance_chunk(cache);
+    }
+    if (!span_fits(cache, pages) && !drop_next_chunk(cache)) {
+        if (cache->verbose) {
+            printf("All chunks have open write locks\n");
+        }
+        return EMPTY_DESC;
+    }
+    // Evacuation keeps at most half of the victim, spans are at most half of a chunk
+    assert(span_fits(cache, pages));
+
+    struct chunk* chunk = &cache->chunks[cache->current_chunk_idx];
+    struct entry_descriptor desc = { .chunk = cache->current_chunk_idx, .index = chunk->len };
+    prefault_blank(cache, chunk, chunk->len + pages);
+    blank_reset(cache, desc, pages);
+    __atomic_store_n(&chunk->len, chunk->len + pages, __ATOMIC_RELEASE);
+    cache->total_free_pages -= pages;
+    return desc;
+}
+
+static lazyfree_wlock_t wlock_new(struct lazyfree_cache* cache, lazyfree_key_t key, struct entry_descriptor desc) {
+    struct chunk* chunk = &cache->chunks[desc.chunk];
+    chunk->writers++;
+
+    lazyfree_wlock_t wlock = {0};
+    wlock_impl_t *wlock_impl = (wlock_impl_t*) &wlock;
+    wlock_impl->key = key;
+    wlock_impl->page = (uint8_t*) &chunk->entries[desc.index];
+    wlock_impl->_chunk = desc.chunk;
+    wlock_impl->_index = desc.index;
+    return wlock;
+}
+
+lazyfree_wlock_t lazyfree_write_alloc(lazyfree_cache_t cache, lazyfree_key_t key, uint32_t pages) {
+    // Replaced page is released now, unless someone is still writing it
+    struct entry_descriptor old = hmap_get(cache, key);
+    if (old.chunk != EMPTY_DESC.chunk && seq_read(&cache->chunks[old.chunk], old.index) % 2 == 0) {
+        seq_bump(&cache->chunks[old.chunk], old.index);
+        cache_drop(cache, old);
+    }
+
+    if (pages > cache->pages_per_chunk / 2 || pages > UINT16_MAX) {
+        if (cache->verbose) {
+            printf("Entry of %u pages doesn't fit in a chunk\n", pages);
+        }
+        lazyfree_wlock_t wlock = { .key = key, .page = NULL };
+        return wlock;
+    }
 
+    if (cache->maintenance != NULL) {
+        maintenance_drain(cache);
+    }
     // Looking for a free page
-    struct entry_descriptor desc = alloc_new_page(cache);
+    struct entry_descriptor desc = pages > 1 ? alloc_span(cache, pages) : alloc_new_page(cache);
+    if (desc.chunk == EMPTY_DESC.chunk) {
+        lazyfree_wlock_t wlock = { .key = key, .page = NULL };
+        return wlock;
+    }
     struct chunk* chunk = &cache->chunks[desc.chunk];
-    struct discardable_entry* entry = &chunk->entries[desc.index];
+    if (cache->sweep_left > 0) {
+        size_t slots = cache->sweep_left < cache->sweep_budget ? cache->sweep_left : cache->sweep_budget;
+        sweep_index(cache, slots);
+        cache->sweep_left -= slots;
+    }
+    prepare_next_chunk(cache);
 
-    cache->wlock_chunk = desc.chunk;
-    cache->wlock_index = desc.index;
-    cache->wlock_key = key;
+    seq_write_begin(chunk, desc.index);
     hmap_put(cache, key, desc);
-    chunk->keys[desc.index] = cache->wlock_key;
+    chunk->keys[desc.index] = key;
+    chunk->spans[desc.index] = pages;
+    if (cache->evacuate_hot) {
+        bitset_put_atomic(chunk->accessed, desc.index, false);
+    }
     
-    return entry;
+    return wlock_new(cache, key, desc);
 }
 
 
-void* lazyfree_write_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
+lazyfree_wlock_t lazyfree_write_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
     rlock_impl_t *lock_impl = (rlock_impl_t*) lock;
-    assert(cache->wlock_chunk == EMPTY_DESC.chunk);
+    uint32_t pages = lock_impl->pages ? lock_impl->pages : 1;
     
     if (lock_impl->head == NULL) {
         // This is an empty lock
-        return lazyfree_write_alloc(cache, lock_impl->key);
+        return lazyfree_write_alloc(cache, lock_impl->key, pages);
     }
 
     if (lock_impl->head == EMPTY_PAGE) {
         // This is an empty entry
-        return lazyfree_write_alloc(cache, lock_impl->key);
+        return lazyfree_write_alloc(cache, lock_impl->key, pages);
     }
     assert(lock_impl->_chunk != EMPTY_DESC.chunk);
 
 
-    if (!rlock_check_key(cache, lock_impl)) {
+    if (!rlock_check_key(cache, lock_impl) || !rlock_check_seq(cache, lock_impl)) {
         // This is now some other key
         lock_impl->head = NULL;
-        return lazyfree_write_alloc(cache, lock_impl->key);
+        return lazyfree_write_alloc(cache, lock_impl->key, pages);
     }
 
-    // Use first byte to lock the page
-    uint8_t byte0 = lock_impl->head[0];
-    lock_impl->head[0] = 1;
-    if (!LAZYFREE_LOCK_CHECK(*lock)) {
-        lock_impl->head[0] = 0;
+    struct chunk* chunk = &cache->chunks[lock_impl->_chunk];
+    if (span_pages(chunk, lock_impl->_index) != pages || chunk->queued) {
+        // Resized entry, or the maintenance thread may be advising the chunk: a new span replaces it
         lock_impl->head = NULL;
-        printf("DEBUG: Page updated during lock upgrade\n");
-        return lazyfree_write_alloc(cache, lock_impl->key);
+        return lazyfree_write_alloc(cache, lock_impl->key, pages);
     }
-    lock_impl->head[0] = byte0;
-    
-    // Set wlock
-    cache->wlock_chunk = lock_impl->_chunk;
-    cache->wlock_index = lock_impl->_index;
-    cache->wlock_key   = lock_impl->key;
-    // Already in hashmap and keys
-    
-    struct chunk* chunk = &cache->chunks[lock_impl->_chunk];
+
     struct discardable_entry* entry = &chunk->entries[lock_impl->_index];
+    seq_write_begin(chunk, lock_impl->_index);
+
+    // Use first byte to lock every page
+    for (uint32_t i = 0; i < pages; ++i) {
+        uint8_t byte0 = entry[i].head[0];
+        entry[i].head[0] = 1;
+        if (entry[i].tail == 0) {
+            entry[i].head[0] = 0;
+            seq_write_end(chunk, lock_impl->_index);
+            lock_impl->head = NULL;
+            printf("DEBUG: Page updated during lock upgrade\n");
+            return lazyfree_write_alloc(cache, lock_impl->key, pages);
+        }
+        entry[i].head[0] = byte0;
+    }
+    // Already in hashmap and keys
 
-    bit_to_tail(chunk, lock_impl->_index, &entry->tail);
-    return (uint8_t*) entry;
-}
+    bit_to_tail(chunk, lock_impl->_index + pages - 1, &entry[pages - 1].tail);
 
-void lazyfree_write_unlock(lazyfree_cache_t cache, bool drop) {
-    assert(cache->wlock_chunk != EMPTY_DESC.chunk);
+    struct entry_descriptor desc = { .chunk = lock_impl->_chunk, .index = lock_impl->_index };
+    return wlock_new(cache, lock_impl->key, desc);
+}
 
+bool lazyfree_write_unlock(lazyfree_cache_t cache, lazyfree_wlock_t* wlock, bool drop) {
+    wlock_impl_t *wlock_impl = (wlock_impl_t*) wlock;
+    if (wlock_impl->page == NULL) {
+        // Nothing was allocated
+        return false;
+    }
 
     struct entry_descriptor desc = {
-        .chunk = cache->wlock_chunk,
-        .index = cache->wlock_index,
+        .chunk = wlock_impl->_chunk,
+        .index = wlock_impl->_index,
     };
+    struct chunk* chunk = &cache->chunks[desc.chunk];
+    assert(chunk->writers > 0);
+    assert(seq_read(chunk, desc.index) % 2 == 1);
+    wlock_impl->page = NULL;
 
-    cache->wlock_chunk = EMPTY_DESC.chunk;
+    // Another write of the same key could have replaced this page
+    struct entry_descriptor current = hmap_get(cache, wlock_impl->key);
+    bool installed = current.chunk == desc.chunk && current.index == desc.index;
 
-    if (drop) {
+    if (drop || !installed) {
         cache_drop(cache, desc);
-        return;
-    } 
-    // Move bit0 from head to bit0
-    struct chunk* chunk = &cache->chunks[desc.chunk];
-    struct discardable_entry* entry = &chunk->entries[desc.index];
-    bit_from_tail(chunk, desc.index, &entry->tail);  
+        cache->write_counters.explicit_drops += drop;
+    } else {
+        // Reserved bytes of the span, then move bit0 of the last byte to bit0
+        struct discardable_entry* entry = &chunk->entries[desc.index];
+        uint32_t pages = span_pages(chunk, desc.index);
+        for (uint32_t i = 0; i + 1 < pages; ++i) {
+            entry[i].tail = 1;
+        }
+        bit_from_tail(chunk, desc.index + pages - 1, &entry[pages - 1].tail);
+    }
+    seq_write_end(chunk, desc.index);
+
+    chunk->writers--;
+    if (chunk->writers == 0 && chunk->advise_pending) {
+        chunk->advise_pending = false;
+        advise_chunk(cache, desc.chunk);
+    }
+    return installed && !drop;
+}
+
+
+
+// == Resize ==
+
+// Fewest live pages first, then fewest LFU hits.
+static size_t pick_retired(struct lazyfree_cache* cache) {
+    size_t best = cache->chunks_count;
+    for (size_t i = 0; i < cache->chunks_count; ++i) {
+        struct chunk* chunk = &cache->chunks[i];
+        if (!victim_allowed(cache, i)) {
+            continue;
+        }
+        if (best == cache->chunks_count) {
+            best = i;
+            continue;
+        }
+        struct chunk* other = &cache->chunks[best];
+        uint32_t live = chunk->len - chunk->free_pages_count;
+        uint32_t other_live = other->len - other->free_pages_count;
+        if (live < other_live || (live == other_live && chunk->hits < other->hits)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Drops all pages and releases the memory, the mapping stays for concurrent readers.
+static void retire_chunk(struct lazyfree_cache* cache, size_t idx) {
+    struct chunk* chunk = &cache->chunks[idx];
+    uint32_t len = chunk->len;
+    // Live entries are lost the same as in a drop
+    cache->write_counters.pages_evicted += len - chunk->free_pages_count;
+    // Keys and spans stay for blank_reset
+    chunk_invalidate(cache, chunk, 0);
+    int ret = madvise(chunk->entries, cache->chunk_size, MADV_DONTNEED);
+    count_madvise(cache, cache->chunk_size);
+    if (ret != 0) {
+        printf("MADV_DONTNEED failed: %d\n", ret);
+        exit(1);
+    }
+    memset(chunk->accessed, 0, (cache->pages_per_chunk + 7) / 8);
+
+    cache->total_free_pages -= chunk->free_pages_count + (cache->pages_per_chunk - len);
+    chunk->populated = 0;
+    chunk->free_pages_count = 0;
+    chunk->advise_pending = false;
+    chunk->advised = false;
+    chunk->hits = 0;
+    chunk->referenced = 0;
+    chunk->retired = true;
+    cache->active_chunks--;
+}
+
+static void revive_chunk(struct lazyfree_cache* cache, size_t idx) {
+    cache->chunks[idx].retired = false;
+    cache->total_free_pages += cache->pages_per_chunk;
+    cache->active_chunks++;
+}
+
+bool lazyfree_cache_resize(lazyfree_cache_t cache, size_t new_capacity) {
+    size_t target = new_capacity / cache->chunk_size;
+    bool ok = true;
+    if (target == 0) {
+        target = 1;
+        ok = false;
+    }
+    if (target > cache->max_chunks) {
+        target = cache->max_chunks;
+        ok = false;
+    }
+
+    while (cache->active_chunks > target) {
+        size_t idx = pick_retired(cache);
+        if (idx == cache->chunks_count) {
+            // Every chunk has open write locks
+            ok = false;
+            break;
+        }
+        retire_chunk(cache, idx);
+    }
+
+    // Retired chunks are still mapped, reuse them first
+    for (size_t i = 0; i < cache->chunks_count && cache->active_chunks < target; ++i) {
+        if (cache->chunks[i].retired) {
+            revive_chunk(cache, i);
+        }
+    }
+    while (cache->active_chunks < target) {
+        // Same memory kind as the last chunk
+        struct chunk* last = &cache->chunks[cache->chunks_count - 1];
+        struct chunk* chunk = &cache->chunks[cache->chunks_count];
+        chunk->mmap_impl = last->mmap_impl;
+        chunk->madv_impl = last->madv_impl;
+        chunk_init(cache, chunk);
+        // Readers check descriptors against chunks_count
+        __atomic_store_n(&cache->chunks_count, cache->chunks_count + 1, __ATOMIC_RELEASE);
+        cache->total_free_pages += cache->pages_per_chunk;
+        cache->active_chunks++;
+    }
+
+    cache->cache_capacity = cache->active_chunks * cache->chunk_size;
+    if (cache->verbose) {
+        printf("DEBUG: Resized to %zu chunks of %zu\n", cache->active_chunks, cache->chunks_count);
+    }
+    return ok;
 }
 
+// == Scrub ==
+
+// Purges reclaimed pages of advised chunks, resuming where the last call stopped.
+size_t lazyfree_cache_scrub(lazyfree_cache_t cache, size_t max_pages) {
+    unsigned char vec[LAZYFREE_SCRUB_BATCH];
+    size_t purged = 0;
+    size_t scanned = 0;
+    size_t chunks_visited = 0;
+    while (scanned < max_pages && chunks_visited <= cache->chunks_count) {
+        struct chunk* chunk = &cache->chunks[cache->scrub_chunk];
+        if (!chunk->advised || cache->scrub_index >= chunk->len) {
+            cache->scrub_chunk = (cache->scrub_chunk + 1) % cache->chunks_count;
+            cache->scrub_index = 0;
+            chunks_visited++;
+            continue;
+        }
 
+        size_t batch = chunk->len - cache->scrub_index;
+        if (batch > LAZYFREE_SCRUB_BATCH) {
+            batch = LAZYFREE_SCRUB_BATCH;
+        }
+        if (batch > max_pages - scanned) {
+            batch = max_pages - scanned;
+        }
+        if (mincore((void*) &chunk->entries[cache->scrub_index], batch * PAGE_SIZE, vec) != 0) {
+            perror("mincore");
+            exit(1);
+        }
+        for (size_t i = 0; i < batch; ++i) {
+            uint32_t index = cache->scrub_index + i;
+            lazyfree_key_t key = chunk->keys[index];
+            if (chunk->spans[index] == 0 || seq_read(chunk, index) % 2 == 1) {
+                continue;
+            }
+            // A span is dropped if any of its pages is gone. Tails of resident
+            // pages are read without a fault, a reader could have mapped the zero page.
+            uint32_t pages = span_pages(chunk, index);
+            size_t in_batch = i + pages <= batch ? pages : batch - i;
+            bool resident = true;
+            for (size_t k = 0; k < in_batch && resident; ++k) {
+                resident = vec[i + k] & 1;
+            }
+            if (resident && in_batch < pages) {
+                resident = pages_resident(&chunk->entries[index + in_batch], pages - in_batch);
+            }
+            if (resident && (pages == 1 || span_valid(chunk, index, pages))) {
+                continue;
+            }
+            struct entry_descriptor desc = { .chunk = cache->scrub_chunk, .index = index };
+            struct entry_descriptor current = hmap_get(cache, key);
+            if (current.chunk != desc.chunk || current.index != desc.index) {
+                continue;
+            }
+            seq_bump(chunk, index);
+            cache_drop(cache, desc);
+            purged++;
+        }
+        cache->scrub_index += batch;
+        scanned += batch;
+    }
+    cache->write_counters.pages_scrubbed += purged;
+    if (cache->verbose && purged > 0) {
+        printf("DEBUG: Scrubbed %zu reclaimed pages\n", purged);
+    }
+    return purged;
+}
 
-struct lazyfree_stats lazyfree_fetch_stats(lazyfree_cache_t cache, bool verbose) {
+struct lazyfree_stats lazyfree_fetch_stats(lazyfree_cache_t cache) {
     struct lazyfree_cache* lazyfree_cache = (struct lazyfree_cache*) cache;
-    struct lazyfree_stats stats;
-    stats.total_pages = lazyfree_cache->cache_capacity / PAGE_SIZE;
+    struct lazyfree_stats stats = {0};
+    stats.total_pages = lazyfree_cache->active_chunks * lazyfree_cache->pages_per_chunk;
     stats.free_pages = lazyfree_cache->total_free_pages;
-    print_stats(cache);
-    lazyfree_cache->verbose = verbose;
+
+    for (size_t i = 0; i < READ_SLOTS; ++i) {
+        struct read_counters* counters = &lazyfree_cache->read_counters[i];
+        stats.lookups += __atomic_load_n(&counters->lookups, __ATOMIC_RELAXED);
+        stats.miss_absent += __atomic_load_n(&counters->absent, __ATOMIC_RELAXED);
+        stats.miss_writing += __atomic_load_n(&counters->writing, __ATOMIC_RELAXED);
+        stats.miss_dropped += __atomic_load_n(&counters->dropped, __ATOMIC_RELAXED);
+        stats.miss_reclaimed += __atomic_load_n(&counters->reclaimed, __ATOMIC_RELAXED);
+        stats.miss_invalidated += __atomic_load_n(&counters->invalidated, __ATOMIC_RELAXED);
+    }
+    uint64_t misses = stats.miss_absent + stats.miss_writing + stats.miss_dropped +
+                      stats.miss_reclaimed + stats.miss_invalidated;
+    stats.hits = stats.lookups > misses ? stats.lookups - misses : 0;
+
+    struct write_counters* counters = &lazyfree_cache->write_counters;
+    stats.explicit_drops = counters->explicit_drops;
+    stats.chunk_drops = counters->chunk_drops;
+    stats.pages_evicted = counters->pages_evicted;
+    stats.pages_evacuated = counters->pages_evacuated;
+    stats.pages_scrubbed = counters->pages_scrubbed;
+    stats.madvise_calls = __atomic_load_n(&counters->madvise_calls, __ATOMIC_RELAXED);
+    stats.bytes_advised = __atomic_load_n(&counters->bytes_advised, __ATOMIC_RELAXED);
+    stats.maintenance_waits = counters->maintenance_waits;
     return stats;
 }
 
+void lazyfree_set_verbose(lazyfree_cache_t cache, bool verbose) {
+    cache->verbose = verbose;
+}
+
 
 // == Tests
+// Calls with side effects keep their result in a variable, the asserts only read it.
 
-void lazyfree_cache_tests() {
-    volatile uint64_t value = random_next();    
+// Tail writes, and writes of the same key that overlap.
+static void test_writes() {
+    volatile uint64_t value = random_next();
     lazyfree_cache_t cache = lazyfree_cache_new(32*NUMBER_OF_CHUNKS*PAGE_SIZE);
     uint64_t* ptr = NULL;
-    lazyfree_rlock_t lock;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
     uint64_t result;
-    
-    
+    bool ok;
+    UNUSED(ok);
+
     // // HEAD WRITE
     // ptr = lazyfree_write_alloc(cache, 1);
     // *ptr = value;
@@ -582,13 +1766,12 @@ void lazyfree_cache_tests() {
     // lazyfree_read_unlock(cache, &lock, false);
     // // END HEAD WRITE
 
-
     // TAIL WRITE
     lock.key = 2;
-    ptr = lazyfree_write_lock(cache, &lock);
+    wlock = lazyfree_write_lock(cache, &lock);
+    ptr = (uint64_t*) wlock.page;
     ptr[PAGE_SIZE/sizeof(uint64_t) - 1] = value + 1;
-    lazyfree_write_unlock(cache, false);
-
+    lazyfree_write_unlock(cache, &wlock, false);
 
     lazyfree_read_lock(cache, &lock);
     lazyfree_read(&lock, &result, PAGE_SIZE-sizeof(uint64_t), sizeof(uint64_t));
@@ -600,5 +1783,827 @@ void lazyfree_cache_tests() {
     lazyfree_read_unlock(cache, &lock, false);
     // END TAIL WRITE
 
+    // MULTIPLE WRITES
+    lazyfree_rlock_t locks[3] = {{.key = 3}, {.key = 4}, {.key = 3}};
+    lazyfree_wlock_t wlocks[3];
+    for (size_t i = 0; i < 3; ++i) {
+        wlocks[i] = lazyfree_write_lock(cache, &locks[i]);
+        ((uint64_t*) wlocks[i].page)[0] = value + i;
+    }
+
+    // Pages being written are not readable
+    lock.key = 4;
+    lazyfree_read_lock(cache, &lock);
+    assert(!LAZYFREE_LOCK_CHECK(lock));
+
+    // Second write of key 3 replaced the first one
+    ok = lazyfree_write_unlock(cache, &wlocks[1], false);
+    assert(ok);
+    ok = lazyfree_write_unlock(cache, &wlocks[0], false);
+    assert(!ok);
+    ok = lazyfree_write_unlock(cache, &wlocks[2], false);
+    assert(ok);
+
+    for (size_t i = 1; i < 3; ++i) {
+        lazyfree_read_lock(cache, &locks[i]);
+        lazyfree_read(&locks[i], &result, 0, sizeof(uint64_t));
+        assert(result == value + i);
+        ok = lazyfree_read_unlock(cache, &locks[i], false);
+        assert(ok);
+    }
+    // END MULTIPLE WRITES
+
+    lazyfree_cache_free(cache);
+}
+
+// Hot pages of the victim survive its drop.
+static void test_evacuation() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .anon_chunks = NUMBER_OF_CHUNKS,
+        .policy = LAZYFREE_POLICY_FIFO,
+        .evacuate_hot = true,
+    });
+    // Fill the cache, the first chunk is dropped next
+    for (size_t key = 1; key <= pages + 1; ++key) {
+        if (key == pages + 1) {
+            // Read the first page
+            lock.key = 1;
+            lazyfree_read_lock(cache, &lock);
+            ok = lazyfree_read_unlock(cache, &lock, false);
+            assert(ok);
+        }
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+
+    // Hot page survived the drop, its neighbour didn't
+    lock.key = 1;
+    lazyfree_read_lock(cache, &lock);
+    lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(ok);
+    assert(result == value + 1);
+
+    lock.key = 2;
+    lazyfree_read_lock(cache, &lock);
+    assert(!LAZYFREE_LOCK_CHECK(lock));
+    lazyfree_cache_free(cache);
+
+    // Same with a nearly full index, evacuation must not sweep the victim's entries
+    cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .anon_chunks = NUMBER_OF_CHUNKS,
+        .policy = LAZYFREE_POLICY_FIFO,
+        .evacuate_hot = true,
+    });
+    for (size_t key = 1; key <= pages; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    for (size_t key = 1; key <= cache->pages_per_chunk; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok);
+    }
+    // One more insert would take the index over 7/8
+    for (uint64_t key = UINT64_MAX; (cache->map.size + 1) * 8 <= cache->map.capacity * 7; --key) {
+        hmap_put(cache, key, (struct entry_descriptor){ .chunk = 1 });
+    }
+    lock.key = pages + 1;
+    lock.head = NULL;
+    wlock = lazyfree_write_lock(cache, &lock);
+    ok = lazyfree_write_unlock(cache, &wlock, false);
+    assert(ok);
+    assert(lazyfree_fetch_stats(cache).pages_evacuated == cache->pages_per_chunk / 2);
+    for (size_t key = 1; key <= cache->pages_per_chunk / 2; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok);
+        assert(result == value + key);
+    }
+    lazyfree_cache_free(cache);
+
+    // Advised victim: the first page stays in its slot and is still lazily freed, the second is copied
+    for (size_t hot_key = 1; hot_key <= 2; ++hot_key) {
+        cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+            .lazyfree_chunks = NUMBER_OF_CHUNKS,
+            .policy = LAZYFREE_POLICY_FIFO,
+            .evacuate_hot = true,
+        });
+        for (size_t key = 1; key <= pages + 1; ++key) {
+            if (key == pages + 1) {
+                lock.key = hot_key;
+                lazyfree_read_lock(cache, &lock);
+                lazyfree_read_unlock(cache, &lock, false);
+            }
+            lock.key = key;
+            lock.head = NULL;
+            wlock = lazyfree_write_lock(cache, &lock);
+            ok = lazyfree_write_unlock(cache, &wlock, false);
+            assert(ok);
+        }
+        assert(lazyfree_fetch_stats(cache).chunk_drops == 1);
+        assert(cache->chunks[0].advised == (hot_key == 1));
+        lazyfree_cache_free(cache);
+    }
+}
+
+// More chunks than int8_t indexes, with drops and batched lookups.
+static void test_many_chunks() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    // 256 chunks of 2 pages, more than int8_t can index
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .anon_chunks = 1,
+        .chunk_size = 2*PAGE_SIZE,
+    });
+    for (size_t key = 1; key <= 2*pages; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    size_t hits = 0;
+    for (size_t key = 1; key <= 2*pages; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        if (lazyfree_read_unlock(cache, &lock, false)) {
+            assert(result == value + key);
+            hits++;
+        }
+    }
+    assert(hits > 0 && hits <= pages);
+    struct lazyfree_stats stats = lazyfree_fetch_stats(cache);
+    UNUSED(stats);
+    assert(stats.lookups == 2*pages && stats.hits == hits);
+    // Entries of dropped chunks that were not swept yet miss as dropped
+    assert(stats.miss_absent + stats.miss_dropped == 2*pages - hits);
+    assert(stats.chunk_drops == pages/2 && stats.pages_evicted == pages);
+
+    // Batched lookup finds the same pages, windows don't have to be full
+    lazyfree_rlock_t* many = calloc(2*pages, sizeof(lazyfree_rlock_t));
+    for (size_t key = 1; key <= 2*pages; ++key) {
+        many[key - 1].key = key;
+    }
+    lazyfree_read_lock_many(cache, many, 2*pages);
+    size_t many_hits = 0;
+    for (size_t key = 1; key <= 2*pages; ++key) {
+        lazyfree_read(&many[key - 1], &result, 0, sizeof(uint64_t));
+        if (lazyfree_read_unlock(cache, &many[key - 1], false)) {
+            assert(result == value + key);
+            many_hits++;
+        }
+    }
+    assert(many_hits == hits);
+    free(many);
+
+    lazyfree_cache_free(cache);
+}
+
+// Shrinking retires the empty chunks first, growing adds chunks back.
+static void test_resize() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .anon_chunks = NUMBER_OF_CHUNKS,
+        .max_capacity = 2*pages*PAGE_SIZE,
+    });
+    for (size_t key = 1; key <= 2*pages; ++key) {
+        if (key == pages/2 + 1) {
+            // Half of the chunks are full, the rest empty
+            ok = lazyfree_cache_resize(cache, pages/2*PAGE_SIZE);
+            assert(ok);
+            assert(cache->active_chunks * cache->pages_per_chunk == pages/2);
+            assert(cache->total_free_pages == 0);
+        }
+        if (key == pages/2 + 1 + pages/4) {
+            ok = lazyfree_cache_resize(cache, 2*pages*PAGE_SIZE);
+            assert(ok);
+        }
+        if (key <= pages/2 || key > pages/2 + pages/4) {
+            lock.key = key;
+            lock.head = NULL;
+            wlock = lazyfree_write_lock(cache, &lock);
+            ((uint64_t*) wlock.page)[0] = value + key;
+            ok = lazyfree_write_unlock(cache, &wlock, false);
+            assert(ok);
+        }
+    }
+    // Nothing was dropped: the empty chunks were retired, then the cache grew
+    for (size_t key = 1; key <= 2*pages; ++key) {
+        if (key > pages/2 && key <= pages/2 + pages/4) {
+            continue;
+        }
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok);
+        assert(result == value + key);
+    }
+    ok = lazyfree_cache_resize(cache, 4*pages*PAGE_SIZE);
+    assert(!ok);
+    assert(cache->active_chunks * cache->pages_per_chunk == 2*pages);
+    assert(lazyfree_fetch_stats(cache).pages_evicted == 0);
+    // Shrinking never retires the chunk being written
+    ok = lazyfree_cache_resize(cache, cache->chunk_size);
+    assert(ok);
+    assert(cache->active_chunks == 1);
+    struct chunk* current = &cache->chunks[cache->current_chunk_idx];
+    UNUSED(current);
+    assert(!current->retired);
+    // Every other entry was evicted with its chunk
+    assert(lazyfree_fetch_stats(cache).pages_evicted == 2*pages - pages/4 - (current->len - current->free_pages_count));
+
+    lazyfree_cache_free(cache);
+}
+
+// Pages the kernel reclaimed from an advised chunk miss.
+static void test_residency() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+    int ret;
+    UNUSED(ret);
+    size_t scrubbed;
+    UNUSED(scrubbed);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS,
+        .residency_check = true,
+    });
+    // Fill two chunks, the first one is advised
+    for (size_t key = 1; key <= 64; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    assert(cache->chunks[0].advised && !cache->chunks[1].advised);
+    // Same as a kernel reclaim of the first page
+    struct discardable_entry* reclaimed = &cache->chunks[0].entries[0];
+    ret = madvise(reclaimed, PAGE_SIZE, MADV_DONTNEED);
+    assert(ret == 0);
+
+    lock.key = 1;
+    lazyfree_read_lock(cache, &lock);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(!ok);
+    assert(!pages_resident(reclaimed, 1));
+    struct lazyfree_stats stats = lazyfree_fetch_stats(cache);
+    UNUSED(stats);
+    assert(stats.lookups == 1 && stats.miss_reclaimed == 1);
+    assert(stats.madvise_calls == 1 && stats.bytes_advised == cache->chunk_size);
+
+    size_t index_size = u64map_size(&cache->map);
+    UNUSED(index_size);
+    scrubbed = lazyfree_cache_scrub(cache, pages);
+    assert(scrubbed == 1);
+    assert(u64map_size(&cache->map) == index_size - 1);
+    assert(cache->chunks[0].free_pages_count == 1);
+    assert(!pages_resident(reclaimed, 1));
+    assert(lazyfree_fetch_stats(cache).pages_scrubbed == 1);
+
+    lock.key = 2;
+    lazyfree_read_lock(cache, &lock);
+    lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(ok);
+    assert(result == value + 2);
+
+    lazyfree_cache_free(cache);
+}
+
+// Advised chunks go through the swap tier and read back.
+static void test_swap_tier() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS / 2,
+        .swap_chunks = NUMBER_OF_CHUNKS / 2,
+    });
+    assert(cache->chunks[NUMBER_OF_CHUNKS - 1].madv_impl == lazyfree_madv_pageout);
+    // Fill all chunks and start the last, every other one is advised in turn
+    for (size_t key = 1; key <= pages - 31; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    struct lazyfree_stats stats = lazyfree_fetch_stats(cache);
+    UNUSED(stats);
+    assert(stats.madvise_calls == NUMBER_OF_CHUNKS - 1);
+    assert(cache->chunks[0].advised && !cache->chunks[NUMBER_OF_CHUNKS - 2].advised);
+    // Paged out entries are read back from swap, or were never paged out without it
+    for (size_t key = pages / 2 + 1; key <= pages - 31; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok);
+        assert(result == value + key);
+    }
+
+    lazyfree_cache_free(cache);
+}
+
+// A dropped chunk leaves stale entries only, the sweep erases them.
+static void test_epochs() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_rlock_t held;
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS,
+        .policy = LAZYFREE_POLICY_FIFO,
+    });
+    for (size_t key = 1; key <= pages + 1; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+        if (key == 2) {
+            // Held across the drop of its chunk
+            lock.key = 1;
+            lazyfree_read_lock(cache, &lock);
+            held = lock;
+        }
+    }
+    // The first chunk was dropped by the last write, its entries are only stale
+    assert(lazyfree_fetch_stats(cache).chunk_drops == 1);
+    assert(cache->chunks[0].epoch == 1 && cache->chunks[0].len == 1);
+    ok = lazyfree_read_unlock(cache, &held, false);
+    assert(!ok);
+    lock.key = 2;
+    lazyfree_read_lock(cache, &lock);
+    assert(!LAZYFREE_LOCK_CHECK(lock));
+    // The sweep goes on with the next writes, a full pass leaves the live entries only
+    assert(cache->sweep_left > 0 && u64map_size(&cache->map) > pages - 31);
+    sweep_index(cache, cache->map.capacity);
+    assert(u64map_size(&cache->map) == pages - 31);
+    for (size_t key = 33; key <= pages + 1; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok);
+        assert(result == value + key);
+    }
+
     lazyfree_cache_free(cache);
 }
+
+// Under 15 bytes of index per page, stale entries included.
+static void test_index_size() {
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+
+    lazyfree_cache_t cache = lazyfree_cache_new(pages*PAGE_SIZE);
+    assert(u64map_memory(&cache->map) < 15 * cache->max_chunks * cache->pages_per_chunk);
+    assert(cache->index_bits == 5);
+
+    lazyfree_cache_free(cache);
+}
+
+// Key 0 is a valid key, the rest of a span doesn't match it.
+static void test_key_zero() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .anon_chunks = NUMBER_OF_CHUNKS,
+        .policy = LAZYFREE_POLICY_FIFO,
+    });
+    // Key 0 takes the third page of the first chunk
+    for (size_t i = 0; i < 3; ++i) {
+        lock = (lazyfree_rlock_t){ .key = i < 2 ? pages + i : 0 };
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    struct entry_descriptor zero = hmap_lookup(cache, 0);
+    assert(zero.index == 2);
+    // Until the writes are back in the first chunk, it was dropped then
+    bool moved_on = false;
+    for (size_t key = 1; !moved_on || cache->current_chunk_idx != (size_t) zero.chunk; ++key) {
+        lock = (lazyfree_rlock_t){ .key = key };
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+        moved_on |= cache->current_chunk_idx != (size_t) zero.chunk;
+    }
+    // The page of key 0 is the rest of a span now
+    uint8_t pair[LAZYFREE_ENTRY_CAPACITY(2)];
+    memset(pair, 0xAB, sizeof(pair));
+    lock = (lazyfree_rlock_t){ .key = pages + 2, .pages = 2 };
+    wlock = lazyfree_write_lock(cache, &lock);
+    lazyfree_write_entry(wlock.page, 2, pair, sizeof(pair));
+    ok = lazyfree_write_unlock(cache, &wlock, false);
+    assert(ok);
+    struct chunk* first = &cache->chunks[zero.chunk];
+    UNUSED(first);
+    assert(first->len == 3 && first->spans[1] == 2 && first->keys[2] == 0 && first->spans[2] == 0);
+    assert(hmap_lookup(cache, 0).chunk == EMPTY_DESC.chunk);
+    lock = (lazyfree_rlock_t){ .key = 0 };
+    lazyfree_read_lock(cache, &lock);
+    assert(!LAZYFREE_LOCK_CHECK(lock));
+
+    // Written again, it reads back
+    wlock = lazyfree_write_lock(cache, &lock);
+    ((uint64_t*) wlock.page)[0] = value + 1;
+    ok = lazyfree_write_unlock(cache, &wlock, false);
+    assert(ok);
+    lazyfree_read_lock(cache, &lock);
+    lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(ok);
+    assert(result == value + 1);
+
+    lazyfree_cache_free(cache);
+}
+
+// The maintenance thread drops the next victim ahead of time.
+static void test_maintenance() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS,
+        .policy = LAZYFREE_POLICY_FIFO,
+        .maintenance_thread = true,
+    });
+    size_t half_chunk = cache->pages_per_chunk / 2;
+    for (size_t key = 1; key <= pages - half_chunk + 1; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    // Below the watermark the first chunk is dropped ahead, while the last one is filled
+    assert(cache->prepared_chunk == 0 && cache->current_chunk_idx == NUMBER_OF_CHUNKS - 1);
+    assert(lazyfree_fetch_stats(cache).chunk_drops == 1);
+    lock.key = 1;
+    lazyfree_read_lock(cache, &lock);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(!ok);
+    ok = maintenance_wait(cache);
+    assert(ok);
+    assert(cache->chunks[0].len == 0 && cache->chunks[1].advised && !cache->chunks[1].queued);
+    assert(cache->total_free_pages == half_chunk - 1 + cache->pages_per_chunk);
+
+    // The rest of the last chunk, then the prepared one is taken without another drop
+    for (size_t key = pages - half_chunk + 2; key <= pages + 1; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    assert(cache->current_chunk_idx == 0 && cache->chunks[0].len == 1);
+    struct lazyfree_stats stats = lazyfree_fetch_stats(cache);
+    UNUSED(stats);
+    assert(stats.chunk_drops == 1 && stats.maintenance_waits == 1);
+    for (size_t key = cache->pages_per_chunk + 1; key <= pages + 1; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok);
+        assert(result == value + key);
+    }
+
+    // Drops while a chunk is prepared leave it to the thread
+    size_t key = pages + 2;
+    for (; cache->prepared_chunk == NO_CHUNK; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    size_t prepared = cache->prepared_chunk;
+    UNUSED(prepared);
+    uint64_t drops = lazyfree_fetch_stats(cache).chunk_drops;
+    UNUSED(drops);
+    ok = drop_next_chunk(cache);
+    assert(ok);
+    assert(cache->current_chunk_idx != prepared && cache->prepared_chunk == prepared);
+    assert(lazyfree_fetch_stats(cache).chunk_drops == drops + 1);
+    // Until the thread is done with the prepared chunk, writes would go to any chunk with room
+    maintenance_wait(cache);
+    // The dropped chunk is filled first, then the prepared one is taken without another drop
+    for (size_t i = 0; i <= cache->pages_per_chunk; ++i, ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+        assert(cache->prepared_chunk != cache->current_chunk_idx);
+    }
+    assert(cache->current_chunk_idx == prepared && cache->prepared_chunk == NO_CHUNK);
+    assert(lazyfree_fetch_stats(cache).chunk_drops == drops + 1);
+
+    lazyfree_cache_free(cache);
+}
+
+// Blank pages are populated a batch at a time.
+static void test_prefault() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    bool ok;
+    UNUSED(ok);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS,
+        .policy = LAZYFREE_POLICY_FIFO,
+        .prefault = true,
+    });
+    size_t chunk_pages = cache->pages_per_chunk;
+    UNUSED(chunk_pages);
+    for (size_t key = 1; key <= pages + 1; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+        if (key == 1) {
+            // The first write populates the whole batch, the next chunk is untouched
+            assert(cache->chunks[0].populated == chunk_pages);
+            assert(pages_resident(&cache->chunks[0].entries[1], chunk_pages - 1));
+            assert(!pages_resident(&cache->chunks[1].entries[0], 1));
+        }
+    }
+    // Pages released by the drop are populated again
+    assert(lazyfree_fetch_stats(cache).chunk_drops == 1);
+    assert(cache->chunks[0].len == 1 && cache->chunks[0].populated == chunk_pages);
+    assert(pages_resident(&cache->chunks[0].entries[1], chunk_pages - 1));
+
+    lazyfree_cache_free(cache);
+}
+
+// Chunks of whole huge pages, a reclaim splits them.
+static void test_huge_pages() {
+    volatile uint64_t value = random_next();
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    uint64_t result;
+    bool ok;
+    UNUSED(ok);
+    int ret;
+    UNUSED(ret);
+
+    // Not a multiple of 2Mb, chunks are rounded down
+    size_t huge_pages = HUGE_PAGE_SIZE / PAGE_SIZE;
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(4*HUGE_PAGE_SIZE + 3*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = 4,
+        .huge_pages = true,
+    });
+    assert(cache->chunk_size == HUGE_PAGE_SIZE);
+    for (size_t i = 0; i < cache->chunks_count; ++i) {
+        assert((uintptr_t) cache->chunks[i].entries % HUGE_PAGE_SIZE == 0);
+    }
+    // Fill the first chunk and advise it, MADV_FREE keeps the huge page whole
+    for (size_t key = 1; key <= huge_pages + 1; ++key) {
+        lock.key = key;
+        lock.head = NULL;
+        wlock = lazyfree_write_lock(cache, &lock);
+        ((uint64_t*) wlock.page)[0] = value + key;
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    assert(cache->chunks[0].advised);
+    // Reclaim of one page splits the huge page, the other pages stay
+    ret = madvise(&cache->chunks[0].entries[5], PAGE_SIZE, MADV_DONTNEED);
+    assert(ret == 0);
+    for (size_t key = 1; key <= huge_pages; ++key) {
+        lock.key = key;
+        lazyfree_read_lock(cache, &lock);
+        lazyfree_read(&lock, &result, 0, sizeof(uint64_t));
+        ok = lazyfree_read_unlock(cache, &lock, false);
+        assert(ok == (key != 6));
+        assert(!ok || result == value + key);
+    }
+
+    lazyfree_cache_free(cache);
+}
+
+// Entries of several pages, a reclaim of any page loses the whole entry.
+static void test_multi_page() {
+    volatile uint64_t value = random_next();
+    size_t pages = 32*NUMBER_OF_CHUNKS;
+    lazyfree_rlock_t lock = {0};
+    lazyfree_wlock_t wlock;
+    bool ok;
+    UNUSED(ok);
+    int ret;
+    UNUSED(ret);
+    size_t scrubbed;
+    UNUSED(scrubbed);
+
+    lazyfree_cache_t cache = lazyfree_cache_new_ex(pages*PAGE_SIZE, (struct lazyfree_config){
+        .lazyfree_chunks = NUMBER_OF_CHUNKS,
+        .residency_check = true,
+    });
+    uint8_t big[LAZYFREE_ENTRY_CAPACITY(3)];
+    uint8_t big_result[sizeof(big)];
+    // 10 entries of 3 pages fill the first chunk, the 11th advises it
+    for (size_t key = 1; key <= 11; ++key) {
+        for (size_t i = 0; i < sizeof(big); ++i) {
+            big[i] = value + key + i;
+        }
+        lock = (lazyfree_rlock_t){ .key = key, .pages = 3 };
+        wlock = lazyfree_write_lock(cache, &lock);
+        lazyfree_write_entry(wlock.page, 3, big, sizeof(big));
+        ok = lazyfree_write_unlock(cache, &wlock, false);
+        assert(ok);
+    }
+    assert(cache->chunks[0].advised && cache->chunks[0].len == 30);
+    assert(cache->chunks[1].len == 3 && cache->chunks[1].spans[0] == 3);
+
+    // Size comes from the cache
+    lock = (lazyfree_rlock_t){ .key = 11 };
+    lazyfree_read_lock(cache, &lock);
+    assert(lock.pages == 3);
+    ok = lazyfree_read_entry(&lock, big_result, sizeof(big));
+    assert(ok);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(ok);
+    assert(memcmp(big, big_result, sizeof(big)) == 0);
+
+    // Upgrade keeps the span
+    wlock = lazyfree_write_lock(cache, &lock);
+    assert(wlock.page == (uint8_t*) lock.head);
+    big[0] = ~big[0];
+    lazyfree_write_entry(wlock.page, 3, big, sizeof(big));
+    ok = lazyfree_write_unlock(cache, &wlock, false);
+    assert(ok);
+    lazyfree_read_lock(cache, &lock);
+    ok = lazyfree_read_entry(&lock, big_result, sizeof(big));
+    assert(ok);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(ok);
+    assert(memcmp(big, big_result, sizeof(big)) == 0);
+
+    // Reclaim of the middle page misses the whole entry
+    ret = madvise(&cache->chunks[0].entries[1], PAGE_SIZE, MADV_DONTNEED);
+    assert(ret == 0);
+    lock = (lazyfree_rlock_t){ .key = 1 };
+    lazyfree_read_lock(cache, &lock);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(!ok);
+    // Same while locked
+    lock = (lazyfree_rlock_t){ .key = 3 };
+    lazyfree_read_lock(cache, &lock);
+    assert(LAZYFREE_LOCK_CHECK(lock));
+    ret = madvise(&cache->chunks[0].entries[7], PAGE_SIZE, MADV_DONTNEED);
+    assert(ret == 0);
+    ok = lazyfree_read_entry(&lock, big_result, sizeof(big));
+    assert(!ok);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(!ok);
+    struct lazyfree_stats stats = lazyfree_fetch_stats(cache);
+    UNUSED(stats);
+    assert(stats.miss_reclaimed == 1 && stats.miss_invalidated == 1);
+
+    // Scrub frees every page of both entries
+    scrubbed = lazyfree_cache_scrub(cache, pages);
+    assert(scrubbed == 2);
+    assert(cache->chunks[0].free_pages_count == 6);
+    lock = (lazyfree_rlock_t){ .key = 2 };
+    lazyfree_read_lock(cache, &lock);
+    ok = lazyfree_read_unlock(cache, &lock, false);
+    assert(ok);
+
+    // More than half of a chunk is not cached
+    lock = (lazyfree_rlock_t){ .key = 12, .pages = cache->pages_per_chunk / 2 + 1 };
+    wlock = lazyfree_write_lock(cache, &lock);
+    assert(wlock.page == NULL);
+    ok = lazyfree_write_unlock(cache, &wlock, false);
+    assert(!ok);
+
+    lazyfree_cache_free(cache);
+}
+
+// The copy candidates and the dispatched copy.
+static void test_copy() {
+    lazyfree_rlock_t lock = {0};
+    bool ok;
+    UNUSED(ok);
+
+    // Every candidate at every length and alignment, and lazyfree_read with the tail byte
+    uint8_t src[PAGE_SIZE], dest[PAGE_SIZE + 1];
+    for (size_t i = 0; i < PAGE_SIZE; ++i) {
+        src[i] = random_next();
+    }
+    src[PAGE_SIZE - 1] = 1;
+    const struct lazyfree_copy_variant *variants;
+    size_t variants_count = lazyfree_copy_variants(&variants);
+    assert(variants[variants_count - 1].copy == lazyfree_copy_scalar);
+    // The dispatched copy last, it resolves on its first call
+    for (size_t c = 0; c <= variants_count; ++c) {
+        lazyfree_copy_t copy = c < variants_count ? variants[c].copy : lazyfree_copy;
+        for (size_t size = 0; size <= 160; ++size) {
+            for (size_t offset = 0; offset < 40; ++offset) {
+                dest[size] = 0xAA;
+                copy(dest, src + offset, size);
+                assert(memcmp(dest, src + offset, size) == 0 && dest[size] == 0xAA);
+            }
+        }
+    }
+    lock = (lazyfree_rlock_t){ .key = 1, .head = src, .tail = 42 };
+    for (size_t size = 1; size <= PAGE_SIZE; size = size * 2 + 1) {
+        ok = lazyfree_read(&lock, dest, PAGE_SIZE - size, size);
+        assert(ok);
+        assert(memcmp(dest, src + PAGE_SIZE - size, size - 1) == 0 && dest[size - 1] == 42);
+    }
+}
+
+void lazyfree_cache_tests() {
+    test_writes();
+    test_evacuation();
+    test_many_chunks();
+    test_resize();
+    test_residency();
+    test_swap_tier();
+    test_epochs();
+    test_index_size();
+    test_key_zero();
+    test_maintenance();
+    test_prefault();
+    test_huge_pages();
+    test_multi_page();
+    test_copy();
+}
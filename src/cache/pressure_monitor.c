@@ -0,0 +1,343 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fallthrough_cache.h"
+#include "pressure_monitor.h"
+
+#include "util.h"
+
+
+struct pressure_monitor {
+    ft_cache_t *cache;
+    struct pressure_config config;
+
+    int psi_fd;                // -1 if PSI is not available
+    bool psi_trigger;          // false: avg10 is sampled on every poll
+    int events_fd;             // cgroup memory.events, -1 if not available
+    char cgroup[PATH_MAX];     // empty if no cgroup v2
+    uint64_t events_seen;      // high + max + oom
+
+    size_t max_capacity;
+    size_t min_capacity;
+    size_t step;
+    double last_pressure_ms;
+    double last_change_ms;
+
+    pthread_mutex_t mutex;     // protects capacity and stats
+    struct pressure_stats stats;
+
+    pthread_t thread;
+    bool thread_started;
+    int stop_fd;               // eventfd, wakes the thread up on free
+};
+
+static double monitor_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Reads the whole small file from offset 0. Returns false on error.
+static bool read_fd(int fd, char *buf, size_t size) {
+    ssize_t len = pread(fd, buf, size - 1, 0);
+    if (len < 0) {
+        return false;
+    }
+    buf[len] = '\0';
+    return true;
+}
+
+static bool read_path(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = read_fd(fd, buf, size);
+    close(fd);
+    return ok;
+}
+
+// Value of "<name> <value>" line, 0 if missing.
+static uint64_t parse_field(const char *buf, const char *name) {
+    size_t len = strlen(name);
+    for (const char *line = buf; line != NULL && *line; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            line++;
+        }
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+// == Sources ==
+
+static void find_cgroup(struct pressure_monitor *monitor) {
+    monitor->cgroup[0] = '\0';
+    if (monitor->config.cgroup_path != NULL) {
+        snprintf(monitor->cgroup, PATH_MAX, "%s", monitor->config.cgroup_path);
+        return;
+    }
+
+    // Unified hierarchy line is "0::<path>"
+    char buf[4096];
+    if (!read_path("/proc/self/cgroup", buf, sizeof(buf))) {
+        return;
+    }
+    char *line = strstr(buf, "0::");
+    if (line == NULL) {
+        return;
+    }
+    char *path = line + 3;
+    char *end = strchr(path, '\n');
+    if (end != NULL) {
+        *end = '\0';
+    }
+
+    const char *mounts[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+    for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); ++i) {
+        char events[PATH_MAX];
+        snprintf(events, PATH_MAX, "%s%s/memory.events", mounts[i], path);
+        if (access(events, R_OK) == 0) {
+            snprintf(monitor->cgroup, PATH_MAX, "%s%s", mounts[i], path);
+            return;
+        }
+    }
+}
+
+static void open_psi(struct pressure_monitor *monitor) {
+    char path[PATH_MAX + 32] = "/proc/pressure/memory";
+    if (monitor->cgroup[0] != '\0') {
+        char cgroup_psi[PATH_MAX + 32];
+        snprintf(cgroup_psi, sizeof(cgroup_psi), "%s/memory.pressure", monitor->cgroup);
+        if (access(cgroup_psi, R_OK) == 0) {
+            memcpy(path, cgroup_psi, sizeof(path));
+        }
+    }
+
+    char trigger[64];
+    snprintf(trigger, sizeof(trigger), "some %u %u",
+             monitor->config.stall_us, monitor->config.window_us);
+    monitor->psi_fd = open(path, O_RDWR | O_NONBLOCK);
+    if (monitor->psi_fd != -1 && write(monitor->psi_fd, trigger, strlen(trigger) + 1) > 0) {
+        monitor->psi_trigger = true;
+        return;
+    }
+
+    // No trigger support or no permission, sample avg10 instead
+    if (monitor->psi_fd != -1) {
+        close(monitor->psi_fd);
+    }
+    monitor->psi_fd = open(path, O_RDONLY);
+    monitor->psi_trigger = false;
+}
+
+static uint64_t read_events(struct pressure_monitor *monitor) {
+    char buf[512];
+    if (monitor->events_fd == -1 || !read_fd(monitor->events_fd, buf, sizeof(buf))) {
+        return 0;
+    }
+    return parse_field(buf, "high") + parse_field(buf, "max") + parse_field(buf, "oom");
+}
+
+static bool psi_avg10_high(struct pressure_monitor *monitor) {
+    char buf[256];
+    if (!read_fd(monitor->psi_fd, buf, sizeof(buf))) {
+        return false;
+    }
+    char *avg10 = strstr(buf, "some avg10=");
+    return avg10 != NULL && strtod(avg10 + strlen("some avg10="), NULL) >= monitor->config.avg10;
+}
+
+// memory.current is within 5% of memory.high, or of memory.max if there is no high.
+static bool cgroup_near_limit(struct pressure_monitor *monitor) {
+    if (monitor->cgroup[0] == '\0') {
+        return false;
+    }
+    char path[PATH_MAX + 16];
+    char buf[64];
+    uint64_t limit = 0;
+    const char *limits[] = {"memory.high", "memory.max"};
+    for (size_t i = 0; i < 2 && limit == 0; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", monitor->cgroup, limits[i]);
+        if (read_path(path, buf, sizeof(buf)) && strncmp(buf, "max", 3) != 0) {
+            limit = strtoull(buf, NULL, 10);
+        }
+    }
+    if (limit == 0) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "%s/memory.current", monitor->cgroup);
+    if (!read_path(path, buf, sizeof(buf))) {
+        return false;
+    }
+    return strtoull(buf, NULL, 10) >= limit / 20 * 19;
+}
+
+// == Monitor ==
+
+struct pressure_monitor* pressure_monitor_new(ft_cache_t *cache, struct pressure_config config) {
+    struct pressure_monitor *monitor = malloc(sizeof(struct pressure_monitor));
+    assert(monitor != NULL);
+    memset(monitor, 0, sizeof(*monitor));
+
+    config.stall_us = config.stall_us ? config.stall_us : PRESSURE_DEFAULT_STALL_US;
+    config.window_us = config.window_us ? config.window_us : PRESSURE_DEFAULT_WINDOW_US;
+    config.avg10 = config.avg10 > 0 ? config.avg10 : PRESSURE_DEFAULT_AVG10;
+    config.relax_ms = config.relax_ms ? config.relax_ms : PRESSURE_DEFAULT_RELAX_MS;
+    config.steps = config.steps ? config.steps : PRESSURE_DEFAULT_STEPS;
+    config.min_steps = config.min_steps ? config.min_steps : 1;
+    assert(config.min_steps <= config.steps);
+    monitor->config = config;
+    monitor->cache = cache;
+
+    monitor->max_capacity = cache->capacity;
+    monitor->step = cache->capacity / config.steps;
+    monitor->min_capacity = monitor->step * config.min_steps;
+    monitor->stats.capacity = cache->capacity;
+    monitor->last_pressure_ms = monitor_now_ms();
+    monitor->last_change_ms = monitor->last_pressure_ms;
+    pthread_mutex_init(&monitor->mutex, NULL);
+
+    find_cgroup(monitor);
+    open_psi(monitor);
+    monitor->events_fd = -1;
+    if (monitor->cgroup[0] != '\0') {
+        char path[PATH_MAX + 16];
+        snprintf(path, sizeof(path), "%s/memory.events", monitor->cgroup);
+        monitor->events_fd = open(path, O_RDONLY);
+        monitor->events_seen = read_events(monitor);
+    }
+    monitor->stats.psi = monitor->psi_fd != -1;
+    monitor->stats.psi_trigger = monitor->psi_trigger;
+    monitor->stats.cgroup = monitor->events_fd != -1;
+
+    monitor->stop_fd = eventfd(0, EFD_NONBLOCK);
+    assert(monitor->stop_fd != -1);
+    return monitor;
+}
+
+void pressure_monitor_free(struct pressure_monitor *monitor) {
+    if (monitor->thread_started) {
+        uint64_t one = 1;
+        ssize_t ret = write(monitor->stop_fd, &one, sizeof(one));
+        assert(ret == sizeof(one));
+        UNUSED(ret);
+        pthread_join(monitor->thread, NULL);
+    }
+    if (monitor->psi_fd != -1) {
+        close(monitor->psi_fd);
+    }
+    if (monitor->events_fd != -1) {
+        close(monitor->events_fd);
+    }
+    close(monitor->stop_fd);
+    pthread_mutex_destroy(&monitor->mutex);
+    free(monitor);
+}
+
+bool pressure_monitor_update(struct pressure_monitor *monitor, bool pressure, double now_ms) {
+    pthread_mutex_lock(&monitor->mutex);
+    size_t capacity = monitor->stats.capacity;
+    if (pressure) {
+        monitor->stats.events++;
+        monitor->last_pressure_ms = now_ms;
+        // At most one step per PSI window
+        if (capacity > monitor->min_capacity &&
+            now_ms - monitor->last_change_ms >= monitor->config.window_us / 1000.0) {
+            capacity = capacity > monitor->min_capacity + monitor->step ? capacity - monitor->step
+                                                                        : monitor->min_capacity;
+            monitor->stats.shrinks++;
+        }
+    } else if (capacity < monitor->max_capacity &&
+               now_ms - monitor->last_pressure_ms >= monitor->config.relax_ms &&
+               now_ms - monitor->last_change_ms >= monitor->config.relax_ms) {
+        capacity = capacity + monitor->step < monitor->max_capacity ? capacity + monitor->step
+                                                                     : monitor->max_capacity;
+        monitor->stats.grows++;
+    }
+
+    bool changed = capacity != monitor->stats.capacity;
+    if (changed) {
+        monitor->last_change_ms = now_ms;
+        ft_cache_resize(monitor->cache, capacity);
+        // A failed resize leaves the cache at its own size
+        monitor->stats.capacity = monitor->cache->capacity;
+    }
+    pthread_mutex_unlock(&monitor->mutex);
+    return changed;
+}
+
+bool pressure_monitor_poll(struct pressure_monitor *monitor, int timeout_ms) {
+    struct pollfd fds[3];
+    nfds_t nfds = 0;
+    int psi_idx = -1;
+    int events_idx = -1;
+    if (monitor->psi_fd != -1 && monitor->psi_trigger) {
+        psi_idx = nfds;
+        fds[nfds++] = (struct pollfd){ .fd = monitor->psi_fd, .events = POLLPRI };
+    }
+    if (monitor->events_fd != -1) {
+        // kernfs notifies about file changes with POLLPRI
+        events_idx = nfds;
+        fds[nfds++] = (struct pollfd){ .fd = monitor->events_fd, .events = POLLPRI };
+    }
+    fds[nfds++] = (struct pollfd){ .fd = monitor->stop_fd, .events = POLLIN };
+
+    int ret = poll(fds, nfds, timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+        perror("poll");
+        exit(1);
+    }
+
+    bool pressure = false;
+    if (psi_idx >= 0 && (fds[psi_idx].revents & POLLPRI)) {
+        pressure = true;
+    }
+    if (events_idx >= 0 && fds[events_idx].revents) {
+        uint64_t events = read_events(monitor);
+        pressure |= events > monitor->events_seen;
+        monitor->events_seen = events;
+    }
+    if (monitor->psi_fd != -1 && !monitor->psi_trigger) {
+        pressure |= psi_avg10_high(monitor);
+    }
+    pressure |= cgroup_near_limit(monitor);
+
+    return pressure_monitor_update(monitor, pressure, monitor_now_ms());
+}
+
+static void* run_monitor(void *opaque) {
+    struct pressure_monitor *monitor = opaque;
+    while (true) {
+        pressure_monitor_poll(monitor, monitor->config.window_us / 1000);
+        uint64_t stop;
+        if (read(monitor->stop_fd, &stop, sizeof(stop)) == sizeof(stop)) {
+            return NULL;
+        }
+    }
+}
+
+void pressure_monitor_start(struct pressure_monitor *monitor) {
+    assert(!monitor->thread_started);
+    monitor->thread_started = true;
+    pthread_create(&monitor->thread, NULL, run_monitor, monitor);
+}
+
+struct pressure_stats pressure_monitor_stats(struct pressure_monitor *monitor) {
+    pthread_mutex_lock(&monitor->mutex);
+    struct pressure_stats stats = monitor->stats;
+    pthread_mutex_unlock(&monitor->mutex);
+    return stats;
+}
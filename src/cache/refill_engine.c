@@ -0,0 +1,246 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fallthrough_cache.h"
+#include "refill_engine.h"
+
+#include "util.h"
+#include "u64map.h"
+
+
+struct waiter {
+    uint8_t *value;
+    refill_done_t done;
+    void *opaque;
+    struct waiter *next;
+};
+
+// One refill in flight, queued or running.
+struct flight {
+    lazyfree_key_t key;
+    uint8_t *value;            // entry_size, filled by the worker
+    struct waiter *waiters;
+    struct flight *next;       // queue
+};
+
+struct refill_engine {
+    ft_cache_t *cache;
+
+    pthread_mutex_t mutex;     // protects everything below, but the hit counters
+    pthread_cond_t queued;     // a flight was queued, or stop
+    pthread_cond_t completed;  // for refill_engine_get_sync
+    struct u64map flights;     // key -> struct flight*
+    struct flight *head;
+    struct flight *tail;
+    bool stop;
+    struct refill_stats stats;
+
+    size_t batch;
+    size_t workers_count;
+    pthread_t *workers;
+};
+
+// == Workers ==
+
+static struct flight* pop_flight(struct refill_engine *engine) {
+    struct flight *flight = engine->head;
+    engine->head = flight->next;
+    if (engine->head == NULL) {
+        engine->tail = NULL;
+    }
+    return flight;
+}
+
+// Completes the waiters outside of the lock, they may call the engine again.
+static void complete(struct refill_engine *engine, struct flight *flight, struct waiter *waiters) {
+    while (waiters != NULL) {
+        struct waiter *next = waiters->next;
+        memcpy(waiters->value, flight->value, engine->cache->entry_size);
+        waiters->done(waiters->opaque, flight->key, waiters->value);
+        free(waiters);
+        waiters = next;
+    }
+    free(flight->value);
+    free(flight);
+}
+
+// Drains the queue before it stops.
+static void* run_worker(void *opaque) {
+    struct refill_engine *engine = opaque;
+    ft_cache_t *cache = engine->cache;
+    struct flight *flights[FT_BATCH];
+    uint64_t keys[FT_BATCH];
+    uint8_t *values = malloc(engine->batch * cache->entry_size);
+    assert(values != NULL);
+
+    pthread_mutex_lock(&engine->mutex);
+    while (true) {
+        while (engine->head == NULL && !engine->stop) {
+            pthread_cond_wait(&engine->queued, &engine->mutex);
+        }
+        if (engine->head == NULL) {
+            break;
+        }
+        size_t count = 0;
+        while (engine->head != NULL && count < engine->batch) {
+            flights[count] = pop_flight(engine);
+            keys[count] = flights[count]->key;
+            count++;
+        }
+        pthread_mutex_unlock(&engine->mutex);
+
+        ft_cache_refill_many(cache, keys, count, values);
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(flights[i]->value, values + i * cache->entry_size, cache->entry_size);
+            ft_cache_put(cache, keys[i], flights[i]->value);
+        }
+
+        // Installed before it leaves the table, so a later miss finds one or the other
+        struct waiter *waiters[FT_BATCH];
+        pthread_mutex_lock(&engine->mutex);
+        engine->stats.refills += count;
+        engine->stats.batches += cache->refill_batch_cb != NULL ? 1 : count;
+        for (size_t i = 0; i < count; ++i) {
+            u64map_remove(&engine->flights, keys[i]);
+            waiters[i] = flights[i]->waiters;
+        }
+        pthread_mutex_unlock(&engine->mutex);
+
+        for (size_t i = 0; i < count; ++i) {
+            complete(engine, flights[i], waiters[i]);
+        }
+        pthread_mutex_lock(&engine->mutex);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    free(values);
+    return NULL;
+}
+
+struct refill_engine* refill_engine_new(ft_cache_t *cache, struct refill_config config) {
+    struct refill_engine *engine = calloc(1, sizeof(struct refill_engine));
+    assert(engine != NULL);
+    engine->cache = cache;
+    pthread_mutex_init(&engine->mutex, NULL);
+    pthread_cond_init(&engine->queued, NULL);
+    pthread_cond_init(&engine->completed, NULL);
+    u64map_init(&engine->flights, 64);
+
+    // Without a batch refill every key is a call of its own
+    engine->batch = config.batch ? config.batch : REFILL_DEFAULT_BATCH;
+    engine->batch = cache->refill_batch_cb == NULL ? 1 : engine->batch;
+    assert(engine->batch <= FT_BATCH);
+    engine->workers_count = config.workers ? config.workers : REFILL_DEFAULT_WORKERS;
+    engine->workers = malloc(engine->workers_count * sizeof(pthread_t));
+    assert(engine->workers != NULL);
+    for (size_t i = 0; i < engine->workers_count; ++i) {
+        pthread_create(&engine->workers[i], NULL, run_worker, engine);
+    }
+    return engine;
+}
+
+void refill_engine_free(struct refill_engine *engine) {
+    pthread_mutex_lock(&engine->mutex);
+    engine->stop = true;
+    pthread_cond_broadcast(&engine->queued);
+    pthread_mutex_unlock(&engine->mutex);
+    for (size_t i = 0; i < engine->workers_count; ++i) {
+        pthread_join(engine->workers[i], NULL);
+    }
+    assert(u64map_size(&engine->flights) == 0);
+    u64map_destroy(&engine->flights);
+    pthread_cond_destroy(&engine->completed);
+    pthread_cond_destroy(&engine->queued);
+    pthread_mutex_destroy(&engine->mutex);
+    free(engine->workers);
+    free(engine);
+}
+
+// == Requests ==
+
+bool refill_engine_get(struct refill_engine *engine, lazyfree_key_t key, uint8_t *value,
+                       refill_done_t done, void *opaque) {
+    __atomic_fetch_add(&engine->stats.requests, 1, __ATOMIC_RELAXED);
+    // Hits never take the engine mutex, they only go through the cache's own read path
+    if (ft_cache_peek(engine->cache, key, value)) {
+        __atomic_fetch_add(&engine->stats.hits, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    struct waiter *waiter = malloc(sizeof(struct waiter));
+    assert(waiter != NULL);
+    *waiter = (struct waiter){ .value = value, .done = done, .opaque = opaque };
+
+    pthread_mutex_lock(&engine->mutex);
+    uint64_t found;
+    if (u64map_get(&engine->flights, key, &found)) {
+        struct flight *flight = (struct flight*) found;
+        waiter->next = flight->waiters;
+        flight->waiters = waiter;
+        engine->stats.joined++;
+        pthread_mutex_unlock(&engine->mutex);
+        return false;
+    }
+    // Misses only: a refill could have completed since the first peek,
+    // checked under the mutex so that the key gets a single flight
+    if (ft_cache_peek(engine->cache, key, value)) {
+        pthread_mutex_unlock(&engine->mutex);
+        __atomic_fetch_add(&engine->stats.hits, 1, __ATOMIC_RELAXED);
+        free(waiter);
+        return true;
+    }
+
+    struct flight *flight = malloc(sizeof(struct flight));
+    assert(flight != NULL);
+    *flight = (struct flight){ .key = key, .waiters = waiter };
+    flight->value = malloc(engine->cache->entry_size);
+    assert(flight->value != NULL);
+    if (engine->tail != NULL) {
+        engine->tail->next = flight;
+    } else {
+        engine->head = flight;
+    }
+    engine->tail = flight;
+    u64map_put(&engine->flights, key, (uint64_t) flight);
+    pthread_cond_signal(&engine->queued);
+    pthread_mutex_unlock(&engine->mutex);
+    return false;
+}
+
+struct sync_wait {
+    struct refill_engine *engine;
+    bool done;
+};
+
+static void sync_done(void *opaque, lazyfree_key_t key, uint8_t *value) {
+    UNUSED(key);
+    UNUSED(value);
+    struct sync_wait *wait = opaque;
+    pthread_mutex_lock(&wait->engine->mutex);
+    wait->done = true;
+    pthread_cond_broadcast(&wait->engine->completed);
+    pthread_mutex_unlock(&wait->engine->mutex);
+}
+
+void refill_engine_get_sync(struct refill_engine *engine, lazyfree_key_t key, uint8_t *value) {
+    struct sync_wait wait = { .engine = engine };
+    if (refill_engine_get(engine, key, value, sync_done, &wait)) {
+        return;
+    }
+    pthread_mutex_lock(&engine->mutex);
+    while (!wait.done) {
+        pthread_cond_wait(&engine->completed, &engine->mutex);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+struct refill_stats refill_engine_stats(struct refill_engine *engine) {
+    pthread_mutex_lock(&engine->mutex);
+    struct refill_stats stats = engine->stats;
+    stats.requests = __atomic_load_n(&engine->stats.requests, __ATOMIC_RELAXED);
+    stats.hits = __atomic_load_n(&engine->stats.hits, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&engine->mutex);
+    return stats;
+}
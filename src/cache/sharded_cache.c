@@ -0,0 +1,255 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "lazyfree_cache.h"
+#include "sharded_cache.h"
+
+#include "util.h"
+#include "random.h"
+
+
+struct shard {
+    pthread_mutex_t mutex;
+    lazyfree_cache_t cache;
+} __attribute__((aligned(64)));
+
+struct sharded_cache {
+    size_t shards_count;
+    bool optimistic_reads;
+    struct shard *shards;
+    size_t shard_pages;        // capacity of one shard
+
+    // Background scrubber
+    uint32_t scrub_interval_ms;
+    pthread_t scrub_thread;
+    pthread_mutex_t scrub_mutex;
+    pthread_cond_t scrub_stop_cond;
+    bool scrub_stop;
+};
+
+// Different mix than the index inside the shard, so shards don't share home slots.
+static struct shard* route(struct sharded_cache* cache, lazyfree_key_t key) {
+    uint64_t state = key;
+    return &cache->shards[random_mix(&state) % cache->shards_count];
+}
+
+// == Scrubber ==
+
+// Holds a shard lock for one batch at a time.
+static size_t scrub_shard(struct shard* shard, size_t max_pages) {
+    size_t purged = 0;
+    for (size_t scanned = 0; scanned < max_pages; scanned += LAZYFREE_SCRUB_BATCH) {
+        size_t batch = max_pages - scanned < LAZYFREE_SCRUB_BATCH ? max_pages - scanned : LAZYFREE_SCRUB_BATCH;
+        pthread_mutex_lock(&shard->mutex);
+        purged += lazyfree_cache_scrub(shard->cache, batch);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return purged;
+}
+
+// Scrubs every shard once per interval, until sharded_cache_free.
+static void* run_scrubber(void* opaque) {
+    struct sharded_cache* cache = opaque;
+    pthread_mutex_lock(&cache->scrub_mutex);
+    while (!cache->scrub_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += cache->scrub_interval_ms / 1000;
+        deadline.tv_nsec += (cache->scrub_interval_ms % 1000) * 1000000l;
+        if (deadline.tv_nsec >= 1000000000l) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+        pthread_cond_timedwait(&cache->scrub_stop_cond, &cache->scrub_mutex, &deadline);
+        if (cache->scrub_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&cache->scrub_mutex);
+        for (size_t i = 0; i < cache->shards_count; ++i) {
+            scrub_shard(&cache->shards[i], __atomic_load_n(&cache->shard_pages, __ATOMIC_RELAXED));
+        }
+        pthread_mutex_lock(&cache->scrub_mutex);
+    }
+    pthread_mutex_unlock(&cache->scrub_mutex);
+    return NULL;
+}
+
+lazyfree_cache_t sharded_cache_new(size_t cache_size, struct lazyfree_config config) {
+    struct sharded_cache* cache = malloc(sizeof(struct sharded_cache));
+    assert(cache != NULL);
+    cache->shards_count = config.shards ? config.shards : LAZYFREE_DEFAULT_SHARDS;
+    cache->optimistic_reads = config.optimistic_reads;
+
+    config.max_capacity /= cache->shards_count;
+
+    cache->shards = aligned_alloc(64, cache->shards_count * sizeof(struct shard));
+    assert(cache->shards != NULL);
+    for (size_t i = 0; i < cache->shards_count; ++i) {
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+        cache->shards[i].cache = lazyfree_cache_new_ex(cache_size / cache->shards_count, config);
+    }
+    cache->shard_pages = cache_size / cache->shards_count / PAGE_SIZE;
+
+    cache->scrub_interval_ms = config.scrub_interval_ms;
+    if (cache->scrub_interval_ms) {
+        pthread_mutex_init(&cache->scrub_mutex, NULL);
+        pthread_cond_init(&cache->scrub_stop_cond, NULL);
+        cache->scrub_stop = false;
+        pthread_create(&cache->scrub_thread, NULL, run_scrubber, cache);
+    }
+    return (lazyfree_cache_t) cache;
+}
+
+void sharded_cache_free(lazyfree_cache_t lfcache) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    if (cache->scrub_interval_ms) {
+        pthread_mutex_lock(&cache->scrub_mutex);
+        cache->scrub_stop = true;
+        pthread_cond_signal(&cache->scrub_stop_cond);
+        pthread_mutex_unlock(&cache->scrub_mutex);
+        pthread_join(cache->scrub_thread, NULL);
+        pthread_cond_destroy(&cache->scrub_stop_cond);
+        pthread_mutex_destroy(&cache->scrub_mutex);
+    }
+    for (size_t i = 0; i < cache->shards_count; ++i) {
+        lazyfree_cache_free(cache->shards[i].cache);
+        pthread_mutex_destroy(&cache->shards[i].mutex);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+// == Read Lock API ==
+
+void sharded_cache_read_lock(lazyfree_cache_t lfcache, lazyfree_rlock_t* lock) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    struct shard* shard = route(cache, lock->key);
+    if (cache->optimistic_reads) {
+        lazyfree_read_lock(shard->cache, lock);
+        return;
+    }
+    pthread_mutex_lock(&shard->mutex);
+    lazyfree_read_lock(shard->cache, lock);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+bool sharded_cache_read_unlock(lazyfree_cache_t lfcache, lazyfree_rlock_t* lock, bool drop) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    struct shard* shard = route(cache, lock->key);
+    if (cache->optimistic_reads && !drop) {
+        return lazyfree_read_unlock(shard->cache, lock, false);
+    }
+    pthread_mutex_lock(&shard->mutex);
+    bool ok = lazyfree_read_unlock(shard->cache, lock, drop);
+    pthread_mutex_unlock(&shard->mutex);
+    return ok;
+}
+
+// == Write Lock API ==
+
+lazyfree_wlock_t sharded_cache_write_lock(lazyfree_cache_t lfcache, lazyfree_rlock_t* lock) {
+    struct shard* shard = route((struct sharded_cache*) lfcache, lock->key);
+    pthread_mutex_lock(&shard->mutex);
+    lazyfree_wlock_t wlock = lazyfree_write_lock(shard->cache, lock);
+    pthread_mutex_unlock(&shard->mutex);
+    return wlock;
+}
+
+bool sharded_cache_write_unlock(lazyfree_cache_t lfcache, lazyfree_wlock_t* lock, bool drop) {
+    struct shard* shard = route((struct sharded_cache*) lfcache, lock->key);
+    pthread_mutex_lock(&shard->mutex);
+    bool ok = lazyfree_write_unlock(shard->cache, lock, drop);
+    pthread_mutex_unlock(&shard->mutex);
+    return ok;
+}
+
+// == Extra API ==
+
+struct lazyfree_stats sharded_cache_stats(lazyfree_cache_t lfcache) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    struct lazyfree_stats stats = {0};
+    for (size_t i = 0; i < cache->shards_count; ++i) {
+        struct shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        struct lazyfree_stats shard_stats = lazyfree_fetch_stats(shard->cache);
+        pthread_mutex_unlock(&shard->mutex);
+        stats.total_pages += shard_stats.total_pages;
+        stats.free_pages += shard_stats.free_pages;
+        stats.lookups += shard_stats.lookups;
+        stats.hits += shard_stats.hits;
+        stats.miss_absent += shard_stats.miss_absent;
+        stats.miss_writing += shard_stats.miss_writing;
+        stats.miss_dropped += shard_stats.miss_dropped;
+        stats.miss_reclaimed += shard_stats.miss_reclaimed;
+        stats.miss_invalidated += shard_stats.miss_invalidated;
+        stats.explicit_drops += shard_stats.explicit_drops;
+        stats.chunk_drops += shard_stats.chunk_drops;
+        stats.pages_evicted += shard_stats.pages_evicted;
+        stats.pages_evacuated += shard_stats.pages_evacuated;
+        stats.pages_scrubbed += shard_stats.pages_scrubbed;
+        stats.madvise_calls += shard_stats.madvise_calls;
+        stats.bytes_advised += shard_stats.bytes_advised;
+        stats.maintenance_waits += shard_stats.maintenance_waits;
+    }
+    return stats;
+}
+
+void sharded_cache_set_verbose(lazyfree_cache_t lfcache, bool verbose) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    for (size_t i = 0; i < cache->shards_count; ++i) {
+        lazyfree_set_verbose(cache->shards[i].cache, verbose);
+    }
+}
+
+bool sharded_cache_resize(lazyfree_cache_t lfcache, size_t cache_size) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    bool ok = true;
+    for (size_t i = 0; i < cache->shards_count; ++i) {
+        struct shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        ok &= lazyfree_cache_resize(shard->cache, cache_size / cache->shards_count);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    __atomic_store_n(&cache->shard_pages, cache_size / cache->shards_count / PAGE_SIZE, __ATOMIC_RELAXED);
+    return ok;
+}
+
+size_t sharded_cache_scrub(lazyfree_cache_t lfcache, size_t max_pages) {
+    struct sharded_cache* cache = (struct sharded_cache*) lfcache;
+    size_t purged = 0;
+    for (size_t i = 0; i < cache->shards_count; ++i) {
+        purged += scrub_shard(&cache->shards[i], max_pages / cache->shards_count);
+    }
+    return purged;
+}
+
+struct lazyfree_impl lazyfree_sharded_impl() {
+    struct lazyfree_impl impl = {
+        .new = sharded_cache_new,
+        .free = sharded_cache_free,
+
+        .read_lock = sharded_cache_read_lock,
+        .read_unlock = sharded_cache_read_unlock,
+
+        .write_lock = sharded_cache_write_lock,
+        .write_unlock = sharded_cache_write_unlock,
+
+        .stats = sharded_cache_stats,
+        .set_verbose = sharded_cache_set_verbose,
+        .resize = sharded_cache_resize,
+        .scrub = sharded_cache_scrub,
+
+        .config = {
+            .lazyfree_chunks = NUMBER_OF_CHUNKS,
+            .anon_chunks = 0,
+            .disk_chunks = 0,
+            .shards = LAZYFREE_DEFAULT_SHARDS,
+        },
+    };
+    return impl;
+}
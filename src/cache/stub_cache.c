@@ -8,16 +8,15 @@
 
 
 
-lazyfree_cache_t stub_cache_new(size_t capacity_bytes, size_t lazyfree_chunks, size_t anon_chunks, size_t disk_chunks) {
+lazyfree_cache_t stub_cache_new(size_t capacity_bytes, struct lazyfree_config config) {
     UNUSED(capacity_bytes);
-    UNUSED(lazyfree_chunks);
-    UNUSED(anon_chunks);
-    UNUSED(disk_chunks);
+    UNUSED(config);
     return (lazyfree_cache_t)(&EMPTY_PAGE);
 }
 
 void stub_cache_free(lazyfree_cache_t lfcache) { 
     assert(lfcache == (lazyfree_cache_t)(&EMPTY_PAGE));
+    UNUSED(lfcache);
 }
 
 // == Read Lock API ==
@@ -41,16 +40,18 @@ bool stub_cache_read_unlock(lazyfree_cache_t cache, lazyfree_rlock_t* lock, bool
 // == Write Lock API ==
 // Always uses the same page
 
-void* stub_cache_write_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
+lazyfree_wlock_t stub_cache_write_lock(lazyfree_cache_t cache, lazyfree_rlock_t* lock) {
     UNUSED(cache);
-    UNUSED(lock);
-    return EMPTY_PAGE;
+    // EMPTY_PAGE holds a single page entry only
+    lazyfree_wlock_t wlock = { .key = lock->key, .page = lock->pages > 1 ? NULL : EMPTY_PAGE };
+    return wlock;
 }
 
-void stub_cache_write_unlock(lazyfree_cache_t cache, bool drop) {
+bool stub_cache_write_unlock(lazyfree_cache_t cache, lazyfree_wlock_t* lock, bool drop) {
     UNUSED(cache);
+    UNUSED(lock);
     UNUSED(drop);
-    return;
+    return true;
 }
 
 struct lazyfree_impl lazyfree_stub_impl() {
@@ -64,8 +65,10 @@ struct lazyfree_impl lazyfree_stub_impl() {
         .write_lock = stub_cache_write_lock,
         .write_unlock = stub_cache_write_unlock,
 
-        .lazyfree_chunks = NUMBER_OF_CHUNKS,
-        .anon_chunks = 0,
-        .disk_chunks = 0,
+        .config = {
+            .lazyfree_chunks = NUMBER_OF_CHUNKS,
+            .anon_chunks = 0,
+            .disk_chunks = 0,
+        },
     };
 }
@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +9,9 @@
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "util.h"
 #include "random.h"
@@ -16,14 +21,20 @@
 
 void lazyfree_madv_free(void *memory, size_t size) {
     int ret;
-    printf("MADV_FREE %zu Mb at %p\n", size / M, memory);
     ret = madvise(memory, size, MADV_FREE);
     assert(ret == 0);
+    UNUSED(ret);
 }
 
 void lazyfree_madv_cold(void *memory, size_t size) {
     int ret = madvise(memory, size,  MADV_COLD);
     assert(ret == 0);
+    UNUSED(ret);
+}
+
+void lazyfree_madv_pageout(void *memory, size_t size) {
+    // EINVAL before Linux 5.4, then the pages just stay
+    madvise(memory, size, MADV_PAGEOUT);
 }
 
 void lazyfree_madv_nop(void *memory, size_t size) {
@@ -31,6 +42,106 @@ void lazyfree_madv_nop(void *memory, size_t size) {
     UNUSED(size);
 }
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static bool populate_unsupported;
+
+void lazyfree_populate(void *memory, size_t size) {
+    if (!__atomic_load_n(&populate_unsupported, __ATOMIC_RELAXED)) {
+        if (madvise(memory, size, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+        // EINVAL before Linux 5.14, then the pages are touched one by one
+        if (errno == EINVAL) {
+            __atomic_store_n(&populate_unsupported, true, __ATOMIC_RELAXED);
+        }
+    }
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        // Adding zero writes the page without changing it, even under a concurrent write
+        __atomic_fetch_add((uint8_t*) memory + offset, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// == Copy functions ==
+// Plain loads from the page, lazyfree_read keeps them between its checks.
+
+void lazyfree_copy_scalar(void *dest, const volatile uint8_t *src, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        ((uint8_t*) dest)[i] = src[i];
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+void lazyfree_copy_sse2(void *dest, const volatile uint8_t *src, size_t size) {
+    const uint8_t *in = (const uint8_t*) src;
+    uint8_t *out = dest;
+    if (size < 16) {
+        lazyfree_copy_scalar(dest, src, size);
+        return;
+    }
+    for (size_t i = 0; i + 16 <= size; i += 16) {
+        _mm_storeu_si128((__m128i*) (out + i), _mm_loadu_si128((const __m128i*) (in + i)));
+    }
+    // Last vector overlaps the previous one
+    _mm_storeu_si128((__m128i*) (out + size - 16), _mm_loadu_si128((const __m128i*) (in + size - 16)));
+}
+
+__attribute__((target("avx2")))
+void lazyfree_copy_avx2(void *dest, const volatile uint8_t *src, size_t size) {
+    const uint8_t *in = (const uint8_t*) src;
+    uint8_t *out = dest;
+    if (size < 32) {
+        lazyfree_copy_sse2(dest, src, size);
+        return;
+    }
+    for (size_t i = 0; i + 32 <= size; i += 32) {
+        _mm256_storeu_si256((__m256i*) (out + i), _mm256_loadu_si256((const __m256i*) (in + i)));
+    }
+    _mm256_storeu_si256((__m256i*) (out + size - 32), _mm256_loadu_si256((const __m256i*) (in + size - 32)));
+}
+
+#endif
+
+// Best first, every entry only needs the features of the ones after it.
+static const struct lazyfree_copy_variant copy_variants[] = {
+#if defined(__x86_64__)
+    { "avx2", lazyfree_copy_avx2 },
+    { "sse2", lazyfree_copy_sse2 },
+#endif
+    { "scalar", lazyfree_copy_scalar },
+};
+
+size_t lazyfree_copy_variants(const struct lazyfree_copy_variant **variants) {
+    size_t first = 0;
+#if defined(__x86_64__)
+    // SSE2 is part of x86-64
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2")) {
+        first = 1;
+    }
+#endif
+    *variants = &copy_variants[first];
+    return sizeof(copy_variants) / sizeof(copy_variants[0]) - first;
+}
+
+lazyfree_copy_t lazyfree_copy_select(void) {
+    const struct lazyfree_copy_variant *variants;
+    lazyfree_copy_variants(&variants);
+    return variants[0].copy;
+}
+
+// Replaces itself on the first call, concurrent first calls pick the same function.
+static void copy_resolve(void *dest, const volatile uint8_t *src, size_t size) {
+    lazyfree_copy_t copy = lazyfree_copy_select();
+    __atomic_store_n(&lazyfree_copy, copy, __ATOMIC_RELAXED);
+    copy(dest, src, size);
+}
+
+lazyfree_copy_t lazyfree_copy = copy_resolve;
+
 void *lazyfree_mmap_anon(size_t size) {
     void *addr = mmap(NULL, size, 
                 PROT_READ | PROT_WRITE, 
@@ -47,6 +158,20 @@ void *lazyfree_mmap_anon(size_t size) {
     return addr;
 }
 
+void *lazyfree_mmap_anon_huge(size_t size) {
+    // Over-allocate and trim, mmap only guarantees PAGE_SIZE alignment
+    uint8_t *addr = lazyfree_mmap_anon(size + HUGE_PAGE_SIZE);
+    uint8_t *aligned = (uint8_t*) (((uintptr_t) addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > addr) {
+        munmap(addr, aligned - addr);
+    }
+    munmap(aligned + size, addr + HUGE_PAGE_SIZE - aligned);
+
+    // Fails only if THP is disabled, then the memory is backed by normal pages
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
 void *lazyfree_mmap_file(size_t size) {
     char filename[PATH_MAX];
     mkdir("./tmp", 0755);
@@ -35,6 +35,15 @@ static bool bitset_get(bitset_t bitset, size_t idx) {
     return (bitset[idx/8] & (1 << (idx % 8))) != 0;
 }
 
+// Safe to call concurrently with other atomic puts to the same byte.
+static void bitset_put_atomic(bitset_t bitset, size_t idx, bool val) {
+    if (val) {
+        __atomic_fetch_or(&bitset[idx/8], 1 << (idx % 8), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&bitset[idx/8], ~(1 << (idx % 8)), __ATOMIC_RELAXED);
+    }
+}
+
 
 // struct indirect_bitset {
 //     bitset_t bitset;
@@ -14,12 +14,17 @@ static uint64_t random_mix(uint64_t *state) {
 static uint64_t __global_seed = 2;
 
 
+// Same as random_next, but with caller-owned state.
+static uint64_t random_next_r(uint64_t *seed) {
+    *seed = random_mix(seed);
+    return *seed ^ 0xdeadbeef; // So that we don't follow the same path every time
+}
+
 static uint64_t random_next(void) {
     // if (__global_seed == 1) {
     //     __global_seed = time(NULL);
     // }
-    __global_seed = random_mix(&__global_seed);
-    return __global_seed ^ 0xdeadbeef; // So that we don't follow the same path every time
+    return random_next_r(&__global_seed);
 }
 
 inline static void random_rotate() {
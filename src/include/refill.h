@@ -2,6 +2,7 @@
 #define REFILL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "random.h"
@@ -10,6 +11,7 @@
 struct refill_ctx{
     uint64_t seed;
     uint64_t count;
+    uint64_t batches;          // refill_batch_cb calls
 };
 
 extern struct refill_ctx refill_ctx;
@@ -18,4 +20,7 @@ uint64_t refill_expected(uint64_t key);
 
 void refill_cb(void* _, uint64_t key, uint8_t *value);
 
+// Same values as refill_cb, for uint64_t entries.
+void refill_batch_cb(void* _, const uint64_t *keys, size_t count, uint8_t *values);
+
 #endif
@@ -7,7 +7,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
 
 #include "fallthrough_cache.h"
 #include "random.h"
@@ -15,6 +18,24 @@
 #include "util.h"
 
 
+static const char *testlib_policy_names[LAZYFREE_POLICY_COUNT] = {
+    [LAZYFREE_POLICY_RANDOM] = "random",
+    [LAZYFREE_POLICY_FIFO] = "fifo",
+    [LAZYFREE_POLICY_LFU] = "lfu",
+    [LAZYFREE_POLICY_CLOCK] = "clock",
+};
+
+// Returns LAZYFREE_POLICY_COUNT if unknown.
+enum lazyfree_policy testlib_parse_policy(const char *name) {
+    for (size_t i = 0; i < LAZYFREE_POLICY_COUNT; ++i) {
+        if (strcmp(name, testlib_policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return LAZYFREE_POLICY_COUNT;
+}
+
+
 struct testlib_keyset {
     uint64_t seed;
     size_t cnt;
@@ -70,6 +91,9 @@ static void testlib_get_one(ft_cache_t *cache, struct testlib_keyset *keyset) {
 
 static bool testlib_verbose = false;
 
+// If set, testlib_measure_set appends "set,hit,ns" for every lookup.
+static FILE *testlib_samples = NULL;
+
 // Returns hitrate
 static float testlib_get_all(ft_cache_t *cache, 
                                struct testlib_keyset *keyset) {
@@ -112,6 +136,19 @@ void testlib_reclaim(size_t size) {
     munmap(mem, size);
 }
 
+// All free memory and half of the cache.
+void testlib_reclaim_cache(size_t cache_size) {
+    testlib_reclaim(sysconf(_SC_AVPHYS_PAGES) * PAGE_SIZE + cache_size/2);
+}
+
+// Whether the kernel reclaims MADV_FREE pages in time depends on the host's memory,
+// swap and cgroup limits, so nothing reclaimed is a skip. Values are checked either way.
+void testlib_check_reclaimed(float hitrate_after) {
+    if (hitrate_after == 1) {
+        printf("Nothing was reclaimed, skipping the reclaim check\n");
+    }
+}
+
 void testlib_reclaim_many(size_t chunks, size_t chunk_size) {
     printf("Reclaiming %zu Mb\n", chunks*chunk_size/M);
     volatile uint8_t **mem = malloc(chunks * sizeof(uint8_t*));
@@ -129,35 +166,210 @@ void testlib_reclaim_many(size_t chunks, size_t chunk_size) {
 }
 
 
+// == Counters ==
+
+// dTLB read misses of this thread, -1 if hardware counters are not available (e.g. in a VM).
+static int64_t testlib_tlb_misses() {
+    static int fd = -2;
+    if (fd == -2) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    int64_t count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+// AnonHugePages of this process in bytes.
+static size_t testlib_anon_huge_bytes() {
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb * K;
+}
+
+// == Latency histogram ==
+
+// Log buckets as in HdrHistogram: 16 linear sub-buckets per power of two, within 6.25%.
+#define TESTLIB_HIST_SUB_BITS 4
+#define TESTLIB_HIST_BUCKETS (64 << TESTLIB_HIST_SUB_BITS)
+
+struct testlib_histogram {
+    size_t count;
+    uint64_t max;
+    uint64_t buckets[TESTLIB_HIST_BUCKETS];
+};
+
+static inline size_t testlib_hist_bucket(uint64_t ns) {
+    if (ns < (1 << TESTLIB_HIST_SUB_BITS)) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - TESTLIB_HIST_SUB_BITS;
+    return ((size_t) (shift + 1) << TESTLIB_HIST_SUB_BITS) + ((ns >> shift) & ((1 << TESTLIB_HIST_SUB_BITS) - 1));
+}
+
+// Highest value of the bucket.
+static uint64_t testlib_hist_upper(size_t bucket) {
+    if (bucket < (1 << TESTLIB_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    size_t shift = (bucket >> TESTLIB_HIST_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << TESTLIB_HIST_SUB_BITS) - 1);
+    return (((1 << TESTLIB_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static inline void testlib_hist_add(struct testlib_histogram *hist, uint64_t ns) {
+    hist->count++;
+    hist->max = ns > hist->max ? ns : hist->max;
+    hist->buckets[testlib_hist_bucket(ns)]++;
+}
+
+static uint64_t testlib_hist_percentile(struct testlib_histogram *hist, double percentile) {
+    size_t rank = (size_t) (percentile / 100 * hist->count + 0.5);
+    rank = rank ? rank : 1;
+    size_t seen = 0;
+    for (size_t i = 0; i < TESTLIB_HIST_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = testlib_hist_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// In ns, all zero if count is 0.
+struct testlib_latency {
+    size_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+static struct testlib_latency testlib_hist_latency(struct testlib_histogram *hist) {
+    struct testlib_latency latency = {0};
+    if (hist->count == 0) {
+        return latency;
+    }
+    latency.count = hist->count;
+    latency.p50 = testlib_hist_percentile(hist, 50);
+    latency.p90 = testlib_hist_percentile(hist, 90);
+    latency.p99 = testlib_hist_percentile(hist, 99);
+    latency.p999 = testlib_hist_percentile(hist, 99.9);
+    latency.max = hist->max;
+    return latency;
+}
+
+static inline uint64_t testlib_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// == Reports ==
+
 struct testlib_report {
     float hitrate;
-    double latency_ns;
+    double latency_ns;   // wall time of the pass per lookup
+    double tlb_misses;   // per lookup, -1 if not available
+    struct testlib_latency hits;
+    struct testlib_latency misses;   // refill and write, with the chunk drops
 };
 
-struct testlib_report testlib_measure_set(struct fallthrough_cache* cache, struct testlib_keyset* keyset) {
+// Times every lookup, one clock read each, the histogram update is counted in the next lookup.
+struct testlib_report testlib_measure_set(struct fallthrough_cache* cache, struct testlib_keyset* keyset,
+                                          const char *name) {
     testlib_set_random_order(keyset);
  
     struct testlib_report report = {0};
+    struct testlib_histogram *hits = calloc(1, sizeof(struct testlib_histogram));
+    struct testlib_histogram *misses = calloc(1, sizeof(struct testlib_histogram));
+    // Low bit is the hit, written out after the pass
+    uint64_t *samples = testlib_samples != NULL ? malloc(keyset->cnt * sizeof(uint64_t)) : NULL;
 
     struct timespec start, end;
+    refill_ctx.count = 0;
+    int64_t tlb_misses = testlib_tlb_misses();
     clock_gettime(CLOCK_MONOTONIC, &start);
-    float hitrate = testlib_get_all(cache, keyset);
+    uint64_t last = testlib_now_ns();
+    for (size_t i = 0; i < keyset->cnt; ++i) {
+        uint64_t refills = refill_ctx.count;
+        testlib_get_one(cache, keyset);
+        uint64_t now = testlib_now_ns();
+        bool hit = refill_ctx.count == refills;
+        testlib_hist_add(hit ? hits : misses, now - last);
+        if (samples != NULL) {
+            samples[i] = (now - last) << 1 | hit;
+        }
+        last = now;
+    }
     clock_gettime(CLOCK_MONOTONIC, &end);
+    testlib_set_standard_order(keyset);
+    report.tlb_misses = tlb_misses < 0 ? -1 : (double) (testlib_tlb_misses() - tlb_misses) / keyset->cnt;
     report.latency_ns = (end.tv_sec - start.tv_sec) * 1e9;
     report.latency_ns += (end.tv_nsec - start.tv_nsec);
     report.latency_ns /= keyset->cnt;
-    report.hitrate = hitrate;
+    report.hitrate = (float) hits->count / (float) keyset->cnt;
+    report.hits = testlib_hist_latency(hits);
+    report.misses = testlib_hist_latency(misses);
+    if (testlib_verbose) {
+        printf("size=%zuMb hitrate=%.2f%%\n", keyset->cnt * PAGE_SIZE/M, report.hitrate * 100);
+    }
 
+    if (samples != NULL) {
+        for (size_t i = 0; i < keyset->cnt; ++i) {
+            fprintf(testlib_samples, "%s,%d,%lu\n", name, (int) (samples[i] & 1), samples[i] >> 1);
+        }
+        fflush(testlib_samples);
+        free(samples);
+    }
+    free(hits);
+    free(misses);
     return report;
 }
 
-
+static void testlib_print_latency(struct testlib_latency latency, const char* prefix, const char* kind) {
+    printf("%s_%s=%zu p50=%luns p90=%luns p99=%luns p99.9=%luns max=%luns\n", prefix, kind, latency.count,
+           latency.p50, latency.p90, latency.p99, latency.p999, latency.max);
+}
 
 void testlib_print_report(struct testlib_report report, const char* prefix) {
     printf("%s_hitrate=%.2f\n", prefix, report.hitrate);
     printf("%s_latency=%.2fns\n", prefix, report.latency_ns);
+    testlib_print_latency(report.hits, prefix, "hits");
+    testlib_print_latency(report.misses, prefix, "misses");
+    if (report.tlb_misses >= 0) {
+        printf("%s_dtlb_misses=%.2f\n", prefix, report.tlb_misses);
+    } else {
+        printf("%s_dtlb_misses=n/a\n", prefix);
+    }
 }
 
+#define HOT_COLD_HOT_SIZE (1*G)
+#define HOT_COLD_JUNK_SIZE (256*M)
+
 struct hot_cold_report {
     struct testlib_report hot_before_reclaim;
     struct testlib_report hot_after_reclaim;
@@ -165,13 +377,17 @@ struct hot_cold_report {
     struct testlib_report cold_after_reclaim;
 
     float reclaim_latency;
+    size_t anon_huge_before_reclaim;
+    size_t anon_huge_after_reclaim;
 };
 
 
 
-struct hot_cold_report run_hot_cold(struct fallthrough_cache* cache, size_t set_size, size_t reclaim_size) {
-    size_t hot_size = 1*G;
-    size_t junk_size = 256 * M;
+// Hot keys are factor_hot times as likely as cold ones in the warmup.
+struct hot_cold_report run_hot_cold(struct fallthrough_cache* cache, size_t set_size, int factor_hot,
+                                    size_t reclaim_size) {
+    size_t hot_size = HOT_COLD_HOT_SIZE;
+    size_t junk_size = HOT_COLD_JUNK_SIZE;
     size_t cold_size = (set_size - hot_size) - junk_size;
     if (testlib_verbose) {
         printf("Hot size: %zuMb, cold size: %zuMb\n", hot_size/M, cold_size/M);
@@ -183,9 +399,8 @@ struct hot_cold_report run_hot_cold(struct fallthrough_cache* cache, size_t set_
     struct testlib_keyset junk_set;
     testlib_init_keyset(&junk_set, junk_size/PAGE_SIZE);
 
-    struct hot_cold_report report;
+    struct hot_cold_report report = {0};
 
-    int factor_hot = 3;
     int passes = 2;
 
     size_t total = (factor_hot + 1) * passes * (cold_size + hot_size)/PAGE_SIZE;
@@ -205,8 +420,9 @@ struct hot_cold_report run_hot_cold(struct fallthrough_cache* cache, size_t set_
     testlib_get_all(cache, &junk_set);
     printf("Warmup finished: hot %zu, cold %zu\n", cnt_hot, cnt_cold);
 
-    report.hot_before_reclaim = testlib_measure_set(cache, &hot_set);
-    report.cold_before_reclaim = testlib_measure_set(cache, &cold_set);
+    report.hot_before_reclaim = testlib_measure_set(cache, &hot_set, "hot_before_reclaim");
+    report.cold_before_reclaim = testlib_measure_set(cache, &cold_set, "cold_before_reclaim");
+    report.anon_huge_before_reclaim = testlib_anon_huge_bytes();
 
     if (reclaim_size) {
         struct timespec start, end;
@@ -215,14 +431,15 @@ struct hot_cold_report run_hot_cold(struct fallthrough_cache* cache, size_t set_
         clock_gettime(CLOCK_MONOTONIC, &end);
         report.reclaim_latency = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1e6;
     }
+    report.anon_huge_after_reclaim = testlib_anon_huge_bytes();
 
     testlib_set_random_order(&hot_set);
     printf("Measuring hot (%zuK pages)...\n", hot_set.cnt/K);
-    report.hot_after_reclaim = testlib_measure_set(cache, &hot_set);
+    report.hot_after_reclaim = testlib_measure_set(cache, &hot_set, "hot_after_reclaim");
 
     testlib_set_random_order(&cold_set);
     printf("Measuring cold (%zuK pages)...\n", cold_set.cnt/K);
-    report.cold_after_reclaim = testlib_measure_set(cache, &cold_set);
+    report.cold_after_reclaim = testlib_measure_set(cache, &cold_set, "cold_after_reclaim");
 
     // printf("\nStarting final check %d times, core is %dx\n", attempts, factor);
     // for (int i = 0; i < attempts; ++i) {
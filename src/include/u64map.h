@@ -0,0 +1,272 @@
+#ifndef U64MAP_H
+#define U64MAP_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Open addressing map from uint64_t keys to uint64_t values.
+//
+// Linear probing with keys stored inline next to values. Values are 8 bytes,
+// or 4 bytes with u64map_init_ex when they fit, the slots are packed to 12 bytes then.
+// A separate array of 1-byte tags (0 = empty, 0x80|7 hash bits = used) is probed
+// 16 slots at a time, so most probes never touch the slot array.
+// Deletion shifts the following entries back, so there are no tombstones.
+//
+// Memory: 17 bytes per slot (13 with 4-byte values), at most 7/8 of the slots are used.
+//
+// One writer may run concurrently with readers as long as the map doesn't grow:
+// readers can get a stale value or miss a moved key, but never read out of bounds.
+
+#define U64MAP_GROUP 16
+#define U64MAP_NONE SIZE_MAX
+
+struct u64map {
+    uint8_t *tags;              // capacity + U64MAP_GROUP, tail mirrors the first group
+    uint8_t *slots;             // capacity, key then value
+    size_t capacity;
+    size_t size;
+    size_t value_size;          // 4 or 8
+    size_t stride;              // 8 + value_size, values stay aligned to their size
+};
+
+static inline uint64_t u64map_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline uint8_t u64map_tag(uint64_t hash) {
+    return 0x80 | (hash & 0x7f);
+}
+
+// Home slot uses the high bits of the hash, the tag uses the low ones.
+static inline size_t u64map_home(const struct u64map *map, uint64_t hash) {
+    return (size_t) (((unsigned __int128) hash * map->capacity) >> 64);
+}
+
+static inline size_t u64map_next(const struct u64map *map, size_t idx, size_t step) {
+    idx += step;
+    return idx >= map->capacity ? idx - map->capacity : idx;
+}
+
+static inline void u64map_set_tag(struct u64map *map, size_t idx, uint8_t tag) {
+    map->tags[idx] = tag;
+    if (idx < U64MAP_GROUP) {
+        map->tags[map->capacity + idx] = tag;
+    }
+}
+
+// Returns bitmask of tags in [idx, idx+U64MAP_GROUP) equal to tag, and of empty ones.
+static inline void u64map_match(const struct u64map *map, size_t idx, uint8_t tag,
+                                uint32_t *match, uint32_t *empty) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*) &map->tags[idx]);
+    *match = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+    *empty = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_setzero_si128()));
+#else
+    *match = 0;
+    *empty = 0;
+    for (uint32_t i = 0; i < U64MAP_GROUP; ++i) {
+        *match |= (uint32_t) (map->tags[idx + i] == tag) << i;
+        *empty |= (uint32_t) (map->tags[idx + i] == 0) << i;
+    }
+#endif
+}
+
+// == Slot access ==
+// Values are loaded and stored whole, so concurrent readers never see a torn one.
+
+static inline uint8_t* u64map_slot(const struct u64map *map, size_t idx) {
+    return map->slots + idx * map->stride;
+}
+
+static inline uint64_t u64map_key(const struct u64map *map, size_t idx) {
+    uint64_t key;
+    memcpy(&key, u64map_slot(map, idx), sizeof(key));
+    return key;
+}
+
+static inline uint64_t u64map_value(const struct u64map *map, size_t idx) {
+    if (map->value_size == sizeof(uint32_t)) {
+        uint32_t value;
+        memcpy(&value, u64map_slot(map, idx) + sizeof(uint64_t), sizeof(value));
+        return value;
+    }
+    uint64_t value;
+    memcpy(&value, u64map_slot(map, idx) + sizeof(uint64_t), sizeof(value));
+    return value;
+}
+
+static inline void u64map_set_value(struct u64map *map, size_t idx, uint64_t value) {
+    if (map->value_size == sizeof(uint32_t)) {
+        assert(value <= UINT32_MAX);
+        uint32_t narrow = value;
+        memcpy(u64map_slot(map, idx) + sizeof(uint64_t), &narrow, sizeof(narrow));
+        return;
+    }
+    memcpy(u64map_slot(map, idx) + sizeof(uint64_t), &value, sizeof(value));
+}
+
+// value_size is 4 or 8 bytes, 4-byte maps only take values up to UINT32_MAX.
+static void u64map_init_ex(struct u64map *map, size_t expected, size_t value_size) {
+    assert(value_size == sizeof(uint32_t) || value_size == sizeof(uint64_t));
+    size_t capacity = expected + expected / 7 + 1;
+    if (capacity < U64MAP_GROUP) {
+        capacity = U64MAP_GROUP;
+    }
+    memset(map, 0, sizeof(*map));
+    map->capacity = capacity;
+    map->value_size = value_size;
+    map->stride = sizeof(uint64_t) + value_size;
+    map->tags = calloc(capacity + U64MAP_GROUP, sizeof(uint8_t));
+    map->slots = malloc(capacity * map->stride);
+    assert(map->tags != NULL);
+    assert(map->slots != NULL);
+}
+
+static inline void u64map_init(struct u64map *map, size_t expected) {
+    u64map_init_ex(map, expected, sizeof(uint64_t));
+}
+
+static void u64map_destroy(struct u64map *map) {
+    free(map->tags);
+    free(map->slots);
+    memset(map, 0, sizeof(*map));
+}
+
+static inline size_t u64map_size(const struct u64map *map) {
+    return map->size;
+}
+
+static inline size_t u64map_memory(const struct u64map *map) {
+    return map->capacity * map->stride + map->capacity + U64MAP_GROUP;
+}
+
+// Returns slot index of the key or U64MAP_NONE.
+static inline size_t u64map_find(const struct u64map *map, uint64_t key) {
+    uint64_t hash = u64map_hash(key);
+    uint8_t tag = u64map_tag(hash);
+    size_t idx = u64map_home(map, hash);
+
+    while (true) {
+        uint32_t match, empty;
+        u64map_match(map, idx, tag, &match, &empty);
+        if (empty) {
+            // Probe sequence ends at the first empty slot
+            match &= (empty & -empty) - 1;
+        }
+        while (match) {
+            size_t slot = u64map_next(map, idx, __builtin_ctz(match));
+            if (u64map_key(map, slot) == key) {
+                return slot;
+            }
+            match &= match - 1;
+        }
+        if (empty) {
+            return U64MAP_NONE;
+        }
+        idx = u64map_next(map, idx, U64MAP_GROUP);
+    }
+}
+
+// Prefetches the first tag group and slot of the key, for batched lookups.
+static inline void u64map_prefetch(const struct u64map *map, uint64_t key) {
+    size_t idx = u64map_home(map, u64map_hash(key));
+    __builtin_prefetch(&map->tags[idx]);
+    __builtin_prefetch(u64map_slot(map, idx));
+}
+
+static inline bool u64map_get(const struct u64map *map, uint64_t key, uint64_t *value) {
+    size_t slot = u64map_find(map, key);
+    if (slot == U64MAP_NONE) {
+        return false;
+    }
+    *value = u64map_value(map, slot);
+    return true;
+}
+
+static void u64map_grow(struct u64map *map);
+
+static inline void u64map_put(struct u64map *map, uint64_t key, uint64_t value) {
+    size_t slot = u64map_find(map, key);
+    if (slot != U64MAP_NONE) {
+        u64map_set_value(map, slot, value);
+        return;
+    }
+    if ((map->size + 1) * 8 > map->capacity * 7) {
+        u64map_grow(map);
+    }
+
+    uint64_t hash = u64map_hash(key);
+    size_t idx = u64map_home(map, hash);
+    while (true) {
+        uint32_t match, empty;
+        u64map_match(map, idx, 0, &match, &empty);
+        if (empty) {
+            slot = u64map_next(map, idx, __builtin_ctz(empty));
+            break;
+        }
+        idx = u64map_next(map, idx, U64MAP_GROUP);
+    }
+
+    memcpy(u64map_slot(map, slot), &key, sizeof(key));
+    u64map_set_value(map, slot, value);
+    u64map_set_tag(map, slot, u64map_tag(hash));
+    map->size++;
+}
+
+// Removes the entry at slot index, shifting the rest of the cluster back.
+static inline void u64map_erase_at(struct u64map *map, size_t hole) {
+    size_t idx = hole;
+    while (true) {
+        idx = u64map_next(map, idx, 1);
+        if (map->tags[idx] == 0) {
+            break;
+        }
+        size_t home = u64map_home(map, u64map_hash(u64map_key(map, idx)));
+        // Entry can't move if its home is cyclically in (hole, idx]
+        bool stays = hole <= idx ? (hole < home && home <= idx)
+                                 : (hole < home || home <= idx);
+        if (stays) {
+            continue;
+        }
+        memcpy(u64map_slot(map, hole), u64map_slot(map, idx), map->stride);
+        u64map_set_tag(map, hole, map->tags[idx]);
+        hole = idx;
+    }
+    u64map_set_tag(map, hole, 0);
+    map->size--;
+}
+
+static inline bool u64map_remove(struct u64map *map, uint64_t key) {
+    size_t slot = u64map_find(map, key);
+    if (slot == U64MAP_NONE) {
+        return false;
+    }
+    u64map_erase_at(map, slot);
+    return true;
+}
+
+static void u64map_grow(struct u64map *map) {
+    struct u64map old = *map;
+    u64map_init_ex(map, old.capacity * 2, old.value_size);
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.tags[i] != 0) {
+            u64map_put(map, u64map_key(&old, i), u64map_value(&old, i));
+        }
+    }
+    u64map_destroy(&old);
+}
+
+#endif
@@ -10,6 +10,9 @@
 #define M (K*K)
 #define G (K*M)
 
+// Transparent huge page size on x86_64 and arm64 with 4Kb pages.
+#define HUGE_PAGE_SIZE (2*M)
+
 #define UNUSED(x) (void)(x)
 
 static uint8_t                  EMPTY_PAGE[PAGE_SIZE];
@@ -22,6 +25,8 @@ typedef void* (*mmap_impl_t)(size_t size);
 
 // Allocate anonymous memory.
 void *lazyfree_mmap_anon(size_t size);
+// Allocate anonymous memory aligned to HUGE_PAGE_SIZE, with MADV_HUGEPAGE.
+void *lazyfree_mmap_anon_huge(size_t size);
 // Allocate file memory.
 void *lazyfree_mmap_file(size_t size);
 
@@ -33,7 +38,35 @@ void lazyfree_madv_free(void *memory, size_t size);
 // MADV_COLD
 void lazyfree_madv_cold(void *memory, size_t size);
 
+// MADV_PAGEOUT, pages go to swap and keep their content
+void lazyfree_madv_pageout(void *memory, size_t size);
+
 // nop
 void lazyfree_madv_nop(void *memory, size_t size);
 
+// MADV_POPULATE_WRITE, or a write fault per page without it
+void lazyfree_populate(void *memory, size_t size);
+
+
+
+// == Copy functions ==
+// Candidates for lazyfree_copy, all of them copy size bytes of src to dest.
+
+void lazyfree_copy_scalar(void *dest, const volatile uint8_t *src, size_t size);
+#if defined(__x86_64__)
+void lazyfree_copy_sse2(void *dest, const volatile uint8_t *src, size_t size);
+void lazyfree_copy_avx2(void *dest, const volatile uint8_t *src, size_t size);
+#endif
+
+struct lazyfree_copy_variant {
+    const char *name;
+    lazyfree_copy_t copy;
+};
+
+// Candidates supported by the CPU, best first and the scalar copy last. Returns their count.
+size_t lazyfree_copy_variants(const struct lazyfree_copy_variant **variants);
+
+// Best candidate supported by the CPU.
+lazyfree_copy_t lazyfree_copy_select(void);
+
 #endif
@@ -0,0 +1,914 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "cache.h"
+#include "fallthrough_cache.h"
+#include "lazyfree_cache.h"
+#include "sharded_cache.h"
+
+#include "util.h"
+#include "random.h"
+#include "refill.h"
+#include "u64map.h"
+#include "hashmap.h"
+
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// == Index: u64map vs hashmap.h ==
+
+// Same wrappers lazyfree_cache.c used on top of hashmap.h
+static int exact_key_comparer(const void *a, hashmap_uint32_t a_len,
+                              const void *b, hashmap_uint32_t b_len) {
+    UNUSED(a_len);
+    UNUSED(b_len);
+    return a == b;
+}
+
+static hashmap_uint32_t exact_key_hasher(hashmap_uint32_t seed,
+                                         const void *key,
+                                         hashmap_uint32_t key_len) {
+    UNUSED(key_len);
+    return seed + (uint32_t) u64map_hash((uint64_t) key) + 1;
+}
+
+static union {
+    uint64_t value;
+    void *ptr;
+    struct {
+        uint32_t index;
+        int8_t chunk;
+        bool set;
+    } entry;
+} hmap_access;
+
+struct index_result {
+    double put_ns;
+    double hit_ns;
+    double miss_ns;
+    double remove_ns;
+    double bytes_per_entry;
+};
+
+static struct index_result bench_hashmap(const uint64_t *keys, size_t cnt) {
+    struct index_result result = {0};
+    struct hashmap_s map;
+    hashmap_create_ex((struct hashmap_create_options_s){
+        .initial_capacity = cnt,
+        .comparer = &exact_key_comparer,
+        .hasher = &exact_key_hasher,
+    }, &map);
+
+    double start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        hmap_access.value = i;
+        hmap_access.entry.set = true;
+        hashmap_put(&map, (void*) keys[i], sizeof(keys[i]), hmap_access.ptr);
+    }
+    result.put_ns = (now_ns() - start) / cnt;
+
+    uint64_t sum = 0;
+    start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        hmap_access.ptr = hashmap_get(&map, (void*) keys[i], sizeof(keys[i]));
+        sum += hmap_access.entry.index;
+    }
+    result.hit_ns = (now_ns() - start) / cnt;
+
+    start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        hmap_access.ptr = hashmap_get(&map, (void*) ~keys[i], sizeof(keys[i]));
+        sum += hmap_access.entry.set;
+    }
+    result.miss_ns = (now_ns() - start) / cnt;
+
+    result.bytes_per_entry = (double) (hashmap_capacity(&map) + HASHMAP_LINEAR_PROBE_LENGTH)
+                             * sizeof(struct hashmap_element_s) / cnt;
+
+    start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        hashmap_remove(&map, (void*) keys[i], sizeof(keys[i]));
+    }
+    result.remove_ns = (now_ns() - start) / cnt;
+
+    hashmap_destroy(&map);
+    if (sum == 42) {
+        printf("\n");
+    }
+    return result;
+}
+
+static struct index_result bench_u64map(const uint64_t *keys, size_t cnt, size_t value_size) {
+    struct index_result result = {0};
+    struct u64map map;
+    u64map_init_ex(&map, cnt, value_size);
+
+    double start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        u64map_put(&map, keys[i], i);
+    }
+    result.put_ns = (now_ns() - start) / cnt;
+
+    uint64_t sum = 0;
+    start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        uint64_t value = 0;
+        u64map_get(&map, keys[i], &value);
+        sum += value;
+    }
+    result.hit_ns = (now_ns() - start) / cnt;
+
+    start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        uint64_t value = 0;
+        sum += u64map_get(&map, ~keys[i], &value);
+    }
+    result.miss_ns = (now_ns() - start) / cnt;
+
+    result.bytes_per_entry = (double) u64map_memory(&map) / cnt;
+
+    start = now_ns();
+    for (size_t i = 0; i < cnt; ++i) {
+        u64map_remove(&map, keys[i]);
+    }
+    result.remove_ns = (now_ns() - start) / cnt;
+    assert(u64map_size(&map) == 0);
+
+    u64map_destroy(&map);
+    if (sum == 42) {
+        printf("\n");
+    }
+    return result;
+}
+
+// hashmap.h rehashes whenever 8 consecutive slots are taken, and
+// for random keys it ends up at ~16x capacity (it does not check calloc).
+static bool hashmap_fits(size_t cnt) {
+    size_t memory = sysconf(_SC_PHYS_PAGES) * (size_t) sysconf(_SC_PAGESIZE);
+    return cnt * 16 * sizeof(struct hashmap_element_s) < memory / 2;
+}
+
+static void print_index_result(const char *name, size_t cnt, struct index_result r) {
+    printf("%-8s entries=%zuM put=%.1fns hit=%.1fns miss=%.1fns remove=%.1fns bytes_per_entry=%.1f\n",
+           name, cnt / 1000000, r.put_ns, r.hit_ns, r.miss_ns, r.remove_ns, r.bytes_per_entry);
+}
+
+static void suite_index(int argc, char **argv) {
+    size_t default_sizes[] = {1, 10, 100};
+    size_t sizes_cnt = argc > 0 ? (size_t) argc : sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+    for (size_t s = 0; s < sizes_cnt; ++s) {
+        size_t cnt = (argc > 0 ? (size_t) atoll(argv[s]) : default_sizes[s]) * 1000000;
+        uint64_t *keys = malloc(cnt * sizeof(uint64_t));
+        assert(keys != NULL);
+        for (size_t i = 0; i < cnt; ++i) {
+            keys[i] = random_next();
+        }
+
+        if (hashmap_fits(cnt)) {
+            print_index_result("hashmap", cnt, bench_hashmap(keys, cnt));
+        } else {
+            printf("%-8s entries=%zuM skipped, does not fit in memory\n", "hashmap", cnt / 1000000);
+        }
+        print_index_result("u64map", cnt, bench_u64map(keys, cnt, sizeof(uint64_t)));
+        // With the 4-byte values of the cache index
+        print_index_result("u64map32", cnt, bench_u64map(keys, cnt, sizeof(uint32_t)));
+        free(keys);
+    }
+}
+
+// == Threads: ft_cache_get throughput over the sharded cache ==
+
+#define THREADS_MAX 32
+#define THREADS_DURATION_NS 1e9
+
+struct threads_ctx {
+    ft_cache_t *cache;
+    size_t keys_cnt;
+    uint64_t seed;
+    volatile bool *stop;
+    size_t ops;
+} __attribute__((aligned(64)));
+
+static void* run_threads_gets(void *opaque) {
+    struct threads_ctx *ctx = opaque;
+    size_t ops = 0;
+    while (!*ctx->stop) {
+        for (int i = 0; i < 64; ++i) {
+            uint64_t key = 1 + random_next_r(&ctx->seed) % ctx->keys_cnt;
+            uint64_t value;
+            ft_cache_get(ctx->cache, key, (uint8_t*) &value);
+            assert(value == refill_expected(key));
+        }
+        ops += 64;
+    }
+    ctx->ops = ops;
+    return NULL;
+}
+
+static double bench_threads(ft_cache_t *cache, size_t keys_cnt, size_t threads_cnt) {
+    pthread_t threads[THREADS_MAX];
+    struct threads_ctx ctx[THREADS_MAX];
+    volatile bool stop = false;
+
+    for (size_t i = 0; i < threads_cnt; ++i) {
+        ctx[i] = (struct threads_ctx){
+            .cache = cache,
+            .keys_cnt = keys_cnt,
+            .seed = random_next(),
+            .stop = &stop,
+        };
+        pthread_create(&threads[i], NULL, run_threads_gets, &ctx[i]);
+    }
+    double start = now_ns();
+    usleep(THREADS_DURATION_NS / 1000);
+    stop = true;
+
+    size_t ops = 0;
+    for (size_t i = 0; i < threads_cnt; ++i) {
+        pthread_join(threads[i], NULL);
+        ops += ctx[i].ops;
+    }
+    return ops / ((now_ns() - start) / 1e9);
+}
+
+// threads [capacity_mb] [shards...]
+static void suite_threads(int argc, char **argv) {
+    size_t capacity = (argc > 0 ? (size_t) atoll(argv[0]) : 1024) * M;
+    size_t default_shards[] = {1, LAZYFREE_DEFAULT_SHARDS};
+    size_t shards_cnt = argc > 1 ? (size_t) argc - 1 : sizeof(default_shards) / sizeof(default_shards[0]);
+    // Mostly hits, some refills
+    size_t keys_cnt = capacity / PAGE_SIZE * 9 / 10;
+
+    for (size_t run = 0; run < 2 * shards_cnt; ++run) {
+        size_t s = run / 2;
+        struct lazyfree_impl impl = lazyfree_sharded_impl();
+        impl.config.shards = argc > 1 ? (size_t) atoll(argv[s + 1]) : default_shards[s];
+        impl.config.optimistic_reads = run % 2 == 1;
+
+        ft_cache_t cache;
+        ft_cache_init(&cache, impl, refill_cb, NULL, capacity / PAGE_SIZE, sizeof(uint64_t));
+        for (size_t key = 1; key <= keys_cnt; ++key) {
+            uint64_t value;
+            ft_cache_get(&cache, key, (uint8_t*) &value);
+        }
+
+        double base = 0;
+        for (size_t threads = 1; threads <= THREADS_MAX; threads *= 2) {
+            double ops = bench_threads(&cache, keys_cnt, threads);
+            if (threads == 1) {
+                base = ops;
+            }
+            printf("shards=%-3zu reads=%-10s threads=%-3zu ops=%.2fM/s scaling=%.2fx\n",
+                   impl.config.shards, impl.config.optimistic_reads ? "optimistic" : "locked",
+                   threads, ops / 1e6, ops / base);
+        }
+        ft_cache_destroy(&cache);
+    }
+}
+
+// == Chunks: hitrate and write latency by chunk granularity ==
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// 3/4 of gets go to a hot set of 1/4 of the capacity, the rest to 4x the capacity.
+static uint64_t chunks_next_key(uint64_t *seed, size_t pages) {
+    uint64_t rnd = random_next_r(seed);
+    if (rnd % 4 != 0) {
+        return 1 + (rnd >> 2) % (pages / 4);
+    }
+    return 1 + pages + (rnd >> 2) % (4 * pages);
+}
+
+// Returns hitrate, fills write latencies of the misses.
+static double run_chunks_gets(lazyfree_cache_t cache, size_t pages, size_t ops,
+                              double *write_ns, size_t *writes) {
+    uint64_t seed = random_next();
+    size_t hits = 0;
+    *writes = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        lazyfree_rlock_t lock = { .key = chunks_next_key(&seed, pages) };
+        lazyfree_read_lock(cache, &lock);
+        if (lazyfree_read_unlock(cache, &lock, false)) {
+            hits++;
+            continue;
+        }
+        double start = now_ns();
+        lazyfree_wlock_t wlock = lazyfree_write_lock(cache, &lock);
+        wlock.page[PAGE_SIZE - 1] = lock.key;
+        lazyfree_write_unlock(cache, &wlock, false);
+        write_ns[(*writes)++] = now_ns() - start;
+    }
+    return (double) hits / ops;
+}
+
+// chunks [capacity_mb] [chunks...]
+// Every chunk count runs with writers advising and dropping chunks, then with the maintenance thread.
+static void suite_chunks(int argc, char **argv) {
+    size_t capacity = (argc > 0 ? (size_t) atoll(argv[0]) : 1024) * M;
+    size_t default_chunks[] = {8, 32, 128, 512, 2048};
+    size_t runs = argc > 1 ? (size_t) argc - 1 : sizeof(default_chunks) / sizeof(default_chunks[0]);
+    size_t pages = capacity / PAGE_SIZE;
+    size_t ops = 4 * pages;
+    double *write_ns = malloc(ops * sizeof(double));
+    assert(write_ns != NULL);
+
+    for (size_t run = 0; run < 2 * runs; ++run) {
+        size_t chunks = argc > 1 ? (size_t) atoll(argv[run / 2 + 1]) : default_chunks[run / 2];
+        bool maintenance = run % 2 == 1;
+        lazyfree_cache_t cache = lazyfree_cache_new_ex(capacity, (struct lazyfree_config){
+            .lazyfree_chunks = chunks,
+            .maintenance_thread = maintenance,
+        });
+
+        size_t writes;
+        run_chunks_gets(cache, pages, ops, write_ns, &writes);
+        double hitrate = run_chunks_gets(cache, pages, ops, write_ns, &writes);
+
+        double sum = 0;
+        for (size_t i = 0; i < writes; ++i) {
+            sum += write_ns[i];
+        }
+        qsort(write_ns, writes, sizeof(double), compare_double);
+        printf("chunks=%-5zu chunk_size=%-7.2fMb maintenance=%d hitrate=%.2f%% write_avg=%.0fns "
+               "write_p99=%.0fns write_p999=%.0fns write_max=%.2fms waits=%lu\n",
+               chunks, (double) capacity / chunks / M, maintenance, hitrate * 100,
+               writes ? sum / writes : 0, writes ? write_ns[writes * 99 / 100] : 0,
+               writes ? write_ns[writes * 999 / 1000] : 0, writes ? write_ns[writes - 1] / 1e6 : 0,
+               lazyfree_fetch_stats(cache).maintenance_waits);
+        lazyfree_cache_free(cache);
+    }
+    free(write_ns);
+}
+
+// == Residency: miss path after a reclaim, with and without mincore ==
+
+enum residency_mode {
+    RESIDENCY_TAIL,     // read the tail byte, faults in the zero page
+    RESIDENCY_MINCORE,  // config.residency_check
+    RESIDENCY_SCRUB,    // scrub everything first, misses are index misses
+};
+static const char *residency_mode_names[] = {"tail", "mincore", "scrub"};
+
+static long minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// Touches size bytes, MADV_FREE pages are reclaimed first.
+static void residency_reclaim(size_t size) {
+    uint8_t *mem = lazyfree_mmap_anon(size);
+    for (size_t i = 0; i < size / PAGE_SIZE; ++i) {
+        mem[i * PAGE_SIZE] = 1;
+    }
+    munmap(mem, size);
+}
+
+// residency [capacity_mb] [reclaim_mb]
+static void suite_residency(int argc, char **argv) {
+    size_t capacity = (argc > 0 ? (size_t) atoll(argv[0]) : 1024) * M;
+    size_t pages = capacity / PAGE_SIZE;
+    double *miss_ns = malloc(pages * sizeof(double));
+    assert(miss_ns != NULL);
+
+    for (int mode = RESIDENCY_TAIL; mode <= RESIDENCY_SCRUB; ++mode) {
+        lazyfree_cache_t cache = lazyfree_cache_new_ex(capacity, (struct lazyfree_config){
+            .lazyfree_chunks = NUMBER_OF_CHUNKS,
+            .residency_check = mode != RESIDENCY_TAIL,
+        });
+        for (size_t key = 1; key <= pages; ++key) {
+            lazyfree_rlock_t lock = { .key = key };
+            lazyfree_wlock_t wlock = lazyfree_write_lock(cache, &lock);
+            wlock.page[0] = 1;
+            lazyfree_write_unlock(cache, &wlock, false);
+        }
+
+        // Default: all free memory and half of the cache
+        size_t reclaim = argc > 1 ? (size_t) atoll(argv[1]) * M
+                                  : sysconf(_SC_AVPHYS_PAGES) * PAGE_SIZE + capacity / 2;
+        residency_reclaim(reclaim);
+
+        double scrub_ms = 0;
+        size_t scrubbed = 0;
+        if (mode == RESIDENCY_SCRUB) {
+            double start = now_ns();
+            scrubbed = lazyfree_cache_scrub(cache, pages);
+            scrub_ms = (now_ns() - start) / 1e6;
+        }
+
+        // Odd stride is a permutation of the keys, neighbours land in different chunks
+        size_t stride = pages / 3 * 2 + 1;
+        size_t hits = 0, misses = 0;
+        double hit_sum = 0, miss_sum = 0;
+        long faults = minor_faults();
+        for (size_t i = 0; i < pages; ++i) {
+            lazyfree_rlock_t lock = { .key = 1 + (i * stride) % pages };
+            double start = now_ns();
+            lazyfree_read_lock(cache, &lock);
+            bool hit = lazyfree_read_unlock(cache, &lock, false);
+            double elapsed = now_ns() - start;
+            if (hit) {
+                hits++;
+                hit_sum += elapsed;
+            } else {
+                miss_sum += elapsed;
+                miss_ns[misses++] = elapsed;
+            }
+        }
+        faults = minor_faults() - faults;
+        qsort(miss_ns, misses, sizeof(double), compare_double);
+
+        printf("mode=%-7s reclaim=%zuMb hitrate=%.2f%% hit_avg=%.0fns miss_avg=%.0fns miss_p99=%.0fns "
+               "minor_faults=%ld scrubbed=%zu scrub=%.2fms\n",
+               residency_mode_names[mode], reclaim / M, (double) hits / pages * 100,
+               hits ? hit_sum / hits : 0, misses ? miss_sum / misses : 0,
+               misses ? miss_ns[misses * 99 / 100] : 0, faults, scrubbed, scrub_ms);
+        lazyfree_cache_free(cache);
+    }
+    free(miss_ns);
+}
+
+// == Faults: page faults of the writes, with and without prefault ==
+
+enum prefault_mode {
+    PREFAULT_NONE,
+    PREFAULT_BATCHES,      // config.prefault, populated by the writer
+    PREFAULT_BACKGROUND,   // config.prefault and config.maintenance_thread
+};
+static const char *prefault_mode_names[] = {"none", "batches", "background"};
+
+// Writes count new keys from first, returns ns per write and fills the writer's faults per write.
+static double run_fault_writes(lazyfree_cache_t cache, uint64_t first, size_t count, double *faults) {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    long start_faults = usage.ru_minflt;
+    double start = now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        lazyfree_rlock_t lock = { .key = first + i };
+        lazyfree_wlock_t wlock = lazyfree_write_lock(cache, &lock);
+        wlock.page[PAGE_SIZE - 1] = 1;
+        lazyfree_write_unlock(cache, &wlock, false);
+    }
+    double elapsed = now_ns() - start;
+    getrusage(RUSAGE_THREAD, &usage);
+    *faults = (double) (usage.ru_minflt - start_faults) / count;
+    return elapsed / count;
+}
+
+// faults [capacity_mb]
+// Warmup fills the empty cache, refill writes twice its capacity more, into dropped chunks.
+static void suite_faults(int argc, char **argv) {
+    size_t capacity = (argc > 0 ? (size_t) atoll(argv[0]) : 1024) * M;
+    size_t pages = capacity / PAGE_SIZE;
+
+    for (int mode = PREFAULT_NONE; mode <= PREFAULT_BACKGROUND; ++mode) {
+        lazyfree_cache_t cache = lazyfree_cache_new_ex(capacity, (struct lazyfree_config){
+            .lazyfree_chunks = NUMBER_OF_CHUNKS,
+            .prefault = mode != PREFAULT_NONE,
+            .maintenance_thread = mode == PREFAULT_BACKGROUND,
+        });
+        double warmup_faults, refill_faults;
+        double warmup_ns = run_fault_writes(cache, 1, pages, &warmup_faults);
+        double refill_ns = run_fault_writes(cache, 1 + pages, 2 * pages, &refill_faults);
+        printf("prefault=%-10s warmup=%.0fns/write faults=%.3f/write refill=%.0fns/write faults=%.3f/write\n",
+               prefault_mode_names[mode], warmup_ns, warmup_faults, refill_ns, refill_faults);
+        lazyfree_cache_free(cache);
+    }
+}
+
+// == Ops: cost of every lock API call and of ft_cache_get, in ns/op ==
+
+#define OPS_BATCH 256
+
+enum ops_op {
+    OP_READ_LOCK,
+    OP_READ,              // lazyfree_read of the last 64 bytes
+    OP_READ_UNLOCK,
+    OP_WRITE_LOCK,        // upgrade of the read lock
+    OP_WRITE_UNLOCK,
+    OP_GET_HIT,
+    OP_GET_MISS,          // refill after ft_cache_drop
+    OP_COUNT,
+};
+static const char *ops_names[OP_COUNT] = {
+    "read_lock", "lazyfree_read", "read_unlock", "write_lock", "write_unlock", "get_hit", "get_miss",
+};
+
+// Every operation runs over a batch of distinct keys at a time: the same batch
+// when warm, spread over all keys_cnt keys with a random offset when cold.
+// Cold gets take another offset than the lock calls, so their keys are cold too.
+// Fills ns per op of each operation.
+static void run_ops(ft_cache_t *cache, size_t keys_cnt, bool warm, size_t batches, double *ns) {
+    lazyfree_cache_t lfcache = cache->cache;
+    lazyfree_rlock_t locks[OPS_BATCH];
+    lazyfree_wlock_t wlocks[OPS_BATCH];
+    uint64_t keys[OPS_BATCH];
+    uint64_t get_keys[OPS_BATCH];
+    uint8_t buf[64];
+    uint64_t value;
+    uint64_t seed = random_next();
+    double total[OP_COUNT] = {0};
+
+    for (size_t b = 0; b < batches; ++b) {
+        size_t offset = random_next_r(&seed);
+        size_t get_offset = random_next_r(&seed);
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            keys[i] = warm ? 1 + i : 1 + (offset + i * (keys_cnt / OPS_BATCH)) % keys_cnt;
+            get_keys[i] = warm ? 1 + i : 1 + (get_offset + i * (keys_cnt / OPS_BATCH)) % keys_cnt;
+        }
+
+        double start = now_ns();
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            locks[i] = (lazyfree_rlock_t){ .key = keys[i] };
+            lazyfree_read_lock(lfcache, &locks[i]);
+        }
+        double end = now_ns();
+        total[OP_READ_LOCK] += end - start;
+
+        start = end;
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            lazyfree_read(&locks[i], buf, PAGE_SIZE - sizeof(buf), sizeof(buf));
+        }
+        end = now_ns();
+        total[OP_READ] += end - start;
+
+        start = end;
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            lazyfree_read_unlock(lfcache, &locks[i], false);
+        }
+        end = now_ns();
+        total[OP_READ_UNLOCK] += end - start;
+
+        start = end;
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            wlocks[i] = lazyfree_write_lock(lfcache, &locks[i]);
+        }
+        end = now_ns();
+        total[OP_WRITE_LOCK] += end - start;
+
+        start = end;
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            lazyfree_write_unlock(lfcache, &wlocks[i], false);
+        }
+        end = now_ns();
+        total[OP_WRITE_UNLOCK] += end - start;
+
+        start = end;
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            ft_cache_get(cache, get_keys[i], (uint8_t*) &value);
+        }
+        end = now_ns();
+        total[OP_GET_HIT] += end - start;
+
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            ft_cache_drop(cache, get_keys[i]);
+        }
+        start = now_ns();
+        for (size_t i = 0; i < OPS_BATCH; ++i) {
+            ft_cache_get(cache, get_keys[i], (uint8_t*) &value);
+            assert(value == refill_expected(get_keys[i]));
+        }
+        total[OP_GET_MISS] += now_ns() - start;
+    }
+    for (size_t op = 0; op < OP_COUNT; ++op) {
+        ns[op] = total[op] / (batches * OPS_BATCH);
+    }
+}
+
+static void print_ops_row(const char *name, const double *samples, size_t runs) {
+    double sum = 0, min = samples[0], max = samples[0];
+    for (size_t run = 0; run < runs; ++run) {
+        sum += samples[run];
+        min = samples[run] < min ? samples[run] : min;
+        max = samples[run] > max ? samples[run] : max;
+    }
+    double mean = sum / runs;
+    double var = 0;
+    for (size_t run = 0; run < runs; ++run) {
+        var += (samples[run] - mean) * (samples[run] - mean);
+    }
+    double stddev = runs > 1 ? sqrt(var / (runs - 1)) : 0;
+    printf("  %-14s mean=%7.1fns stddev=%6.1fns (%4.1f%%) min=%7.1fns max=%7.1fns\n",
+           name, mean, stddev, mean > 0 ? stddev / mean * 100 : 0, min, max);
+}
+
+// ops [capacity_mb] [runs] [batches]
+// Half of the capacity is filled, so only misses allocate. Warm and cold runs alternate.
+static void suite_ops(int argc, char **argv) {
+    size_t capacity = (argc > 0 ? (size_t) atoll(argv[0]) : 256) * M;
+    size_t runs = argc > 1 ? (size_t) atoll(argv[1]) : 10;
+    size_t batches = argc > 2 ? (size_t) atoll(argv[2]) : 64;
+    size_t keys_cnt = capacity / PAGE_SIZE / 2;
+    assert(runs > 0 && keys_cnt >= OPS_BATCH);
+
+    ft_cache_t cache;
+    ft_cache_init(&cache, lazyfree_impl(), refill_cb, NULL, capacity / PAGE_SIZE, sizeof(uint64_t));
+    uint64_t value;
+    for (size_t key = 1; key <= keys_cnt; ++key) {
+        ft_cache_get(&cache, key, (uint8_t*) &value);
+    }
+
+    double *samples = malloc(2 * runs * OP_COUNT * sizeof(double));
+    assert(samples != NULL);
+    double ns[OP_COUNT];
+    // Not counted, the first run pays for the page tables and the index after the fill
+    run_ops(&cache, keys_cnt, true, batches, ns);
+    run_ops(&cache, keys_cnt, false, batches, ns);
+    for (size_t run = 0; run < runs; ++run) {
+        for (int cold = 0; cold <= 1; ++cold) {
+            run_ops(&cache, keys_cnt, !cold, batches, ns);
+            for (size_t op = 0; op < OP_COUNT; ++op) {
+                samples[(cold * OP_COUNT + op) * runs + run] = ns[op];
+            }
+        }
+    }
+
+    printf("capacity=%zuMb keys=%zu runs=%zu ops/run=%zu\n", capacity / M, keys_cnt, runs, batches * OPS_BATCH);
+    for (int cold = 0; cold <= 1; ++cold) {
+        printf("%s:\n", cold ? "cold" : "warm");
+        for (size_t op = 0; op < OP_COUNT; ++op) {
+            print_ops_row(ops_names[op], &samples[(cold * OP_COUNT + op) * runs], runs);
+        }
+    }
+    free(samples);
+    ft_cache_destroy(&cache);
+}
+
+// == Batch: ft_cache_get vs ft_cache_get_many ==
+
+#define BATCH_OPS (4*M)
+
+// Returns ns per key, all keys hit.
+static double run_batch_gets(ft_cache_t *cache, size_t keys_cnt, size_t batch) {
+    uint64_t keys[FT_BATCH * 4];
+    uint64_t values[FT_BATCH * 4];
+    uint64_t seed = random_next();
+    double start = now_ns();
+    for (size_t done = 0; done < BATCH_OPS; done += batch) {
+        for (size_t i = 0; i < batch; ++i) {
+            keys[i] = 1 + random_next_r(&seed) % keys_cnt;
+        }
+        if (batch == 1) {
+            ft_cache_get(cache, keys[0], (uint8_t*) values);
+        } else {
+            ft_cache_get_many(cache, keys, batch, (uint8_t*) values);
+        }
+        for (size_t i = 0; i < batch; ++i) {
+            assert(values[i] == refill_expected(keys[i]));
+        }
+    }
+    return (now_ns() - start) / BATCH_OPS;
+}
+
+// batch [capacity_mb] [batch sizes...]
+static void suite_batch(int argc, char **argv) {
+    size_t capacity = (argc > 0 ? (size_t) atoll(argv[0]) : 1024) * M;
+    size_t default_batches[] = {16, 32, 64, 128};
+    size_t runs = argc > 1 ? (size_t) argc - 1 : sizeof(default_batches) / sizeof(default_batches[0]);
+    // Anonymous memory, so every lookup hits
+    size_t keys_cnt = capacity / PAGE_SIZE * 9 / 10;
+    ft_cache_t cache;
+    ft_cache_init(&cache, lazyfree_anon_impl(), refill_cb, NULL, capacity / PAGE_SIZE, sizeof(uint64_t));
+    for (size_t key = 1; key <= keys_cnt; ++key) {
+        uint64_t value;
+        ft_cache_get(&cache, key, (uint8_t*) &value);
+    }
+
+    double single_ns = run_batch_gets(&cache, keys_cnt, 1);
+    printf("batch=%-4d get=%.0fns/key\n", 1, single_ns);
+    for (size_t run = 0; run < runs; ++run) {
+        size_t batch = argc > 1 ? (size_t) atoll(argv[run + 1]) : default_batches[run];
+        if (batch < 1 || batch > FT_BATCH * 4) {
+            printf("Batch size must be in [1, %d]\n", FT_BATCH * 4);
+            exit(1);
+        }
+        double many_ns = run_batch_gets(&cache, keys_cnt, batch);
+        printf("batch=%-4zu get_many=%.0fns/key speedup=%.2fx\n", batch, many_ns, single_ns / many_ns);
+    }
+    ft_cache_destroy(&cache);
+}
+
+
+// == Read: lazyfree_read copy functions ==
+
+#define READ_OPS (4*M)
+
+// lazyfree_read before the bulk copy, one volatile load per byte.
+static bool read_bytes(lazyfree_rlock_t* lock, void *dest, size_t offset, size_t size) {
+    if (!LAZYFREE_LOCK_CHECK(*lock)) {
+        return false;
+    }
+    for (size_t i = 0; i < size && offset + i < PAGE_SIZE; ++i) {
+        ((uint8_t*)dest)[i] = lock->head[offset + i];
+    }
+    if (offset + size == PAGE_SIZE) {
+        ((uint8_t*)dest)[size-1] = lock->tail;
+    }
+    return LAZYFREE_LOCK_CHECK(*lock);
+}
+
+// Returns ns per read of the last size bytes of a hot page, copy NULL means read_bytes.
+static double run_reads(lazyfree_rlock_t *lock, lazyfree_copy_t copy, size_t size, size_t ops) {
+    uint8_t dest[PAGE_SIZE];
+    lazyfree_copy_t dispatched = lazyfree_copy;
+    if (copy != NULL) {
+        lazyfree_copy = copy;
+    }
+    uint64_t checksum = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        bool ok = copy != NULL ? lazyfree_read(lock, dest, PAGE_SIZE - size, size)
+                               : read_bytes(lock, dest, PAGE_SIZE - size, size);
+        assert(ok);
+        UNUSED(ok);
+        checksum += dest[i % size];
+    }
+    double elapsed = (now_ns() - start) / ops;
+    lazyfree_copy = dispatched;
+    assert(checksum > 0);
+    return elapsed;
+}
+
+// read [sizes...]
+static void suite_read(int argc, char **argv) {
+    size_t default_sizes[] = {8, 256, 4096};
+    size_t runs = argc > 0 ? (size_t) argc : sizeof(default_sizes) / sizeof(default_sizes[0]);
+    uint8_t *page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    assert(page != NULL);
+    for (size_t i = 0; i < PAGE_SIZE; ++i) {
+        page[i] = 1 + i % 255;
+    }
+    lazyfree_rlock_t lock = { .key = 1, .head = page, .tail = page[PAGE_SIZE - 1] };
+
+    // Bytes, then every candidate the CPU runs, then the dispatched one
+    const struct lazyfree_copy_variant *variants;
+    size_t variants_count = lazyfree_copy_variants(&variants);
+    struct lazyfree_copy_variant copies[8] = { { "bytes", NULL } };
+    size_t copies_count = 1;
+    for (size_t i = 0; i < variants_count; ++i) {
+        copies[copies_count++] = variants[i];
+    }
+    copies[copies_count++] = (struct lazyfree_copy_variant){ "dispatched", lazyfree_copy_select() };
+    for (size_t run = 0; run < runs; ++run) {
+        size_t size = argc > 0 ? (size_t) atoll(argv[run]) : default_sizes[run];
+        if (size < 1 || size > PAGE_SIZE) {
+            printf("Size must be in [1, %d]\n", PAGE_SIZE);
+            exit(1);
+        }
+        // Same bytes per size, at least 64K reads
+        size_t ops = READ_OPS * 8 / size < 64*K ? 64*K : READ_OPS * 8 / size;
+        double bytes_ns = run_reads(&lock, NULL, size, ops);
+        for (size_t i = 0; i < copies_count; ++i) {
+            double ns = i == 0 ? bytes_ns : run_reads(&lock, copies[i].copy, size, ops);
+            printf("size=%-5zu copy=%-10s %8.1fns/read %6.2fGb/s speedup=%.2fx\n",
+                   size, copies[i].name, ns, size / ns, bytes_ns / ns);
+        }
+    }
+    free(page);
+}
+
+// == Backend: one refill per key vs batch refills ==
+
+#define BACKEND_KEYS (64*K)
+
+// Simulated ground truth, every call costs call_ns and every key key_ns more.
+struct backend {
+    double call_ns;
+    double key_ns;
+    size_t calls;
+};
+
+static void backend_wait(double ns) {
+    double start = now_ns();
+    while (now_ns() - start < ns) {
+    }
+}
+
+static void backend_refill(void *opaque, uint64_t key, uint8_t *value) {
+    struct backend *backend = opaque;
+    backend->calls++;
+    backend_wait(backend->call_ns + backend->key_ns);
+    refill_cb(NULL, key, value);
+}
+
+static void backend_refill_batch(void *opaque, const uint64_t *keys, size_t count, uint8_t *values) {
+    struct backend *backend = opaque;
+    backend->calls++;
+    backend_wait(backend->call_ns + backend->key_ns * count);
+    for (size_t i = 0; i < count; ++i) {
+        refill_cb(NULL, keys[i], values + i * sizeof(uint64_t));
+    }
+}
+
+// Returns ns per key, all keys miss.
+static double run_backend_gets(struct backend *backend, bool batch_refill, size_t batch) {
+    ft_cache_t cache;
+    ft_cache_init(&cache, lazyfree_anon_impl(), backend_refill, backend, BACKEND_KEYS, sizeof(uint64_t));
+    if (batch_refill) {
+        ft_cache_set_refill_batch(&cache, backend_refill_batch);
+    }
+    uint64_t keys[FT_BATCH];
+    uint64_t values[FT_BATCH];
+    backend->calls = 0;
+    double start = now_ns();
+    for (size_t done = 0; done < BACKEND_KEYS; done += batch) {
+        for (size_t i = 0; i < batch; ++i) {
+            keys[i] = 1 + done + i;
+        }
+        if (batch == 1) {
+            ft_cache_get(&cache, keys[0], (uint8_t*) values);
+        } else {
+            ft_cache_get_many(&cache, keys, batch, (uint8_t*) values);
+        }
+        for (size_t i = 0; i < batch; ++i) {
+            assert(values[i] == refill_expected(keys[i]));
+        }
+    }
+    double elapsed = (now_ns() - start) / BACKEND_KEYS;
+    ft_cache_destroy(&cache);
+    return elapsed;
+}
+
+// backend [call_us] [key_ns]
+static void suite_backend(int argc, char **argv) {
+    struct backend backend = {
+        .call_ns = (argc > 0 ? atof(argv[0]) : 20) * 1000,
+        .key_ns = argc > 1 ? atof(argv[1]) : 200,
+    };
+    printf("call=%.0fus key=%.0fns keys=%zuK, all misses\n", backend.call_ns / 1000, backend.key_ns, BACKEND_KEYS / K);
+
+    double single_ns = run_backend_gets(&backend, false, 1);
+    printf("%-28s %8.0fns/key calls=%zu\n", "get", single_ns, backend.calls);
+    double many_ns = run_backend_gets(&backend, false, FT_BATCH);
+    printf("%-28s %8.0fns/key calls=%zu speedup=%.2fx\n", "get_many", many_ns, backend.calls, single_ns / many_ns);
+    for (size_t batch = 8; batch <= FT_BATCH; batch *= 2) {
+        char name[64];
+        snprintf(name, sizeof(name), "get_many+refill_batch=%zu", batch);
+        double batch_ns = run_backend_gets(&backend, true, batch);
+        printf("%-28s %8.0fns/key calls=%zu speedup=%.2fx\n", name, batch_ns, backend.calls, single_ns / batch_ns);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <suite> [args...]\n", argv[0]);
+        printf("Suites:\n");
+        printf("  index [millions...]  u64map vs hashmap.h, default 1 10 100\n");
+        printf("  threads [capacity_mb] [shards...]  ft_cache_get throughput for 1..32 threads\n");
+        printf("  chunks [capacity_mb] [chunks...]  hitrate and write latency by chunk count, default 8..2048,\n"
+               "                                     without and with the maintenance thread\n");
+        printf("  residency [capacity_mb] [reclaim_mb]  miss latency after a reclaim: tail byte, mincore, scrub\n");
+        printf("  ops [capacity_mb] [runs] [batches]  ns/op of the lock APIs and ft_cache_get, warm and cold\n");
+        printf("  faults [capacity_mb]  page faults per write in warmup and refill, by prefault mode\n");
+        printf("  batch [capacity_mb] [batch sizes...]  ft_cache_get vs ft_cache_get_many, default 16..128\n");
+        printf("  read [sizes...]  lazyfree_read by copy function, default 8 256 4096\n");
+        printf("  backend [call_us] [key_ns]  misses against a backend with per-call overhead, default 20 200\n");
+        return 1;
+    }
+
+    random_rotate();
+    refill_ctx.seed = random_next();
+
+    if (strcmp(argv[1], "index") == 0) {
+        suite_index(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "threads") == 0) {
+        suite_threads(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "chunks") == 0) {
+        suite_chunks(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "residency") == 0) {
+        suite_residency(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "ops") == 0) {
+        suite_ops(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "faults") == 0) {
+        suite_faults(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        suite_batch(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "read") == 0) {
+        suite_read(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "backend") == 0) {
+        suite_backend(argc - 2, argv + 2);
+    } else {
+        printf("Unknown suite: %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -1,3 +1,6 @@
+// Checks stay on in release builds
+#undef NDEBUG
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -8,10 +11,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "cache.h"
 #include "fallthrough_cache.h"
 #include "lazyfree_cache.h"
+#include "pressure_monitor.h"
+#include "refill_engine.h"
 
 #include "util.h"
 #include "random.h"
@@ -148,6 +154,301 @@ void suite_lazyfree(size_t memory_size, bool full) {
     ft_cache_destroy(&cache);
 }
 
+// Reclaim of MADV_FREE huge pages splits them, values must stay correct.
+void suite_huge(size_t memory_size) {
+    size_t set_size = get_set_size(memory_size);
+    struct lazyfree_impl impl = lazyfree_impl();
+    impl.config.huge_pages = true;
+    ft_cache_t cache;
+    ft_cache_init(&cache, impl, refill_cb, NULL, set_size/PAGE_SIZE, sizeof(uint64_t));
+
+    run_smoke_test(&cache);
+    float hitrate = check_hitrate(&cache, set_size);
+    if (hitrate < 0.7) {
+        printf("set_size=%zuMb hitrate=%.2f, expect >= 0.7\n", set_size/M, hitrate);
+        exit(1);
+    }
+
+    struct testlib_keyset keyset;
+    testlib_init_keyset(&keyset, set_size/PAGE_SIZE);
+    testlib_get_all(&cache, &keyset);
+    testlib_get_all(&cache, &keyset);
+    size_t huge_before = testlib_anon_huge_bytes();
+
+    testlib_reclaim_cache(set_size);
+    size_t huge_after = testlib_anon_huge_bytes();
+    hitrate = testlib_get_all(&cache, &keyset);
+    printf("anon_huge_pages=%zuMb before reclaim, %zuMb after, hitrate after=%.2f\n",
+           huge_before/M, huge_after/M, hitrate);
+    testlib_check_reclaimed(hitrate);
+
+    testlib_drop_all(&cache, &keyset);
+    testlib_free_keyset(&keyset);
+    ft_cache_destroy(&cache);
+}
+
+// ft_cache_get_many in windows that are not a multiple of FT_BATCH, returns hitrate.
+static float check_get_many(ft_cache_t *cache, size_t cnt) {
+    size_t window = FT_BATCH + FT_BATCH / 2 + 1;
+    uint64_t *keys = malloc(window * sizeof(uint64_t));
+    uint64_t *values = malloc(window * sizeof(uint64_t));
+    uint64_t first_key = random_next() + 999;
+    float hitrate = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        refill_ctx.count = 0;
+        refill_ctx.batches = 0;
+        size_t windows = 0;
+        for (size_t start = 0; start < cnt; start += window) {
+            size_t batch = cnt - start < window ? cnt - start : window;
+            windows += (batch + FT_BATCH - 1) / FT_BATCH;
+            for (size_t i = 0; i < batch; ++i) {
+                keys[i] = first_key + start + i;
+            }
+            ft_cache_get_many(cache, keys, batch, (uint8_t*) values);
+            for (size_t i = 0; i < batch; ++i) {
+                if (values[i] != refill_expected(keys[i])) {
+                    printf("Key %lu: Value %lu != expected %lu\n", keys[i], values[i], refill_expected(keys[i]));
+                    exit(1);
+                }
+            }
+        }
+        hitrate = ((float) cnt - (float) refill_ctx.count) / (float) cnt;
+        printf("get_many pass=%d hitrate=%.2f%% batches=%lu\n", pass, hitrate * 100, refill_ctx.batches);
+        // At most one batch refill per window
+        if (cache->refill_batch_cb != NULL && refill_ctx.batches > windows) {
+            printf("get_many batches=%lu > windows=%zu\n", refill_ctx.batches, windows);
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < cnt; ++i) {
+        ft_cache_drop(cache, first_key + i);
+    }
+    free(keys);
+    free(values);
+    return hitrate;
+}
+
+#define ASYNC_KEYS 512
+#define ASYNC_REFILL_US 200
+#define ASYNC_THREADS 8
+
+// Slow backend, so concurrent misses overlap.
+static void refill_slow_cb(void *opaque, uint64_t key, uint8_t *value) {
+    usleep(ASYNC_REFILL_US);
+    refill_cb(opaque, key, value);
+}
+
+static void refill_slow_batch_cb(void *opaque, const uint64_t *keys, size_t count, uint8_t *values) {
+    usleep(ASYNC_REFILL_US);
+    refill_batch_cb(opaque, keys, count, values);
+}
+
+struct async_ctx {
+    struct refill_engine *engine;
+    uint64_t first_key;
+    uint64_t seed;
+    size_t completed;
+};
+
+static void* run_async_gets(void *opaque) {
+    struct async_ctx *ctx = opaque;
+    for (size_t i = 0; i < ASYNC_KEYS; ++i) {
+        uint64_t key = ctx->first_key + random_next_r(&ctx->seed) % ASYNC_KEYS;
+        uint64_t value;
+        refill_engine_get_sync(ctx->engine, key, (uint8_t*) &value);
+        if (value != refill_expected(key)) {
+            printf("Key %lu: Value %lu != expected %lu\n", key, value, refill_expected(key));
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void async_done(void *opaque, uint64_t key, uint8_t *value) {
+    struct async_ctx *ctx = opaque;
+    if (*(uint64_t*) value != refill_expected(key)) {
+        printf("Key %lu: Value %lu != expected %lu\n", key, *(uint64_t*) value, refill_expected(key));
+        exit(1);
+    }
+    __atomic_fetch_add(&ctx->completed, 1, __ATOMIC_RELAXED);
+}
+
+// Gets the same keys twice while they are in flight, returns the stats of it.
+static struct refill_stats check_async_callbacks(struct refill_engine *engine, uint64_t first_key) {
+    struct refill_stats before = refill_engine_stats(engine);
+    struct async_ctx async = { .engine = engine };
+    uint64_t *values = malloc(2 * ASYNC_KEYS * sizeof(uint64_t));
+    size_t hits = 0;
+    for (size_t i = 0; i < 2 * ASYNC_KEYS; ++i) {
+        uint64_t key = first_key + i % ASYNC_KEYS;
+        if (refill_engine_get(engine, key, (uint8_t*) &values[i], async_done, &async)) {
+            hits++;
+            async_done(&async, key, (uint8_t*) &values[i]);
+        }
+    }
+    while (__atomic_load_n(&async.completed, __ATOMIC_RELAXED) < 2 * ASYNC_KEYS) {
+        usleep(1000);
+    }
+    free(values);
+
+    struct refill_stats stats = refill_engine_stats(engine);
+    stats.refills -= before.refills;
+    stats.joined -= before.joined;
+    stats.batches -= before.batches;
+    printf("async hits=%zu refills=%lu joined=%lu batches=%lu\n", hits, stats.refills, stats.joined, stats.batches);
+    assert(stats.refills == ASYNC_KEYS);
+    return stats;
+}
+
+// Concurrent misses of one key share a refill.
+void suite_async(size_t memory_size) {
+    struct lazyfree_impl impl = lazyfree_sharded_impl();
+    size_t set_size = get_set_size(memory_size);
+    ft_cache_t cache;
+    ft_cache_init(&cache, impl, refill_slow_cb, NULL, set_size/PAGE_SIZE, sizeof(uint64_t));
+    struct refill_engine *engine = refill_engine_new(&cache, (struct refill_config){0});
+    refill_ctx.count = 0;
+
+    pthread_t threads[ASYNC_THREADS];
+    struct async_ctx ctx[ASYNC_THREADS];
+    uint64_t first_key = random_next() + 999;
+    for (size_t i = 0; i < ASYNC_THREADS; ++i) {
+        ctx[i] = (struct async_ctx){ .engine = engine, .first_key = first_key, .seed = random_next() };
+        pthread_create(&threads[i], NULL, run_async_gets, &ctx[i]);
+    }
+    for (size_t i = 0; i < ASYNC_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    struct refill_stats stats = refill_engine_stats(engine);
+    printf("threads=%d requests=%lu hits=%lu refills=%lu joined=%lu\n", ASYNC_THREADS,
+           stats.requests, stats.hits, stats.refills, stats.joined);
+    // Every key is refilled at most once, the cache holds them all
+    if (stats.refills > ASYNC_KEYS || refill_ctx.count != stats.refills ||
+        stats.requests != stats.hits + stats.refills + stats.joined) {
+        printf("Expected at most one refill per key\n");
+        exit(1);
+    }
+
+    check_async_callbacks(engine, first_key + ASYNC_KEYS);
+    refill_engine_free(engine);
+
+    // Queued misses are fetched together
+    ft_cache_set_refill_batch(&cache, refill_slow_batch_cb);
+    engine = refill_engine_new(&cache, (struct refill_config){0});
+    stats = check_async_callbacks(engine, first_key + 2 * ASYNC_KEYS);
+    if (stats.batches >= stats.refills) {
+        printf("Expected fewer batches than refills\n");
+        exit(1);
+    }
+    refill_engine_free(engine);
+    ft_cache_destroy(&cache);
+}
+
+// Small entries share slab pages, the same memory holds many times more of them.
+void suite_slab(size_t memory_size) {
+    size_t pages = get_set_size(memory_size) / PAGE_SIZE / 16;
+    size_t slots = ft_slab_slots(sizeof(uint64_t));
+    assert(slots == (PAGE_SIZE - FT_SLAB_DIRECTORY) / 64);
+    struct lazyfree_impl impl = lazyfree_impl();
+    ft_cache_t cache;
+    ft_cache_init_slab(&cache, impl, refill_cb, NULL, pages*slots, sizeof(uint64_t));
+    assert(cache.impl.stats(cache.cache).total_pages <= pages);
+
+    run_smoke_test(&cache);
+    if (check_get_many(&cache, pages*slots/2) < 0.9) {
+        printf("get_many hitrate must be >= 0.9\n");
+        exit(1);
+    }
+    ft_cache_set_refill_batch(&cache, refill_batch_cb);
+    if (check_get_many(&cache, pages*slots/2) < 0.9) {
+        printf("get_many hitrate with batch refills must be >= 0.9\n");
+        exit(1);
+    }
+    ft_cache_set_refill_batch(&cache, NULL);
+    // One key per PAGE_SIZE of size
+    float hitrate = check_hitrate(&cache, pages*slots*PAGE_SIZE);
+    if (hitrate < 0.7) {
+        printf("entries=%zuK hitrate=%.2f, expect >= 0.7\n", pages*slots/K, hitrate);
+        exit(1);
+    }
+
+    // Reclaimed pages lose all their entries, the others stay correct
+    struct testlib_keyset keyset;
+    testlib_init_keyset(&keyset, pages*slots);
+    testlib_get_all(&cache, &keyset);
+    testlib_get_all(&cache, &keyset);
+    testlib_reclaim_cache(pages*PAGE_SIZE);
+    testlib_check_reclaimed(testlib_get_all(&cache, &keyset));
+    ft_cache_debug(&cache, false);
+
+    testlib_drop_all(&cache, &keyset);
+    testlib_free_keyset(&keyset);
+    ft_cache_destroy(&cache);
+}
+
+// Three pages and a bit, every byte depends on the key.
+#define LARGE_ENTRY_SIZE (3*PAGE_SIZE + 100)
+
+static void refill_large_cb(void* opaque, uint64_t key, uint8_t *value) {
+    UNUSED(opaque);
+    __atomic_fetch_add(&refill_ctx.count, 1, __ATOMIC_RELAXED);
+    uint64_t state = refill_expected(key);
+    for (size_t i = 0; i < LARGE_ENTRY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word = random_mix(&state);
+        memcpy(value + i, &word, LARGE_ENTRY_SIZE - i < sizeof(word) ? LARGE_ENTRY_SIZE - i : sizeof(word));
+    }
+}
+
+// Returns hitrate, exits if any value is wrong.
+static float get_all_large(ft_cache_t *cache, uint64_t first_key, size_t cnt) {
+    uint8_t *value = malloc(LARGE_ENTRY_SIZE);
+    uint8_t *expected = malloc(LARGE_ENTRY_SIZE);
+    refill_ctx.count = 0;
+    for (size_t i = 0; i < cnt; ++i) {
+        ft_cache_get(cache, first_key + i, value);
+        uint64_t count = refill_ctx.count;
+        refill_large_cb(NULL, first_key + i, expected);
+        refill_ctx.count = count;
+        if (memcmp(value, expected, LARGE_ENTRY_SIZE) != 0) {
+            printf("Key %lu: large value differs\n", first_key + i);
+            exit(1);
+        }
+    }
+    free(value);
+    free(expected);
+    float hitrate = ((float) cnt - (float) refill_ctx.count) / (float) cnt;
+    printf("size=%zuMb hitrate=%.2f%%\n", cnt * LARGE_ENTRY_SIZE / M, hitrate * 100);
+    return hitrate;
+}
+
+// Multi-page entries, values must stay whole after a partial reclaim.
+void suite_large(size_t memory_size) {
+    size_t set_size = get_set_size(memory_size);
+    size_t entries = set_size / PAGE_SIZE / lazyfree_entry_pages(LARGE_ENTRY_SIZE);
+    struct lazyfree_impl impl = lazyfree_impl();
+    ft_cache_t cache;
+    ft_cache_init(&cache, impl, refill_large_cb, NULL, entries, LARGE_ENTRY_SIZE);
+    assert(cache.entry_pages == 4);
+
+    uint64_t first_key = random_next() + 999;
+    float hitrate = get_all_large(&cache, first_key, entries);
+    assert(hitrate == 0);
+    hitrate = get_all_large(&cache, first_key, entries);
+    if (hitrate < 0.7) {
+        printf("set_size=%zuMb hitrate=%.2f, expect >= 0.7\n", set_size/M, hitrate);
+        exit(1);
+    }
+
+    testlib_reclaim_cache(set_size);
+    testlib_check_reclaimed(get_all_large(&cache, first_key, entries));
+    ft_cache_debug(&cache, false);
+
+    for (size_t i = 0; i < entries; ++i) {
+        ft_cache_drop(&cache, first_key + i);
+    }
+    ft_cache_destroy(&cache);
+}
+
 void suite_anon(size_t memory_size) {
     struct lazyfree_impl impl = lazyfree_anon_impl();   
     size_t set_size = get_set_size(memory_size);
@@ -157,6 +458,16 @@ void suite_anon(size_t memory_size) {
 
     run_smoke_test(&cache);    
 
+    if (check_get_many(&cache, set_size/PAGE_SIZE) < 1) {
+        printf("get_many hitrate must be 1\n");
+        exit(1);
+    }
+    ft_cache_set_refill_batch(&cache, refill_batch_cb);
+    if (check_get_many(&cache, set_size/PAGE_SIZE) < 1) {
+        printf("get_many hitrate with batch refills must be 1\n");
+        exit(1);
+    }
+    ft_cache_set_refill_batch(&cache, NULL);
     float hitrate = check_hitrate(&cache, set_size);
     if (hitrate < 1) {
         printf("set_size=%zuMb hitrate=%.2f, expect >= 1\n", set_size/M, hitrate);
@@ -179,6 +490,205 @@ void suite_disk(size_t memory_size) {
     ft_cache_destroy(&cache);
 }
 
+#define POLICY_ROUNDS 16
+
+// Hot set is 1/8 of the cache and read between scans of fresh cold keys.
+// Returns hot hitrate over all rounds.
+static float run_policy_scan(enum lazyfree_policy policy, bool evacuate_hot, size_t set_size) {
+    struct lazyfree_impl impl = lazyfree_anon_impl();
+    impl.config.policy = policy;
+    impl.config.evacuate_hot = evacuate_hot;
+    ft_cache_t cache;
+    ft_cache_init(&cache, impl, refill_cb, NULL, set_size/PAGE_SIZE, sizeof(uint64_t));
+
+    run_smoke_test(&cache);
+
+    struct testlib_keyset hot_set;
+    testlib_init_keyset(&hot_set, set_size/PAGE_SIZE/8);
+    for (int i = 0; i < 4; ++i) {
+        testlib_get_all(&cache, &hot_set);
+    }
+
+    float hot_hitrate = 0;
+    for (int round = 0; round < POLICY_ROUNDS; ++round) {
+        struct testlib_keyset cold_set;
+        testlib_init_keyset(&cold_set, set_size/PAGE_SIZE/4);
+        testlib_get_all(&cache, &cold_set);
+        testlib_free_keyset(&cold_set);
+
+        hot_hitrate += testlib_get_all(&cache, &hot_set);
+    }
+    testlib_free_keyset(&hot_set);
+    ft_cache_destroy(&cache);
+    return hot_hitrate / POLICY_ROUNDS;
+}
+
+void suite_policies(size_t memory_size) {
+    size_t set_size = get_set_size(memory_size);
+    bool verbose = testlib_verbose;
+    testlib_verbose = false;
+
+    float hitrates[LAZYFREE_POLICY_COUNT];
+    for (size_t i = 0; i < LAZYFREE_POLICY_COUNT; ++i) {
+        hitrates[i] = run_policy_scan(i, false, set_size);
+        printf("policy=%-6s hot_hitrate=%.2f%%\n", testlib_policy_names[i], hitrates[i] * 100);
+    }
+    float evacuate_hitrate = run_policy_scan(LAZYFREE_POLICY_FIFO, true, set_size);
+    printf("policy=%-6s evacuate_hot hot_hitrate=%.2f%%\n", "fifo", evacuate_hitrate * 100);
+    testlib_verbose = verbose;
+
+    // Hot pages are moved out of the victim chunk instead of being refilled
+    if (evacuate_hitrate < hitrates[LAZYFREE_POLICY_FIFO]) {
+        printf("Evacuation must not lower FIFO hot hitrate\n");
+        exit(1);
+    }
+
+    // Frequency aware policies keep the hot chunks through the scans
+    if (hitrates[LAZYFREE_POLICY_LFU] < hitrates[LAZYFREE_POLICY_FIFO] ||
+        hitrates[LAZYFREE_POLICY_CLOCK] < hitrates[LAZYFREE_POLICY_FIFO]) {
+        printf("LFU and CLOCK hot hitrate must be at least FIFO hot hitrate\n");
+        exit(1);
+    }
+}
+
+#define THREADS_CNT 4
+#define THREAD_GETS (256*K)
+
+struct thread_ctx {
+    ft_cache_t *cache;
+    size_t keys_cnt;
+    uint64_t seed;
+};
+
+static void* run_thread_gets(void* opaque) {
+    struct thread_ctx *ctx = opaque;
+    for (size_t i = 0; i < THREAD_GETS; ++i) {
+        uint64_t key = 1 + random_next_r(&ctx->seed) % ctx->keys_cnt;
+        uint64_t value;
+        ft_cache_get(ctx->cache, key, (uint8_t*) &value);
+        if (value != refill_expected(key)) {
+            printf("Key %lu: Value %lu != expected %lu\n", key, value, refill_expected(key));
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+void suite_sharded(size_t memory_size, bool optimistic_reads) {
+    struct lazyfree_impl impl = lazyfree_sharded_impl();
+    impl.config.optimistic_reads = optimistic_reads;
+    impl.config.residency_check = optimistic_reads;
+    impl.config.maintenance_thread = optimistic_reads;
+    impl.config.scrub_interval_ms = 50;
+    size_t set_size = get_set_size(memory_size);
+    impl.config.max_capacity = set_size;
+    ft_cache_t cache;
+
+    ft_cache_init(&cache, impl, refill_cb, NULL, set_size/PAGE_SIZE, sizeof(uint64_t));
+
+    run_smoke_test(&cache);
+
+    float hitrate = check_hitrate(&cache, set_size);
+    if (hitrate < 0.7) {
+        printf("set_size=%zuMb hitrate=%.2f, expect >= 0.7\n", set_size/M, hitrate);
+        exit(1);
+    }
+
+    // Overlapping keys from several threads, 2x the capacity to force evictions
+    pthread_t threads[THREADS_CNT];
+    struct thread_ctx ctx[THREADS_CNT];
+    for (size_t i = 0; i < THREADS_CNT; ++i) {
+        ctx[i] = (struct thread_ctx){
+            .cache = &cache,
+            .keys_cnt = 2*set_size/PAGE_SIZE,
+            .seed = random_next(),
+        };
+        pthread_create(&threads[i], NULL, run_thread_gets, &ctx[i]);
+    }
+    // Shrink and grow back while threads are running
+    for (int i = 0; i < 4; ++i) {
+        bool ok = ft_cache_resize(&cache, set_size/PAGE_SIZE/2);
+        ok &= ft_cache_resize(&cache, set_size/PAGE_SIZE);
+        assert(ok);
+    }
+    for (size_t i = 0; i < THREADS_CNT; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("threads=%d gets=%zuK ok\n", THREADS_CNT, THREADS_CNT*THREAD_GETS/K);
+
+    // Counters of concurrent readers are not lost while there are free slots
+    ft_cache_debug(&cache, false);
+    struct lazyfree_stats stats = cache.impl.stats(cache.cache);
+    if (stats.lookups < THREADS_CNT*THREAD_GETS || stats.hits > stats.lookups) {
+        printf("lookups=%lu hits=%lu, expect lookups >= %zu\n",
+               stats.lookups, stats.hits, (size_t) THREADS_CNT*THREAD_GETS);
+        exit(1);
+    }
+
+    ft_cache_destroy(&cache);
+}
+
+static void expect_update(struct pressure_monitor *monitor, bool pressure, double now, bool changed) {
+    if (pressure_monitor_update(monitor, pressure, now) != changed) {
+        printf("pressure=%d at %.0fms: expected changed=%d\n", pressure, now, changed);
+        exit(1);
+    }
+}
+
+void suite_pressure(size_t memory_size) {
+    struct lazyfree_impl impl = lazyfree_sharded_impl();
+    size_t set_size = get_set_size(memory_size);
+    size_t capacity = set_size/PAGE_SIZE;
+    impl.config.max_capacity = set_size;
+    ft_cache_t cache;
+
+    ft_cache_init(&cache, impl, refill_cb, NULL, capacity, sizeof(uint64_t));
+    run_smoke_test(&cache);
+
+    struct pressure_config config = {
+        .window_us = 1000000,
+        .relax_ms = 5000,
+        .steps = 4,
+        .min_steps = 2,
+    };
+    struct pressure_monitor *monitor = pressure_monitor_new(&cache, config);
+    struct pressure_stats stats = pressure_monitor_stats(monitor);
+    printf("psi=%d psi_trigger=%d cgroup=%d\n", stats.psi, stats.psi_trigger, stats.cgroup);
+
+    // Fake clock: one step per window, never below min_steps
+    double now = 1e12;
+    expect_update(monitor, true, now, true);
+    expect_update(monitor, true, now + 500, false);
+    expect_update(monitor, true, now + 1000, true);
+    expect_update(monitor, true, now + 1500, false);
+    stats = pressure_monitor_stats(monitor);
+    assert(stats.capacity == capacity - 2 * (capacity / 4));
+    assert(cache.capacity == stats.capacity);
+    assert(stats.shrinks == 2);
+
+    float hitrate = check_hitrate(&cache, set_size / 2);
+    printf("shrunk capacity=%zu hitrate=%.2f\n", stats.capacity, hitrate);
+
+    // Grows back after relax_ms without pressure
+    expect_update(monitor, false, now + 5000, false);
+    expect_update(monitor, false, now + 7000, true);
+    expect_update(monitor, false, now + 8000, false);
+    expect_update(monitor, false, now + 12000, true);
+    stats = pressure_monitor_stats(monitor);
+    assert(stats.capacity == capacity);
+    assert(stats.grows == 2);
+    pressure_monitor_free(monitor);
+
+    // Real sources from a background thread while serving
+    monitor = pressure_monitor_new(&cache, (struct pressure_config){0});
+    pressure_monitor_start(monitor);
+    hitrate = check_hitrate(&cache, set_size);
+    pressure_monitor_free(monitor);
+    printf("background monitor hitrate=%.2f ok\n", hitrate);
+
+    ft_cache_destroy(&cache);
+}
+
 
 int main(int argc, char **argv) {
     testlib_verbose = true;
@@ -187,7 +697,7 @@ int main(int argc, char **argv) {
 
     if (argc < 3) {
         printf("Usage: %s <suite> <memory_size_gb>\n", argv[0]);       
-        printf("Suites: lazyfree, lazyfree_full, anon, disk\n");
+        printf("Suites: lazyfree, lazyfree_full, anon, disk, sharded, sharded_optimistic, policies, pressure, huge, async, slab, large\n");
         return 1;
     }
     size_t memory_size_gb = atoll(argv[2]);
@@ -211,6 +721,22 @@ int main(int argc, char **argv) {
         suite_anon(memory_size);
     } else if (strcmp(argv[1], "disk") == 0) {
         suite_disk(memory_size);
+    } else if (strcmp(argv[1], "sharded") == 0) {
+        suite_sharded(memory_size, false);
+    } else if (strcmp(argv[1], "sharded_optimistic") == 0) {
+        suite_sharded(memory_size, true);
+    } else if (strcmp(argv[1], "policies") == 0) {
+        suite_policies(memory_size);
+    } else if (strcmp(argv[1], "huge") == 0) {
+        suite_huge(memory_size);
+    } else if (strcmp(argv[1], "async") == 0) {
+        suite_async(memory_size);
+    } else if (strcmp(argv[1], "slab") == 0) {
+        suite_slab(memory_size);
+    } else if (strcmp(argv[1], "large") == 0) {
+        suite_large(memory_size);
+    } else if (strcmp(argv[1], "pressure") == 0) {
+        suite_pressure(memory_size);
     } else {
         printf("Unknown suite: %s\n", argv[1]);
         return 1;
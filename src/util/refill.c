@@ -9,9 +9,17 @@ uint64_t refill_expected(uint64_t key) {
     return refill_ctx.seed + key;
 }
 
+void refill_batch_cb(void* opaque, const uint64_t *keys, size_t count, uint8_t *values) {
+    UNUSED(opaque);
+    __atomic_fetch_add(&refill_ctx.batches, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < count; ++i) {
+        refill_cb(NULL, keys[i], values + i * sizeof(uint64_t));
+    }
+}
+
 void refill_cb(void* opaque, uint64_t key, uint8_t *value) {
     UNUSED(opaque);
-    refill_ctx.count++;
+    __atomic_fetch_add(&refill_ctx.count, 1, __ATOMIC_RELAXED);
     uint64_t *real_value = (uint64_t*) value;
 
     *real_value = refill_ctx.seed + key; // Value depends on the seed and the key